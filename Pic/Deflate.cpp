@@ -0,0 +1,1594 @@
+#include <Pic/Deflate.hpp>
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIC_DEFLATE_X86_SIMD
+#include <immintrin.h>
+#endif // defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+namespace pic
+{
+
+using namespace stick;
+
+static const Int32 s_windowSize = 32768;
+static const Int32 s_windowMask = s_windowSize - 1;
+static const Int32 s_hashBits = 15;
+static const Int32 s_hashSize = 1 << s_hashBits;
+static const Int32 s_minMatch = 3;
+static const Int32 s_maxMatch = 258;
+// symbols collected before a block is written. Bigger blocks amortize the dynamic huffman header.
+static const Int32 s_maxBlockSymbols = 32768;
+static const Int32 s_maxStoredBlockSize = 65535;
+
+static const Int32 s_literalCount = 286;
+static const Int32 s_distanceCount = 30;
+static const Int32 s_codeLengthCount = 19;
+static const Int32 s_endOfBlock = 256;
+
+static const UInt16 s_lengthBase[29] = { 3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                                         15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                                         67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const UInt8 s_lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                         2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const UInt16 s_distanceBase[30] = { 1,    2,    3,    4,    5,    7,     9,     13,
+                                           17,   25,   33,   49,   65,   97,    129,   193,
+                                           257,  385,  513,  769,  1025, 1537,  2049,  3073,
+                                           4097, 6145, 8193, 12289, 16385, 24577 };
+static const UInt8 s_distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                           6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const UInt8 s_codeLengthOrder[s_codeLengthCount] = { 16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                                            11, 4,  12, 3, 13, 2, 14, 1, 15 };
+
+// maps match lengths and distances to their deflate symbols
+struct SymbolTables
+{
+    SymbolTables()
+    {
+        for (Int32 i = 0; i < 29; ++i)
+        {
+            Int32 end = i == 28 ? 259 : s_lengthBase[i + 1];
+            for (Int32 len = s_lengthBase[i]; len < end; ++len)
+                lengthSymbol[len] = (UInt8)i;
+        }
+        // a length of 258 has its own symbol without extra bits
+        lengthSymbol[258] = 28;
+
+        for (Int32 i = 0; i < 30; ++i)
+        {
+            Int32 end = i == 29 ? s_windowSize + 1 : s_distanceBase[i + 1];
+            for (Int32 dist = s_distanceBase[i]; dist < end; ++dist)
+                distanceSymbol[dist] = (UInt8)i;
+        }
+    }
+
+    UInt8 lengthSymbol[s_maxMatch + 1];
+    UInt8 distanceSymbol[s_windowSize + 1];
+};
+
+static const SymbolTables & symbolTables()
+{
+    static SymbolTables s_tables;
+    return s_tables;
+}
+
+// a literal if distance is 0, a match otherwise
+struct Symbol
+{
+    UInt16 literalOrLength;
+    UInt16 distance;
+};
+
+struct BitWriter
+{
+    UInt8 * out;
+    UInt64 bits;
+    Int32 count;
+
+    void put(UInt32 _value, Int32 _bitCount)
+    {
+        bits |= (UInt64)_value << count;
+        count += _bitCount;
+        if (count >= 32)
+        {
+            out[0] = (UInt8)bits;
+            out[1] = (UInt8)(bits >> 8);
+            out[2] = (UInt8)(bits >> 16);
+            out[3] = (UInt8)(bits >> 24);
+            out += 4;
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    // writes out all pending bits, padding the last byte with zeros
+    void alignToByte()
+    {
+        while (count > 0)
+        {
+            *out++ = (UInt8)bits;
+            bits >>= 8;
+            count -= 8;
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+static UInt32 reverseBits(UInt32 _code, Int32 _length)
+{
+    UInt32 ret = 0;
+    for (Int32 i = 0; i < _length; ++i, _code >>= 1)
+        ret = (ret << 1) | (_code & 1);
+    return ret;
+}
+
+// Computes huffman code lengths of at most _maxLength bits. Lengths that come out too long are
+// redistributed the way miniz does it, which keeps the code complete.
+static void buildCodeLengths(const UInt32 * _freqs,
+                             Int32 _count,
+                             Int32 _maxLength,
+                             UInt8 * _outLengths)
+{
+    Int32 leaves[s_literalCount];
+    Int32 leafCount = 0;
+    for (Int32 i = 0; i < _count; ++i)
+    {
+        _outLengths[i] = 0;
+        if (_freqs[i])
+            leaves[leafCount++] = i;
+    }
+    if (leafCount == 0)
+        return;
+    if (leafCount == 1)
+    {
+        _outLengths[leaves[0]] = 1;
+        return;
+    }
+
+    std::sort(leaves, leaves + leafCount, [&](Int32 _a, Int32 _b) {
+        return _freqs[_a] < _freqs[_b] || (_freqs[_a] == _freqs[_b] && _a < _b);
+    });
+
+    // two queue huffman construction. Nodes 0 - leafCount-1 are the sorted leaves, internal nodes
+    // follow in the order they are created, so their weights are ascending, too.
+    UInt64 weights[s_literalCount * 2];
+    Int32 parents[s_literalCount * 2];
+    for (Int32 i = 0; i < leafCount; ++i)
+        weights[i] = _freqs[leaves[i]];
+
+    Int32 nextLeaf = 0;
+    Int32 nextInternal = leafCount;
+    Int32 nodeCount = leafCount;
+    auto takeSmallest = [&]() {
+        if (nextLeaf < leafCount &&
+            (nextInternal >= nodeCount || weights[nextLeaf] <= weights[nextInternal]))
+            return nextLeaf++;
+        return nextInternal++;
+    };
+    while (nodeCount < leafCount * 2 - 1)
+    {
+        Int32 a = takeSmallest();
+        Int32 b = takeSmallest();
+        weights[nodeCount] = weights[a] + weights[b];
+        parents[a] = parents[b] = nodeCount;
+        ++nodeCount;
+    }
+
+    // the depth of every node, from the root down
+    Int32 depths[s_literalCount * 2];
+    depths[nodeCount - 1] = 0;
+    for (Int32 i = nodeCount - 2; i >= 0; --i)
+        depths[i] = depths[parents[i]] + 1;
+
+    Int32 lengthCounts[16] = { 0 };
+    for (Int32 i = 0; i < leafCount; ++i)
+        ++lengthCounts[std::min(depths[i], _maxLength)];
+
+    UInt32 total = 0;
+    for (Int32 i = 1; i <= _maxLength; ++i)
+        total += (UInt32)lengthCounts[i] << (_maxLength - i);
+    while (total != (1u << _maxLength))
+    {
+        --lengthCounts[_maxLength];
+        for (Int32 i = _maxLength - 1; i > 0; --i)
+        {
+            if (lengthCounts[i])
+            {
+                --lengthCounts[i];
+                lengthCounts[i + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+
+    // the least frequent symbols get the longest codes
+    Int32 leaf = 0;
+    for (Int32 len = _maxLength; len > 0; --len)
+        for (Int32 i = 0; i < lengthCounts[len]; ++i)
+            _outLengths[leaves[leaf++]] = (UInt8)len;
+}
+
+static void buildCodes(const UInt8 * _lengths, Int32 _count, UInt16 * _outCodes)
+{
+    Int32 lengthCounts[16] = { 0 };
+    for (Int32 i = 0; i < _count; ++i)
+        ++lengthCounts[_lengths[i]];
+    lengthCounts[0] = 0;
+
+    UInt32 nextCode[16];
+    UInt32 code = 0;
+    for (Int32 bits = 1; bits < 16; ++bits)
+    {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    // deflate writes huffman codes starting with the most significant bit
+    for (Int32 i = 0; i < _count; ++i)
+        if (_lengths[i])
+            _outCodes[i] = (UInt16)reverseBits(nextCode[_lengths[i]]++, _lengths[i]);
+}
+
+// a block's huffman codes, either the fixed ones or dynamic ones including their header
+struct BlockCodes
+{
+    UInt8 literalLengths[s_literalCount];
+    UInt16 literalCodes[s_literalCount];
+    UInt8 distanceLengths[s_distanceCount];
+    UInt16 distanceCodes[s_distanceCount];
+
+    // the dynamic block header
+    Int32 literalCount;
+    Int32 distanceCount;
+    Int32 codeLengthCount;
+    UInt8 codeLengthLengths[s_codeLengthCount];
+    UInt16 codeLengthCodes[s_codeLengthCount];
+    // the run length encoded code lengths, symbol in the low byte and extra bits in the high byte
+    UInt16 runs[s_literalCount + s_distanceCount];
+    Int32 runCount;
+};
+
+static void makeFixedCodes(BlockCodes & _codes)
+{
+    // the fixed code has two more (unused) literal codes that shift the 9 bit codes
+    UInt8 literalLengths[288];
+    UInt16 literalCodes[288];
+    for (Int32 i = 0; i < 288; ++i)
+        literalLengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    buildCodes(literalLengths, 288, literalCodes);
+    memcpy(_codes.literalLengths, literalLengths, sizeof(_codes.literalLengths));
+    memcpy(_codes.literalCodes, literalCodes, sizeof(_codes.literalCodes));
+
+    for (Int32 i = 0; i < s_distanceCount; ++i)
+        _codes.distanceLengths[i] = 5;
+    buildCodes(_codes.distanceLengths, s_distanceCount, _codes.distanceCodes);
+}
+
+// builds dynamic codes for the frequencies and returns the size of the block header in bits
+static UInt64 makeDynamicCodes(const UInt32 * _literalFreqs,
+                               const UInt32 * _distanceFreqs,
+                               BlockCodes & _codes)
+{
+    // some inflaters reject incomplete codes, so make sure both codes have at least two symbols
+    UInt32 literalFreqs[s_literalCount];
+    UInt32 distanceFreqs[s_distanceCount];
+    memcpy(literalFreqs, _literalFreqs, sizeof(literalFreqs));
+    memcpy(distanceFreqs, _distanceFreqs, sizeof(distanceFreqs));
+    auto ensureTwoSymbols = [](UInt32 * _freqs, Int32 _count) {
+        Int32 used = 0;
+        for (Int32 i = 0; i < _count; ++i)
+            used += _freqs[i] != 0;
+        for (Int32 i = 0; i < _count && used < 2; ++i)
+        {
+            if (!_freqs[i])
+            {
+                _freqs[i] = 1;
+                ++used;
+            }
+        }
+    };
+    ensureTwoSymbols(literalFreqs, s_literalCount);
+    ensureTwoSymbols(distanceFreqs, s_distanceCount);
+
+    buildCodeLengths(literalFreqs, s_literalCount, 15, _codes.literalLengths);
+    buildCodeLengths(distanceFreqs, s_distanceCount, 15, _codes.distanceLengths);
+    buildCodes(_codes.literalLengths, s_literalCount, _codes.literalCodes);
+    buildCodes(_codes.distanceLengths, s_distanceCount, _codes.distanceCodes);
+
+    _codes.literalCount = s_literalCount;
+    while (_codes.literalCount > 257 && !_codes.literalLengths[_codes.literalCount - 1])
+        --_codes.literalCount;
+    _codes.distanceCount = s_distanceCount;
+    while (_codes.distanceCount > 1 && !_codes.distanceLengths[_codes.distanceCount - 1])
+        --_codes.distanceCount;
+
+    // run length encode the literal and distance code lengths as one sequence
+    UInt8 lengths[s_literalCount + s_distanceCount];
+    Int32 total = _codes.literalCount + _codes.distanceCount;
+    memcpy(lengths, _codes.literalLengths, _codes.literalCount);
+    memcpy(lengths + _codes.literalCount, _codes.distanceLengths, _codes.distanceCount);
+
+    UInt32 codeLengthFreqs[s_codeLengthCount] = { 0 };
+    _codes.runCount = 0;
+    auto addRun = [&](UInt32 _symbol, UInt32 _extra) {
+        _codes.runs[_codes.runCount++] = (UInt16)(_symbol | (_extra << 8));
+        ++codeLengthFreqs[_symbol];
+    };
+    for (Int32 i = 0; i < total;)
+    {
+        UInt8 len = lengths[i];
+        Int32 run = 1;
+        while (i + run < total && lengths[i + run] == len)
+            ++run;
+        i += run;
+
+        if (len == 0)
+        {
+            while (run >= 11)
+            {
+                Int32 n = std::min(run, 138);
+                addRun(18, n - 11);
+                run -= n;
+            }
+            if (run >= 3)
+            {
+                addRun(17, run - 3);
+                run = 0;
+            }
+        }
+        else
+        {
+            addRun(len, 0);
+            --run;
+            while (run >= 3)
+            {
+                Int32 n = std::min(run, 6);
+                addRun(16, n - 3);
+                run -= n;
+            }
+        }
+        for (; run > 0; --run)
+            addRun(len, 0);
+    }
+
+    buildCodeLengths(codeLengthFreqs, s_codeLengthCount, 7, _codes.codeLengthLengths);
+    buildCodes(_codes.codeLengthLengths, s_codeLengthCount, _codes.codeLengthCodes);
+    _codes.codeLengthCount = s_codeLengthCount;
+    while (_codes.codeLengthCount > 4 &&
+           !_codes.codeLengthLengths[s_codeLengthOrder[_codes.codeLengthCount - 1]])
+        --_codes.codeLengthCount;
+
+    UInt64 bits = 5 + 5 + 4 + 3 * _codes.codeLengthCount;
+    for (Int32 i = 0; i < s_codeLengthCount; ++i)
+        bits += (UInt64)codeLengthFreqs[i] * _codes.codeLengthLengths[i];
+    bits += (UInt64)codeLengthFreqs[16] * 2 + (UInt64)codeLengthFreqs[17] * 3 +
+            (UInt64)codeLengthFreqs[18] * 7;
+    return bits;
+}
+
+// the size of the block data in bits with the given codes
+static UInt64 blockDataBits(const UInt32 * _literalFreqs,
+                            const UInt32 * _distanceFreqs,
+                            const BlockCodes & _codes)
+{
+    UInt64 bits = 0;
+    for (Int32 i = 0; i < s_literalCount; ++i)
+    {
+        bits += (UInt64)_literalFreqs[i] * _codes.literalLengths[i];
+        if (i > s_endOfBlock)
+            bits += (UInt64)_literalFreqs[i] * s_lengthExtra[i - 257];
+    }
+    for (Int32 i = 0; i < s_distanceCount; ++i)
+        bits += (UInt64)_distanceFreqs[i] * (_codes.distanceLengths[i] + s_distanceExtra[i]);
+    return bits;
+}
+
+// the same trade offs zlib makes for each level
+struct LevelParameters
+{
+    // the most hash chain entries to look at for a match
+    Int32 maxChain;
+    // stop looking once a match is at least this long
+    Int32 niceLength;
+    // only look at a quarter of the chain if the match to beat is at least this long
+    Int32 goodLength;
+    // for greedy levels, how many positions of a match are added to the hash chains. For lazy
+    // levels, the longest match for which a better one is looked for at the next position.
+    Int32 lazyLength;
+    bool lazy;
+};
+
+static const LevelParameters s_levels[10] = {
+    { 0, 0, 0, 0, false },          { 4, 8, 4, 4, false },         { 8, 16, 4, 5, false },
+    { 32, 32, 4, 6, false },        { 16, 16, 4, 4, true },        { 32, 32, 8, 16, true },
+    { 128, 128, 8, 16, true },      { 256, 128, 8, 32, true },     { 1024, 258, 32, 128, true },
+    { 4096, 258, 32, 258, true }
+};
+
+struct Deflater
+{
+    const UInt8 * data;
+    Int32 byteCount;
+    LevelParameters params;
+
+    Int32 * head;
+    Int32 * prev;
+    Symbol * symbols;
+    Int32 symbolCount;
+    UInt32 literalFreqs[s_literalCount];
+    UInt32 distanceFreqs[s_distanceCount];
+
+    BitWriter writer;
+    BlockCodes dynamicCodes;
+    BlockCodes fixedCodes;
+
+    UInt32 hash(Int32 _pos) const
+    {
+        UInt32 v = data[_pos] | (data[_pos + 1] << 8) | (data[_pos + 2] << 16);
+        return (v * 2654435761u) >> (32 - s_hashBits);
+    }
+
+    // adds _pos to its hash chain and returns the previous head of the chain
+    Int32 insert(Int32 _pos)
+    {
+        UInt32 h = hash(_pos);
+        Int32 ret = head[h];
+        prev[_pos & s_windowMask] = ret;
+        head[h] = _pos;
+        return ret;
+    }
+
+    Int32 matchLength(Int32 _a, Int32 _b, Int32 _maxLength) const
+    {
+        Int32 len = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (len + 8 <= _maxLength)
+        {
+            UInt64 x, y;
+            memcpy(&x, data + _a + len, 8);
+            memcpy(&y, data + _b + len, 8);
+            UInt64 diff = x ^ y;
+            if (diff)
+                return len + (__builtin_ctzll(diff) >> 3);
+            len += 8;
+        }
+#endif // defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (len < _maxLength && data[_a + len] == data[_b + len])
+            ++len;
+        return len;
+    }
+
+    // walks the hash chain starting at _candidate for a match longer than _minLength
+    void findMatch(
+        Int32 _pos, Int32 _candidate, Int32 _minLength, Int32 & _outLength, Int32 & _outDist)
+    {
+        Int32 maxLength = std::min(s_maxMatch, byteCount - _pos);
+        Int32 best = _minLength;
+        _outLength = 0;
+        if (maxLength <= best)
+            return;
+
+        Int32 chain = best >= params.goodLength ? params.maxChain >> 2 : params.maxChain;
+        for (; _candidate >= 0 && chain > 0; --chain)
+        {
+            // older positions in the same window slot have been overwritten by newer ones
+            if (_pos - _candidate >= s_windowSize)
+                break;
+
+            if (data[_candidate + best] == data[_pos + best] && data[_candidate] == data[_pos])
+            {
+                Int32 len = matchLength(_candidate, _pos, maxLength);
+                if (len > best)
+                {
+                    best = len;
+                    _outLength = len;
+                    _outDist = _pos - _candidate;
+                    if (len >= params.niceLength || len == maxLength)
+                        break;
+                }
+            }
+
+            Int32 next = prev[_candidate & s_windowMask];
+            if (next >= _candidate)
+                break;
+            _candidate = next;
+        }
+    }
+
+    void addLiteral(UInt8 _value)
+    {
+        symbols[symbolCount++] = { _value, 0 };
+        ++literalFreqs[_value];
+    }
+
+    void addMatch(Int32 _length, Int32 _dist)
+    {
+        const SymbolTables & tables = symbolTables();
+        symbols[symbolCount++] = { (UInt16)_length, (UInt16)_dist };
+        ++literalFreqs[257 + tables.lengthSymbol[_length]];
+        ++distanceFreqs[tables.distanceSymbol[_dist]];
+    }
+
+    void writeStored(Int32 _start, Int32 _end, bool _final)
+    {
+        do
+        {
+            Int32 n = std::min(_end - _start, s_maxStoredBlockSize);
+            bool last = _start + n == _end;
+            writer.put(_final && last, 1);
+            writer.put(0, 2);
+            writer.alignToByte();
+            UInt8 * out = writer.out;
+            out[0] = (UInt8)n;
+            out[1] = (UInt8)(n >> 8);
+            out[2] = (UInt8)~n;
+            out[3] = (UInt8)(~n >> 8);
+            memcpy(out + 4, data + _start, n);
+            writer.out = out + 4 + n;
+            _start += n;
+        } while (_start < _end);
+    }
+
+    void writeSymbols(const BlockCodes & _codes)
+    {
+        const SymbolTables & tables = symbolTables();
+        for (Int32 i = 0; i < symbolCount; ++i)
+        {
+            const Symbol & sym = symbols[i];
+            if (!sym.distance)
+            {
+                writer.put(_codes.literalCodes[sym.literalOrLength],
+                           _codes.literalLengths[sym.literalOrLength]);
+                continue;
+            }
+
+            Int32 lengthSymbol = tables.lengthSymbol[sym.literalOrLength];
+            writer.put(_codes.literalCodes[257 + lengthSymbol],
+                       _codes.literalLengths[257 + lengthSymbol]);
+            if (s_lengthExtra[lengthSymbol])
+                writer.put(sym.literalOrLength - s_lengthBase[lengthSymbol],
+                           s_lengthExtra[lengthSymbol]);
+
+            Int32 distanceSymbol = tables.distanceSymbol[sym.distance];
+            writer.put(_codes.distanceCodes[distanceSymbol],
+                       _codes.distanceLengths[distanceSymbol]);
+            if (s_distanceExtra[distanceSymbol])
+                writer.put(sym.distance - s_distanceBase[distanceSymbol],
+                           s_distanceExtra[distanceSymbol]);
+        }
+        writer.put(_codes.literalCodes[s_endOfBlock], _codes.literalLengths[s_endOfBlock]);
+    }
+
+    // writes the collected symbols, which encode the input from _start to _end, with whichever of
+    // dynamic codes, fixed codes or no compression is the smallest
+    void writeBlock(Int32 _start, Int32 _end, bool _final)
+    {
+        ++literalFreqs[s_endOfBlock];
+
+        UInt64 dynamicBits = 3 + makeDynamicCodes(literalFreqs, distanceFreqs, dynamicCodes) +
+                             blockDataBits(literalFreqs, distanceFreqs, dynamicCodes);
+        UInt64 fixedBits = 3 + blockDataBits(literalFreqs, distanceFreqs, fixedCodes);
+        Int32 storedCount = std::max((_end - _start + s_maxStoredBlockSize - 1) /
+                                         s_maxStoredBlockSize,
+                                     1);
+        // the worst case, including padding to the byte boundary
+        UInt64 storedBits = (UInt64)storedCount * (3 + 7 + 32) + (UInt64)(_end - _start) * 8;
+
+        if (storedBits <= dynamicBits && storedBits <= fixedBits)
+        {
+            writeStored(_start, _end, _final);
+        }
+        else if (fixedBits <= dynamicBits)
+        {
+            writer.put(_final, 1);
+            writer.put(1, 2);
+            writeSymbols(fixedCodes);
+        }
+        else
+        {
+            writer.put(_final, 1);
+            writer.put(2, 2);
+            writer.put(dynamicCodes.literalCount - 257, 5);
+            writer.put(dynamicCodes.distanceCount - 1, 5);
+            writer.put(dynamicCodes.codeLengthCount - 4, 4);
+            for (Int32 i = 0; i < dynamicCodes.codeLengthCount; ++i)
+                writer.put(dynamicCodes.codeLengthLengths[s_codeLengthOrder[i]], 3);
+            for (Int32 i = 0; i < dynamicCodes.runCount; ++i)
+            {
+                UInt32 symbol = dynamicCodes.runs[i] & 0xff;
+                UInt32 extra = dynamicCodes.runs[i] >> 8;
+                writer.put(dynamicCodes.codeLengthCodes[symbol],
+                           dynamicCodes.codeLengthLengths[symbol]);
+                if (symbol == 16)
+                    writer.put(extra, 2);
+                else if (symbol == 17)
+                    writer.put(extra, 3);
+                else if (symbol == 18)
+                    writer.put(extra, 7);
+            }
+            writeSymbols(dynamicCodes);
+        }
+
+        symbolCount = 0;
+        memset(literalFreqs, 0, sizeof(literalFreqs));
+        memset(distanceFreqs, 0, sizeof(distanceFreqs));
+    }
+
+    // adds the positions before _start, i.e. a preset dictionary, to the hash chains
+    void prime(Int32 _start)
+    {
+        for (Int32 pos = std::max(_start - s_windowSize, 0);
+             pos < _start && pos + s_minMatch <= byteCount;
+             ++pos)
+            insert(pos);
+    }
+
+    void compressGreedy(Int32 _start, bool _final)
+    {
+        Int32 blockStart = _start;
+        Int32 pos = _start;
+        while (pos < byteCount)
+        {
+            Int32 len = 0, dist = 0;
+            if (pos + s_minMatch <= byteCount)
+                findMatch(pos, insert(pos), s_minMatch - 1, len, dist);
+
+            if (len >= s_minMatch)
+            {
+                addMatch(len, dist);
+                Int32 end = pos + len;
+                Int32 insertEnd = std::min(pos + std::min(len, params.lazyLength), byteCount - 2);
+                for (++pos; pos < insertEnd; ++pos)
+                    insert(pos);
+                pos = end;
+            }
+            else
+            {
+                addLiteral(data[pos++]);
+            }
+
+            if (symbolCount == s_maxBlockSymbols)
+            {
+                writeBlock(blockStart, pos, false);
+                blockStart = pos;
+            }
+        }
+        writeBlock(blockStart, byteCount, _final);
+    }
+
+    // zlib style lazy matching: a match is only taken if the match at the next position isn't
+    // longer, otherwise the current byte is written as a literal
+    void compressLazy(Int32 _start, bool _final)
+    {
+        Int32 blockStart = _start;
+        Int32 pos = _start;
+        Int32 prevLength = 0, prevDist = 0;
+        bool pending = false;
+        while (pos < byteCount)
+        {
+            Int32 len = 0, dist = 0;
+            if (pos + s_minMatch <= byteCount)
+            {
+                Int32 candidate = insert(pos);
+                if (prevLength < params.lazyLength)
+                    findMatch(pos, candidate, std::max(prevLength, s_minMatch - 1), len, dist);
+            }
+
+            if (pending && prevLength >= s_minMatch && len <= prevLength)
+            {
+                // the previous position holds the better match
+                addMatch(prevLength, prevDist);
+                Int32 end = pos - 1 + prevLength;
+                Int32 insertEnd = std::min(end, byteCount - 2);
+                for (++pos; pos < insertEnd; ++pos)
+                    insert(pos);
+                pos = end;
+                pending = false;
+                prevLength = 0;
+            }
+            else
+            {
+                if (pending)
+                    addLiteral(data[pos - 1]);
+                pending = true;
+                prevLength = len;
+                prevDist = dist;
+                ++pos;
+            }
+
+            if (symbolCount >= s_maxBlockSymbols - 1)
+            {
+                Int32 blockEnd = pending ? pos - 1 : pos;
+                writeBlock(blockStart, blockEnd, false);
+                blockStart = blockEnd;
+            }
+        }
+        if (pending)
+            addLiteral(data[byteCount - 1]);
+        writeBlock(blockStart, byteCount, _final);
+    }
+};
+
+Size zlibCompressBound(Size _byteCount)
+{
+    // stored blocks plus the zlib header, adler32 and block overhead
+    return _byteCount + _byteCount / 1024 + 64;
+}
+
+// positions in the Deflater are Int32, so bigger inputs are deflated in chunks of this size. Each
+// chunk uses the end of the previous one as its dictionary, only the chunk boundaries cost a sync
+// flush.
+static const Size s_maxChunkByteCount = (Size)1 << 30;
+
+static Size deflateChunk(Deflater & _d,
+                         const UInt8 * _data,
+                         Size _byteCount,
+                         Size _dictionaryByteCount,
+                         Int32 _level,
+                         bool _final,
+                         UInt8 * _out)
+{
+    // positions are relative to the start of the dictionary
+    Int32 start = (Int32)std::min(_dictionaryByteCount, (Size)s_windowSize);
+    Deflater & d = _d;
+    d.data = _data - start;
+    d.byteCount = start + (Int32)_byteCount;
+    d.params = s_levels[_level];
+    d.head = reinterpret_cast<Int32 *>(&d + 1);
+    d.prev = d.head + s_hashSize;
+    d.symbols = reinterpret_cast<Symbol *>(d.prev + s_windowSize);
+    d.symbolCount = 0;
+    memset(d.literalFreqs, 0, sizeof(d.literalFreqs));
+    memset(d.distanceFreqs, 0, sizeof(d.distanceFreqs));
+    memset(d.head, 0xff, sizeof(Int32) * s_hashSize);
+    d.writer = { _out, 0, 0 };
+    makeFixedCodes(d.fixedCodes);
+
+    if (_level == 0)
+    {
+        d.writeStored(start, d.byteCount, _final);
+    }
+    else
+    {
+        d.prime(start);
+        if (d.params.lazy)
+            d.compressLazy(start, _final);
+        else
+            d.compressGreedy(start, _final);
+    }
+
+    if (!_final)
+    {
+        // sync flush, an empty stored block brings the stream to a byte boundary
+        d.writer.put(0, 3);
+        d.writer.alignToByte();
+        UInt8 * out = d.writer.out;
+        out[0] = out[1] = 0x00;
+        out[2] = out[3] = 0xff;
+        d.writer.out = out + 4;
+    }
+    d.writer.alignToByte();
+    return d.writer.out - _out;
+}
+
+Size deflateSegment(const void * _data,
+                   Size _byteCount,
+                   Size _dictionaryByteCount,
+                   Int32 _level,
+                   bool _final,
+                   void * _out,
+                   Allocator & _alloc)
+{
+    UInt8 * out = static_cast<UInt8 *>(_out);
+    if (!_byteCount)
+    {
+        // a final fixed block with only the end of block code, or the sync flush
+        if (_final)
+        {
+            out[0] = 0x03;
+            out[1] = 0x00;
+            return 2;
+        }
+        out[0] = out[1] = out[2] = 0x00;
+        out[3] = out[4] = 0xff;
+        return 5;
+    }
+
+    _level = std::min(std::max(_level, 0), 9);
+    Size scratchByteCount = sizeof(Deflater) + sizeof(Int32) * (s_hashSize + s_windowSize) +
+                            sizeof(Symbol) * s_maxBlockSymbols;
+    Block scratch = _alloc.allocate(scratchByteCount, alignof(Deflater));
+    if (!scratch.ptr)
+        return 0;
+
+    Deflater & d = *static_cast<Deflater *>(scratch.ptr);
+    const UInt8 * data = static_cast<const UInt8 *>(_data);
+    Size ret = 0;
+    for (Size offset = 0; offset < _byteCount;)
+    {
+        Size byteCount = std::min(_byteCount - offset, s_maxChunkByteCount);
+        bool isLast = offset + byteCount == _byteCount;
+        ret += deflateChunk(d,
+                            data + offset,
+                            byteCount,
+                            offset ? offset : _dictionaryByteCount,
+                            _level,
+                            _final && isLast,
+                            out + ret);
+        offset += byteCount;
+    }
+    _alloc.deallocate(scratch);
+    return ret;
+}
+
+void writeZlibHeader(Int32 _level, void * _out)
+{
+    // 32K window, the level hint and the check bits that make the header a multiple of 31
+    UInt8 * out = static_cast<UInt8 *>(_out);
+    out[0] = 0x78;
+    out[1] = _level <= 0 ? 0x01 : _level < 6 ? 0x5e : _level == 6 ? 0x9c : 0xda;
+}
+
+Size zlibCompress(
+    const void * _data, Size _byteCount, Int32 _level, void * _out, Allocator & _alloc)
+{
+    UInt8 * out = static_cast<UInt8 *>(_out);
+    writeZlibHeader(_level, out);
+    Size byteCount = deflateSegment(_data, _byteCount, 0, _level, true, out + 2, _alloc);
+    if (!byteCount)
+        return 0;
+
+    UInt32 adler = adler32(1, _data, _byteCount);
+    UInt8 * end = out + 2 + byteCount;
+    end[0] = (UInt8)(adler >> 24);
+    end[1] = (UInt8)(adler >> 16);
+    end[2] = (UInt8)(adler >> 8);
+    end[3] = (UInt8)adler;
+    return byteCount + 6;
+}
+
+// crc32 with the polynomial used by png and zlib, sliced by 8 bytes
+struct CRCTables
+{
+    CRCTables()
+    {
+        for (UInt32 i = 0; i < 256; ++i)
+        {
+            UInt32 c = i;
+            for (Int32 k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            tables[0][i] = c;
+        }
+        for (UInt32 i = 0; i < 256; ++i)
+            for (Int32 t = 1; t < 8; ++t)
+                tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xff];
+    }
+
+    UInt32 tables[8][256];
+};
+
+static UInt32 crc32Scalar(UInt32 _crc, const UInt8 * _data, Size _byteCount)
+{
+    static CRCTables s_crc;
+    const UInt32(*t)[256] = s_crc.tables;
+    for (; _byteCount >= 8; _byteCount -= 8, _data += 8)
+    {
+        UInt32 a =
+            _crc ^ (_data[0] | (_data[1] << 8) | (_data[2] << 16) | ((UInt32)_data[3] << 24));
+        UInt32 b = _data[4] | (_data[5] << 8) | (_data[6] << 16) | ((UInt32)_data[7] << 24);
+        _crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+               t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+    }
+    for (; _byteCount; --_byteCount)
+        _crc = t[0][(_crc ^ *_data++) & 0xff] ^ (_crc >> 8);
+    return _crc;
+}
+
+static UInt32 adler32Scalar(UInt32 _adler, const UInt8 * _data, Size _byteCount)
+{
+    UInt32 s1 = _adler & 0xffff;
+    UInt32 s2 = _adler >> 16;
+    while (_byteCount)
+    {
+        // the largest n for which s2 can't overflow before the modulo
+        Size n = std::min(_byteCount, (Size)5552);
+        _byteCount -= n;
+        for (; n; --n)
+        {
+            s1 += *_data++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return s1 | (s2 << 16);
+}
+
+#ifdef PIC_DEFLATE_X86_SIMD
+// Folds 64 bytes at a time with carry-less multiplication, following Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction". Expects at least 64 bytes and
+// a multiple of 16.
+__attribute__((target("sse4.1,pclmul"))) static UInt32 crc32PCLMUL(UInt32 _crc,
+                                                                  const UInt8 * _data,
+                                                                  Size _byteCount)
+{
+    alignas(16) static const UInt64 k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const UInt64 k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const UInt64 k5[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const UInt64 poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    x1 = _mm_loadu_si128((const __m128i *)(_data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(_data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(_data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(_data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)_crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    _data += 64;
+    _byteCount -= 64;
+
+    while (_byteCount >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(_data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(_data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(_data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(_data + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        _data += 64;
+        _byteCount -= 64;
+    }
+
+    // fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (_byteCount >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)_data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        _data += 16;
+        _byteCount -= 16;
+    }
+
+    // fold 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (UInt32)_mm_extract_epi32(x1, 1);
+}
+
+// 32 bytes per iteration, s2 gets the bytes weighted by their distance to the end of the block
+__attribute__((target("ssse3"))) static UInt32 adler32SSSE3(UInt32 _adler,
+                                                           const UInt8 * _data,
+                                                           Size _byteCount)
+{
+    UInt32 s1 = _adler & 0xffff;
+    UInt32 s2 = _adler >> 16;
+    const __m128i tap1 =
+        _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    Size blocks = _byteCount / 32;
+    _byteCount -= blocks * 32;
+    while (blocks)
+    {
+        // 5552 / 32, the most blocks before s2 needs a modulo
+        Size n = std::min(blocks, (Size)173);
+        blocks -= n;
+
+        __m128i vps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+        __m128i vs2 = _mm_set_epi32(0, 0, 0, (int)s2);
+        __m128i vs1 = _mm_setzero_si128();
+        for (; n; --n, _data += 32)
+        {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)_data);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(_data + 16));
+            vps = _mm_add_epi32(vps, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes1, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes2, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+        }
+        vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 5));
+
+        // horizontal sums
+        vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(2, 3, 0, 1)));
+        vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (UInt32)_mm_cvtsi128_si32(vs1);
+        vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+        vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (UInt32)_mm_cvtsi128_si32(vs2);
+
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return adler32Scalar(s1 | (s2 << 16), _data, _byteCount);
+}
+
+static bool hasPCLMUL()
+{
+    static const bool s_has = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    return s_has;
+}
+
+static bool hasSSSE3()
+{
+    static const bool s_has = __builtin_cpu_supports("ssse3");
+    return s_has;
+}
+#endif // PIC_DEFLATE_X86_SIMD
+
+UInt32 crc32(UInt32 _crc, const void * _data, Size _byteCount)
+{
+    const UInt8 * data = static_cast<const UInt8 *>(_data);
+    _crc = ~_crc;
+#ifdef PIC_DEFLATE_X86_SIMD
+    if (_byteCount >= 64 && hasPCLMUL())
+    {
+        Size simdByteCount = _byteCount & ~(Size)15;
+        _crc = crc32PCLMUL(_crc, data, simdByteCount);
+        data += simdByteCount;
+        _byteCount -= simdByteCount;
+    }
+#endif // PIC_DEFLATE_X86_SIMD
+    return ~crc32Scalar(_crc, data, _byteCount);
+}
+
+UInt32 adler32(UInt32 _adler, const void * _data, Size _byteCount)
+{
+    const UInt8 * data = static_cast<const UInt8 *>(_data);
+#ifdef PIC_DEFLATE_X86_SIMD
+    if (hasSSSE3())
+        return adler32SSSE3(_adler, data, _byteCount);
+#endif // PIC_DEFLATE_X86_SIMD
+    return adler32Scalar(_adler, data, _byteCount);
+}
+
+// multiplies two polynomials modulo the crc32 polynomial, both in reflected bit order
+static UInt32 multiplyModP(UInt32 _a, UInt32 _b)
+{
+    UInt32 m = 1u << 31;
+    UInt32 ret = 0;
+    for (;;)
+    {
+        if (_a & m)
+        {
+            ret ^= _b;
+            if (!(_a & (m - 1)))
+                break;
+        }
+        m >>= 1;
+        _b = _b & 1 ? (_b >> 1) ^ 0xedb88320u : _b >> 1;
+    }
+    return ret;
+}
+
+UInt32 crc32Combine(UInt32 _crc1, UInt32 _crc2, Size _byteCount2)
+{
+    // appending n zero bytes to the first buffer multiplies its crc by x^(8n) modulo the
+    // polynomial, which is built from the powers x^(2^k) by repeated squaring
+    UInt32 power = 1u << 30;
+    UInt32 shift = 1u << 31;
+    for (UInt64 n = (UInt64)_byteCount2 * 8; n; n >>= 1)
+    {
+        if (n & 1)
+            shift = multiplyModP(power, shift);
+        power = multiplyModP(power, power);
+    }
+    return multiplyModP(shift, _crc1) ^ _crc2;
+}
+
+UInt32 adler32Combine(UInt32 _adler1, UInt32 _adler2, Size _byteCount2)
+{
+    const UInt32 base = 65521;
+    UInt32 rem = (UInt32)(_byteCount2 % base);
+    UInt32 s1 = _adler1 & 0xffff;
+    UInt32 s2 = (UInt32)(((UInt64)rem * s1) % base);
+    s1 += (_adler2 & 0xffff) + base - 1;
+    s2 += (_adler1 >> 16) + (_adler2 >> 16) + base - rem;
+    if (s1 >= base)
+        s1 -= base;
+    if (s1 >= base)
+        s1 -= base;
+    if (s2 >= base * 2)
+        s2 -= base * 2;
+    if (s2 >= base)
+        s2 -= base;
+    return s1 | (s2 << 16);
+}
+
+// codes up to this long are decoded with a single table lookup
+static const Int32 s_fastBits = 9;
+// the decompressed bytes that were not read yet go behind the window that matches refer back to
+static const Size s_ringSize = 2 * s_windowSize;
+static const Size s_ringMask = s_ringSize - 1;
+
+// canonical huffman decoding
+struct HuffmanDecoder
+{
+    // indexed by the next s_fastBits input bits, the symbol << 4 | the code length, 0 if the code
+    // is longer
+    UInt16 fast[1 << s_fastBits];
+    // the first code of each length and the index of its symbol in symbols
+    Int32 firstCode[16];
+    Int32 firstIndex[16];
+    Int32 counts[16];
+    UInt16 symbols[s_literalCount + 2];
+
+    // false if the lengths don't describe a prefix code. Incomplete codes are fine, the codes that
+    // are missing fail to decode.
+    bool build(const UInt8 * _lengths, Int32 _count)
+    {
+        memset(counts, 0, sizeof(counts));
+        for (Int32 i = 0; i < _count; ++i)
+            ++counts[_lengths[i]];
+        counts[0] = 0;
+
+        Int32 left = 1;
+        Int32 code = 0;
+        Int32 index = 0;
+        Int32 next[16];
+        for (Int32 len = 1; len < 16; ++len)
+        {
+            left = (left << 1) - counts[len];
+            if (left < 0)
+                return false;
+            firstCode[len] = code;
+            firstIndex[len] = next[len] = index;
+            code = (code + counts[len]) << 1;
+            index += counts[len];
+        }
+
+        memset(fast, 0, sizeof(fast));
+        for (Int32 i = 0; i < _count; ++i)
+        {
+            Int32 len = _lengths[i];
+            if (!len)
+                continue;
+            Int32 slot = next[len]++;
+            symbols[slot] = (UInt16)i;
+            if (len <= s_fastBits)
+            {
+                // deflate stores codes starting with the most significant bit
+                UInt32 rev = reverseBits(firstCode[len] + slot - firstIndex[len], len);
+                for (UInt32 j = rev; j < (1u << s_fastBits); j += 1u << len)
+                    fast[j] = (UInt16)(i << 4 | len);
+            }
+        }
+        return true;
+    }
+};
+
+struct Inflater::State
+{
+    enum class Stage
+    {
+        ZlibHeader,
+        BlockHeader,
+        Stored,
+        Huffman,
+        Checksum,
+        Done,
+        Failed
+    };
+
+    FillFunction fill;
+    void * userData;
+    const UInt8 * in;
+    const UInt8 * inEnd;
+    bool isInputAtEnd;
+    UInt64 bits;
+    Int32 bitCount;
+
+    Stage stage;
+    bool isFinalBlock;
+    Size storedByteCount;
+    // a match that did not fit into the ring yet
+    Int32 copyLength;
+    Int32 copyDistance;
+    // total bytes decompressed to the ring and read from it
+    UInt64 produced;
+    UInt64 consumed;
+    UInt32 adler;
+
+    HuffmanDecoder literals;
+    HuffmanDecoder distances;
+    UInt8 ring[s_ringSize];
+
+    void refill()
+    {
+        while (bitCount <= 56)
+        {
+            if (in == inEnd)
+            {
+                Size byteCount = isInputAtEnd ? 0 : fill(userData, &in);
+                if (!byteCount)
+                {
+                    isInputAtEnd = true;
+                    return;
+                }
+                inEnd = in + byteCount;
+            }
+            bits |= (UInt64)*in++ << bitCount;
+            bitCount += 8;
+        }
+    }
+
+    // false if the input ends before _count more bits
+    bool need(Int32 _count)
+    {
+        if (bitCount < _count)
+            refill();
+        return bitCount >= _count;
+    }
+
+    UInt32 take(Int32 _count)
+    {
+        UInt32 ret = (UInt32)(bits & ((1ull << _count) - 1));
+        bits >>= _count;
+        bitCount -= _count;
+        return ret;
+    }
+
+    // the next symbol or -1 if there is no valid code
+    Int32 decode(const HuffmanDecoder & _decoder)
+    {
+        if (bitCount < 15)
+            refill();
+        UInt16 entry = _decoder.fast[bits & ((1 << s_fastBits) - 1)];
+        if (entry)
+        {
+            Int32 len = entry & 15;
+            if (len > bitCount)
+                return -1;
+            take(len);
+            return entry >> 4;
+        }
+
+        Int32 code = 0;
+        for (Int32 len = 1; len < 16 && bitCount; ++len)
+        {
+            code |= take(1);
+            Int32 offset = code - _decoder.firstCode[len];
+            if (offset >= 0 && offset < _decoder.counts[len])
+                return _decoder.symbols[_decoder.firstIndex[len] + offset];
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    Error fail(const char * _message)
+    {
+        stage = Stage::Failed;
+        return Error(ec::InvalidOperation, _message, STICK_FILE, STICK_LINE);
+    }
+
+    bool readDynamicCodes()
+    {
+        if (!need(14))
+            return false;
+        Int32 literalCount = take(5) + 257;
+        Int32 distanceCount = take(5) + 1;
+        Int32 codeLengthCount = take(4) + 4;
+        UInt8 codeLengths[s_codeLengthCount] = {};
+        for (Int32 i = 0; i < codeLengthCount; ++i)
+        {
+            if (!need(3))
+                return false;
+            codeLengths[s_codeLengthOrder[i]] = (UInt8)take(3);
+        }
+        // the distance decoder is free until the lengths are read
+        if (literalCount > s_literalCount || !distances.build(codeLengths, s_codeLengthCount))
+            return false;
+
+        UInt8 lengths[s_literalCount + s_distanceCount + 2];
+        Int32 total = literalCount + distanceCount;
+        for (Int32 n = 0; n < total;)
+        {
+            Int32 sym = decode(distances);
+            if (sym < 0)
+                return false;
+            if (sym < 16)
+            {
+                lengths[n++] = (UInt8)sym;
+                continue;
+            }
+
+            // 16 repeats the previous length, 17 and 18 repeat 0
+            static const Int32 s_extraBits[3] = { 2, 3, 7 };
+            static const Int32 s_baseCount[3] = { 3, 3, 11 };
+            if (!need(s_extraBits[sym - 16]) || (sym == 16 && !n))
+                return false;
+            Int32 count = s_baseCount[sym - 16] + take(s_extraBits[sym - 16]);
+            if (n + count > total)
+                return false;
+            UInt8 value = sym == 16 ? lengths[n - 1] : 0;
+            memset(lengths + n, value, count);
+            n += count;
+        }
+        return lengths[s_endOfBlock] && literals.build(lengths, literalCount) &&
+               distances.build(lengths + literalCount, distanceCount);
+    }
+
+    void makeFixedDecoders()
+    {
+        UInt8 lengths[s_literalCount + 2];
+        memset(lengths, 8, 144);
+        memset(lengths + 144, 9, 112);
+        memset(lengths + 256, 7, 24);
+        memset(lengths + 280, 8, 8);
+        literals.build(lengths, s_literalCount + 2);
+        memset(lengths, 5, s_distanceCount);
+        distances.build(lengths, s_distanceCount);
+    }
+
+    void put(UInt8 _byte)
+    {
+        ring[produced++ & s_ringMask] = _byte;
+    }
+
+    // decompresses until the ring is full or the stream ends
+    Error inflate()
+    {
+        UInt64 start = produced;
+        Error err = inflateRing();
+        // the checksum covers everything decompressed so far
+        for (UInt64 pos = start; pos < produced;)
+        {
+            Size offset = (Size)(pos & s_ringMask);
+            Size byteCount = std::min((Size)(produced - pos), s_ringSize - offset);
+            adler = adler32(adler, ring + offset, byteCount);
+            pos += byteCount;
+        }
+        if (err || stage != Stage::Checksum)
+            return err;
+
+        bits >>= bitCount & 7;
+        bitCount &= ~7;
+        if (!need(32))
+            return fail("The zlib stream is truncated");
+        UInt32 expected = 0;
+        for (Int32 i = 0; i < 4; ++i)
+            expected = (expected << 8) | take(8);
+        if (expected != adler)
+            return fail("The zlib checksum does not match");
+        stage = Stage::Done;
+        return Error();
+    }
+
+    Error inflateRing()
+    {
+        while (true)
+        {
+            Size room = s_ringSize - (Size)(produced - consumed);
+            switch (stage)
+            {
+            case Stage::ZlibHeader:
+            {
+                if (!need(16))
+                    return fail("The zlib stream is truncated");
+                UInt32 cmf = take(8);
+                UInt32 flg = take(8);
+                if ((cmf & 15) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flg) % 31 || (flg & 32))
+                    return fail("Invalid zlib header");
+                stage = Stage::BlockHeader;
+                break;
+            }
+            case Stage::BlockHeader:
+            {
+                if (isFinalBlock)
+                {
+                    stage = Stage::Checksum;
+                    return Error();
+                }
+                if (!need(3))
+                    return fail("The zlib stream is truncated");
+                isFinalBlock = take(1) != 0;
+                UInt32 type = take(2);
+                if (type == 0)
+                {
+                    bits >>= bitCount & 7;
+                    bitCount &= ~7;
+                    if (!need(32))
+                        return fail("The zlib stream is truncated");
+                    UInt32 len = take(16);
+                    if ((take(16) ^ 0xffff) != len)
+                        return fail("Invalid stored deflate block");
+                    storedByteCount = len;
+                    stage = Stage::Stored;
+                }
+                else if (type == 1)
+                {
+                    makeFixedDecoders();
+                    stage = Stage::Huffman;
+                }
+                else if (type == 2)
+                {
+                    if (!readDynamicCodes())
+                        return fail("Invalid huffman codes in the deflate stream");
+                    stage = Stage::Huffman;
+                }
+                else
+                    return fail("Invalid deflate block type");
+                break;
+            }
+            case Stage::Stored:
+            {
+                for (; storedByteCount && room; --storedByteCount, --room)
+                {
+                    if (!need(8))
+                        return fail("The zlib stream is truncated");
+                    put((UInt8)take(8));
+                }
+                if (storedByteCount)
+                    return Error();
+                stage = Stage::BlockHeader;
+                break;
+            }
+            case Stage::Huffman:
+            {
+                while (true)
+                {
+                    for (; copyLength && room; --copyLength, --room)
+                        put(ring[(produced - copyDistance) & s_ringMask]);
+                    if (!room)
+                        return Error();
+
+                    Int32 sym = decode(literals);
+                    if (sym < 0)
+                        return fail("The deflate stream is corrupt or truncated");
+                    if (sym < s_endOfBlock)
+                    {
+                        put((UInt8)sym);
+                        --room;
+                        continue;
+                    }
+                    if (sym == s_endOfBlock)
+                        break;
+
+                    sym -= s_endOfBlock + 1;
+                    Int32 dsym = -1;
+                    if (sym < 29 && need(s_lengthExtra[sym]))
+                    {
+                        copyLength = s_lengthBase[sym] + take(s_lengthExtra[sym]);
+                        dsym = decode(distances);
+                    }
+                    if (dsym < 0 || dsym >= s_distanceCount || !need(s_distanceExtra[dsym]))
+                        return fail("The deflate stream is corrupt or truncated");
+                    copyDistance = s_distanceBase[dsym] + take(s_distanceExtra[dsym]);
+                    if ((UInt64)copyDistance > produced)
+                        return fail("A deflate match refers to data before the stream");
+                }
+                stage = Stage::BlockHeader;
+                break;
+            }
+            case Stage::Failed:
+                return Error(
+                    ec::InvalidOperation, "The zlib stream is corrupt", STICK_FILE, STICK_LINE);
+            default:
+                return Error();
+            }
+        }
+    }
+};
+
+Inflater::Inflater(Allocator & _alloc) : m_alloc(&_alloc), m_state(nullptr)
+{
+}
+
+Inflater::~Inflater()
+{
+    if (m_state)
+        m_alloc->deallocate({ m_state, sizeof(State) });
+}
+
+Error Inflater::begin(FillFunction _fill, void * _userData)
+{
+    if (!m_state)
+    {
+        Block block = m_alloc->allocate(sizeof(State), alignof(State));
+        if (!block.ptr)
+            return Error(ec::InvalidOperation,
+                         "Failed to allocate the inflate state",
+                         STICK_FILE,
+                         STICK_LINE);
+        m_state = static_cast<State *>(block.ptr);
+    }
+
+    State & s = *m_state;
+    s.fill = _fill;
+    s.userData = _userData;
+    s.in = s.inEnd = nullptr;
+    s.isInputAtEnd = false;
+    s.bits = 0;
+    s.bitCount = 0;
+    s.stage = State::Stage::ZlibHeader;
+    s.isFinalBlock = false;
+    s.storedByteCount = 0;
+    s.copyLength = 0;
+    s.copyDistance = 0;
+    s.produced = 0;
+    s.consumed = 0;
+    s.adler = 1;
+    return Error();
+}
+
+Result<Size> Inflater::read(void * _out, Size _byteCount)
+{
+    if (!m_state)
+        return Error(
+            ec::InvalidOperation, "The inflater was not started", STICK_FILE, STICK_LINE);
+
+    State & s = *m_state;
+    UInt8 * out = static_cast<UInt8 *>(_out);
+    Size written = 0;
+    while (written < _byteCount)
+    {
+        Size available = (Size)(s.produced - s.consumed);
+        if (!available)
+        {
+            if (s.stage == State::Stage::Done)
+                break;
+            Error err = s.inflate();
+            if (err)
+                return err;
+            continue;
+        }
+
+        Size offset = (Size)(s.consumed & s_ringMask);
+        Size count = std::min(std::min(available, _byteCount - written), s_ringSize - offset);
+        memcpy(out + written, s.ring + offset, count);
+        written += count;
+        s.consumed += count;
+    }
+    return written;
+}
+
+bool Inflater::isAtEnd() const
+{
+    return m_state && m_state->stage == State::Stage::Done &&
+           m_state->produced == m_state->consumed;
+}
+
+} // namespace pic
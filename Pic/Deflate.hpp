@@ -0,0 +1,92 @@
+#ifndef PIC_DEFLATE_HPP
+#define PIC_DEFLATE_HPP
+
+#include <Stick/Allocator.hpp>
+#include <Stick/Result.hpp>
+
+namespace pic
+{
+
+// the largest number of bytes zlibCompress can write for _byteCount bytes of input
+STICK_API stick::Size zlibCompressBound(stick::Size _byteCount);
+
+// Compresses _data to a zlib stream (RFC 1950/1951) and returns the number of bytes written to
+// _out, which needs room for zlibCompressBound(_byteCount) bytes. Level 0 only stores, levels
+// 1 - 3 use greedy matching on short hash chains and levels 4 - 9 lazy matching on increasingly
+// long ones. The match finder state is allocated from _alloc. Returns 0 if that fails.
+STICK_API stick::Size zlibCompress(const void * _data,
+                                   stick::Size _byteCount,
+                                   stick::Int32 _level,
+                                   void * _out,
+                                   stick::Allocator & _alloc = stick::defaultAllocator());
+
+// writes the two byte zlib header for a stream compressed at _level
+STICK_API void writeZlibHeader(stick::Int32 _level, void * _out);
+
+// Compresses _data to raw deflate blocks (RFC 1951), which lets independently compressed segments
+// of one stream be concatenated, like pigz does. The _dictionaryByteCount bytes in front of _data,
+// at most 32K of them, are only used to find matches, so that a segment can refer back into the
+// previous one. Unless _final is set, the output ends on a byte boundary with an empty stored
+// block (a sync flush). _out needs room for zlibCompressBound(_byteCount) bytes. Returns the
+// number of bytes written or 0 if allocating the match finder state fails.
+STICK_API stick::Size deflateSegment(const void * _data,
+                                     stick::Size _byteCount,
+                                     stick::Size _dictionaryByteCount,
+                                     stick::Int32 _level,
+                                     bool _final,
+                                     void * _out,
+                                     stick::Allocator & _alloc = stick::defaultAllocator());
+
+// running checksums, start with 0 for crc32 and 1 for adler32. Both use SIMD where the cpu
+// supports it.
+STICK_API stick::UInt32 crc32(stick::UInt32 _crc, const void * _data, stick::Size _byteCount);
+
+STICK_API stick::UInt32 adler32(stick::UInt32 _adler, const void * _data, stick::Size _byteCount);
+
+// the checksum of two buffers in a row from the checksums of each, where the second one is
+// _byteCount2 bytes long
+STICK_API stick::UInt32 crc32Combine(stick::UInt32 _crc1,
+                                     stick::UInt32 _crc2,
+                                     stick::Size _byteCount2);
+
+STICK_API stick::UInt32 adler32Combine(stick::UInt32 _adler1,
+                                       stick::UInt32 _adler2,
+                                       stick::Size _byteCount2);
+
+// Decompresses a zlib stream a piece at a time, keeping only the output that later data can refer
+// back to. The compressed data is pulled from a FillFunction, which points _outData at the next
+// bytes and returns how many there are, or 0 at the end of the input. The compressed data only has
+// to stay valid until the function is called again.
+class STICK_API Inflater
+{
+  public:
+    typedef stick::Size (*FillFunction)(void * _userData, const stick::UInt8 ** _outData);
+
+    Inflater(stick::Allocator & _alloc = stick::defaultAllocator());
+
+    ~Inflater();
+
+    Inflater(const Inflater &) = delete;
+
+    Inflater & operator=(const Inflater &) = delete;
+
+    // starts decompressing a new stream, the 64K of state are allocated on the first call
+    stick::Error begin(FillFunction _fill, void * _userData);
+
+    // Decompresses up to _byteCount bytes to _out and returns how many were written, which is less
+    // than _byteCount only at the end of the stream. Fails if the stream is corrupt, truncated or
+    // its checksum does not match.
+    stick::Result<stick::Size> read(void * _out, stick::Size _byteCount);
+
+    bool isAtEnd() const;
+
+  private:
+    struct State;
+
+    stick::Allocator * m_alloc;
+    State * m_state;
+};
+
+} // namespace pic
+
+#endif // PIC_DEFLATE_HPP
@@ -1,339 +1,5144 @@
 #include <Pic/Image.hpp>
+#include <Pic/Deflate.hpp>
 #ifdef PIC_IMPLEMENTATION_FREEIMAGE
 #include <FreeImage.h>
 #include <Stick/FileUtilities.hpp>
 #elif defined(PIC_IMPLEMENTATION_STB)
+namespace pic
+{
+namespace detail
+{
+// allocation hooks for stb image, see STBAllocationScope below
+void * stbMalloc(stick::Size _byteCount);
+void * stbRealloc(void * _ptr, stick::Size _byteCount);
+void stbFree(void * _ptr);
+// zlib hook for stb image write, see SaveSettings::pngDeflate
+unsigned char * stbZlibCompress(unsigned char * _data, int _byteCount, int * _outLen, int _level);
+} // namespace detail
+} // namespace pic
+#define STBI_MALLOC(_sz) pic::detail::stbMalloc(_sz)
+#define STBI_REALLOC(_p, _newsz) pic::detail::stbRealloc(_p, _newsz)
+#define STBI_FREE(_p) pic::detail::stbFree(_p)
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
+#define STBIW_MALLOC(_sz) pic::detail::stbMalloc(_sz)
+#define STBIW_REALLOC(_p, _newsz) pic::detail::stbRealloc(_p, _newsz)
+#define STBIW_FREE(_p) pic::detail::stbFree(_p)
+#define STBIW_ZLIB_COMPRESS(_data, _len, _outLen, _q)                                             \
+    pic::detail::stbZlibCompress(_data, _len, _outLen, _q)
+#define STBIW_CRC32(_buf, _len) pic::crc32(0, _buf, _len)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <Stick/Path.hpp>
 #include <stb/stb_image_write.h>
 #else
 #error "No implementation specified"
 #endif // PIC_IMPLEMENTATION_FREEIMAGE
 
+#if defined(__unix__) || defined(__APPLE__)
+#define PIC_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // defined(__unix__) || defined(__APPLE__)
+
+// io_uring is used through the raw system calls, so there is no dependency on liburing
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PIC_HAS_IO_URING
+#include <linux/io_uring.h>
+#endif // __has_include(<linux/io_uring.h>)
+#endif // defined(__NR_io_uring_setup) && defined(__has_include)
+#endif // __linux__
+
+#ifdef __SSE2__
+#define PIC_HAS_SSE2
+#include <emmintrin.h>
+#endif // __SSE2__
+
+#include <Stick/Path.hpp>
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+
 namespace pic
 {
 
 using namespace stick;
 
-Result<ImageUniquePtr> decodeImage(const ByteArray & _data, Allocator & _alloc)
+// Read only view of a whole file. Where supported the file is memory mapped, so that decoders can
+// read it without copying it to the heap first.
+class MappedFile
 {
-    return decodeImage(&_data[0], _data.count(), _alloc);
-}
+  public:
+    MappedFile() : m_data(nullptr), m_byteCount(0)
+    {
+    }
 
-#ifdef PIC_IMPLEMENTATION_FREEIMAGE
-Result<ImageUniquePtr> decodeImage(const void * _data, Size _byteCount, Allocator & _alloc)
-{
-    typedef Result<ImageUniquePtr> ResultType;
-    FIMEMORY * memStream = FreeImage_OpenMemory((unsigned char *)_data, _byteCount);
-    FREE_IMAGE_FORMAT fileType = FreeImage_GetFileTypeFromMemory(memStream, _byteCount);
+    ~MappedFile()
+    {
+#ifdef PIC_HAS_MMAP
+        if (m_data)
+            munmap(m_data, m_byteCount);
+#endif // PIC_HAS_MMAP
+    }
 
-    if (fileType != FIF_UNKNOWN)
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    Error open(const String & _path)
     {
-        FIBITMAP * img = FreeImage_LoadFromMemory(fileType, memStream);
-        FREE_IMAGE_COLOR_TYPE colorType = FreeImage_GetColorType(img);
-        FREE_IMAGE_TYPE imageType = FreeImage_GetImageType(img);
+#ifdef PIC_HAS_MMAP
+        int fd = ::open(_path.cString(), O_RDONLY);
+        if (fd == -1)
+            return Error(ec::InvalidOperation,
+                         String::formatted("Could not open file at %s", _path.cString()),
+                         STICK_FILE,
+                         STICK_LINE);
 
-        int bpp = FreeImage_GetBPP(img);
-        int width = FreeImage_GetWidth(img);
-        int height = FreeImage_GetHeight(img);
-        int pitch = FreeImage_GetPitch(img);
-        int bytePaddingPerRow = pitch - width * (bpp / 8);
+        struct stat st;
+        void * data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            data = mmap(nullptr, (Size)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping stays valid after closing the descriptor
+        close(fd);
 
-        if (imageType == FIT_RGBF)
-        {
-            return ResultType(ImageUniquePtr(
-                _alloc.create<ImageRGB32f>(
-                    width, height, (float *)FreeImage_GetBits(img), bytePaddingPerRow, _alloc),
-                _alloc));
-        }
-        else if (imageType == FIT_RGBAF)
-        {
-            return ResultType(ImageUniquePtr(
-                _alloc.create<ImageRGBA32f>(
-                    width, height, (float *)FreeImage_GetBits(img), bytePaddingPerRow, _alloc),
-                _alloc));
-        }
-        else
+        if (data == MAP_FAILED)
+            return Error(ec::InvalidOperation,
+                         String::formatted("Could not map file at %s", _path.cString()),
+                         STICK_FILE,
+                         STICK_LINE);
+
+        // decoders read the file front to back, so let the kernel read ahead aggressively
+        madvise(data, (Size)st.st_size, MADV_SEQUENTIAL);
+        m_data = data;
+        m_byteCount = (Size)st.st_size;
+        return Error();
+#else
+        return Error(ec::Unsupported,
+                     "Memory mapped files are not supported on this platform",
+                     STICK_FILE,
+                     STICK_LINE);
+#endif // PIC_HAS_MMAP
+    }
+
+    const void * data() const
+    {
+        return m_data;
+    }
+
+    Size byteCount() const
+    {
+        return m_byteCount;
+    }
+
+    // hands the mapping over to the caller, who has to unmap it
+    void * release()
+    {
+        void * ret = m_data;
+        m_data = nullptr;
+        return ret;
+    }
+
+  private:
+    void * m_data;
+    Size m_byteCount;
+};
+
+// position of each channel of a layout in the gray, gray alpha, rgb or rgba layout with the same
+// channel count
+static bool canonicalChannelOrder(TypeID _layout, UInt32 (&_outOrder)[4])
+{
+    static const struct
+    {
+        TypeID layout;
+        UInt32 order[4];
+    } s_orders[] = { { ChannelLayoutGray::channelLayoutTypeID(), { 0 } },
+                     { ChannelLayoutGrayAlpha::channelLayoutTypeID(), { 0, 1 } },
+                     { ChannelLayoutAlphaGray::channelLayoutTypeID(), { 1, 0 } },
+                     { ChannelLayoutRGB::channelLayoutTypeID(), { 0, 1, 2 } },
+                     { ChannelLayoutBGR::channelLayoutTypeID(), { 2, 1, 0 } },
+                     { ChannelLayoutRGBA::channelLayoutTypeID(), { 0, 1, 2, 3 } },
+                     { ChannelLayoutBGRA::channelLayoutTypeID(), { 2, 1, 0, 3 } },
+                     { ChannelLayoutARGB::channelLayoutTypeID(), { 3, 0, 1, 2 } },
+                     { ChannelLayoutABGR::channelLayoutTypeID(), { 3, 2, 1, 0 } } };
+
+    for (const auto & o : s_orders)
+    {
+        if (o.layout == _layout)
         {
-            // grayscale image
-            if (colorType == FIC_MINISBLACK)
-            {
-                if (bpp == 8)
-                {
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageGray8>(width,
-                                                  height,
-                                                  (unsigned char *)FreeImage_GetBits(img),
-                                                  bytePaddingPerRow,
-                                                  _alloc),
-                        _alloc));
-                }
-                else if (bpp == 16)
-                {
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageGray16>(width,
-                                                   height,
-                                                   (unsigned short *)FreeImage_GetBits(img),
-                                                   bytePaddingPerRow,
-                                                   _alloc),
-                        _alloc));
-                }
-                else
-                {
-                    return Error(ec::Unsupported,
-                                 "Grayscale images are only supported in 8 or 16 bits per pixel.",
-                                 STICK_FILE,
-                                 STICK_LINE);
-                }
-            }
-            else if (colorType == FIC_RGB)
-            {
-                // free image uses BGR, so we do too for speed
-                if (bpp == 24)
-                {
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageBGR8>(width,
-                                                 height,
-                                                 (unsigned char *)FreeImage_GetBits(img),
-                                                 bytePaddingPerRow,
-                                                 _alloc),
-                        _alloc));
-                }
-                // this is a FreeImage oddity that happens if we call FreeImage_ConvertTo32Bits
-                // as it won't change the color type to FIC_RGBALPHA (this a bug? who knows daawg)
-                else if (bpp == 32)
-                {
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageBGRA8>(width,
-                                                  height,
-                                                  (unsigned char *)FreeImage_GetBits(img),
-                                                  bytePaddingPerRow,
-                                                  _alloc),
-                        _alloc));
-                }
-                else if (bpp == 48)
-                {
-                    // 48 bit on the other hand are natively stored as rgb in freeimage....
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageRGB16>(width,
-                                                  height,
-                                                  (unsigned short *)FreeImage_GetBits(img),
-                                                  bytePaddingPerRow,
-                                                  _alloc),
-                        _alloc));
-                }
-                else
-                {
-                    return Error(ec::Unsupported,
-                                 "RGB images are only supported in 24 or 48 bits per pixel.",
-                                 STICK_FILE,
-                                 STICK_LINE);
-                }
-            }
-            else if (colorType == FIC_RGBALPHA)
-            {
-                // free image uses BGR, so we do too for speed
-                if (bpp == 32)
-                {
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageBGRA8>(width,
-                                                  height,
-                                                  (unsigned char *)FreeImage_GetBits(img),
-                                                  bytePaddingPerRow,
-                                                  _alloc),
-                        _alloc));
-                }
-                else if (bpp == 64)
-                {
-                    // 64 bit on the other hand are natively stored as rgb in freeimage....
-                    return ResultType(ImageUniquePtr(
-                        _alloc.create<ImageRGBA16>(width,
-                                                   height,
-                                                   (unsigned short *)FreeImage_GetBits(img),
-                                                   bytePaddingPerRow,
-                                                   _alloc),
-                        _alloc));
-                }
-                else
-                {
-                    return Error(ec::Unsupported,
-                                 "RGBA images are only supported in 32 or 64 bits per pixel.",
-                                 STICK_FILE,
-                                 STICK_LINE);
-                }
-            }
+            memcpy(_outOrder, o.order, sizeof(o.order));
+            return true;
         }
     }
-
-    FreeImage_CloseMemory(memStream);
-    return Error(ec::Unsupported, "The image format is not supported.", STICK_FILE, STICK_LINE);
+    return false;
 }
 
-Result<ImageUniquePtr> loadImage(const String & _path, Allocator & _alloc)
+template <class T>
+static void reorderChannels(Image & _img, const UInt32 * _mapping)
 {
-    auto res = loadBinaryFile(_path, _alloc);
-    if (res)
+    UInt32 cc = _img.channelCount();
+    T tmp[4];
+    for (Size z = 0; z < _img.depth(); ++z)
     {
-        return decodeImage(&res.get()[0], res.get().count(), _alloc);
+        for (Size y = 0; y < _img.height(); ++y)
+        {
+            T * row = reinterpret_cast<T *>(_img.bytePtr() +
+                                            (z * _img.height() + y) * _img.bytesPerRow());
+            for (Size x = 0; x < _img.width(); ++x, row += cc)
+            {
+                memcpy(tmp, row, sizeof(T) * cc);
+                for (UInt32 i = 0; i < cc; ++i)
+                    row[i] = tmp[_mapping[i]];
+            }
+        }
     }
-    return res.error();
 }
 
-Error Image::save(const String & _path, const SaveSettings & _settings)
+// reorders the channels of an image whose pixels are currently stored in the _srcLayout order
+// (with the same channel count) to the channel layout of the image
+static Error convertChannelOrder(Image & _img, TypeID _srcLayout)
 {
-    ByteArray data;
-    FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename(toString(_path).cString());
-    if (fif != FIF_UNKNOWN)
-    {
-        // the channel masks don't seem to do anything in FreeImage_ConvertFromRawBits (bug?), so we
-        // convert RGB to BGR for RGB images as that is what freeimage expects
-        Image * tmp;
-        const Image * imgToSave = this;
-        if (channelLayoutTypeID() == ChannelLayoutRGB::TypeInfo::typeID() ||
-            channelLayoutTypeID() == ChannelLayoutRGBA::TypeInfo::typeID())
-        {
-            tmp = clone();
-            tmp->swapChannels(0, 2);
-            imgToSave = tmp;
-        }
-
-        FIBITMAP * img = FreeImage_ConvertFromRawBits((BYTE *)imgToSave->bytePtr(),
-                                                      imgToSave->width(),
-                                                      imgToSave->height(),
-                                                      imgToSave->bytesPerRow(),
-                                                      imgToSave->bitsPerPixel(),
-                                                      FI_RGBA_RED_MASK,
-                                                      FI_RGBA_GREEN_MASK,
-                                                      FI_RGBA_BLUE_MASK,
-                                                      false);
-
-        FIMEMORY * mem = FreeImage_OpenMemory();
-        bool result = FreeImage_SaveToMemory(fif, img, mem, 0);
-        if (result)
-        {
-            BYTE * ptr = NULL;
-            DWORD sizeInBytes = 0;
-            FreeImage_AcquireMemory(mem, &ptr, &sizeInBytes);
-            data.resize(sizeInBytes);
-            memcpy(&data[0], ptr, sizeInBytes);
-            return saveBinaryFile(data, _path);
-        }
-        else
+    if (_srcLayout == _img.channelLayoutTypeID())
+        return Error();
+
+    UInt32 srcOrder[4], dstOrder[4], mapping[4];
+    if (!canonicalChannelOrder(_srcLayout, srcOrder) ||
+        !canonicalChannelOrder(_img.channelLayoutTypeID(), dstOrder))
+        return Error(ec::Unsupported, "Unsupported channel layout", STICK_FILE, STICK_LINE);
+
+    bool isIdentity = true;
+    for (UInt32 i = 0; i < _img.channelCount(); ++i)
+    {
+        for (UInt32 j = 0; j < _img.channelCount(); ++j)
         {
-            return Error(ec::ComposeFailed, "Could not encode image.", STICK_FILE, STICK_LINE);
+            if (srcOrder[j] == dstOrder[i])
+                mapping[i] = j;
         }
-
-        FreeImage_CloseMemory(mem);
-        FreeImage_Unload(img);
+        isIdentity = isIdentity && mapping[i] == i;
     }
+
+    if (isIdentity)
+        return Error();
+
+    if (_img.bitsPerChannel() == 8)
+        reorderChannels<UInt8>(_img, mapping);
+    else if (_img.bitsPerChannel() == 16)
+        reorderChannels<UInt16>(_img, mapping);
     else
-    {
-        return Error(
-            ec::Unsupported, "The requested image type is not supported.", STICK_FILE, STICK_LINE);
-    }
+        reorderChannels<UInt32>(_img, mapping);
     return Error();
 }
-#elif defined(PIC_IMPLEMENTATION_STB)
 
-Result<ImageUniquePtr> createImageFromSTBData(
-    UInt8 * _data, int _w, int _h, int _channelCount, Allocator & _alloc)
+Result<ImageUniquePtr> decodeImage(const ByteArray & _data, Allocator & _alloc)
 {
-    //@NOTE: stb image does not provide a way to load into a preallocated buffer right now. Not
-    // optimal as we need to do one final copy, but should be fine in most cases.
-    ImageUniquePtr ret;
-    Error err;
-    if (_channelCount == 1)
-        ret = makeUnique<ImageGray8>(_alloc, (Size)_w, (Size)_h, _data, (Size)0, _alloc);
-    else if (_channelCount == 2)
-        ret = makeUnique<ImageGrayAlpha8>(_alloc, (Size)_w, (Size)_h, _data, (Size)0, _alloc);
-    else if (_channelCount == 3)
-        ret = makeUnique<ImageRGB8>(_alloc, (Size)_w, (Size)_h, _data, (Size)0, _alloc);
-    else if (_channelCount == 4)
-        ret = makeUnique<ImageRGBA8>(_alloc, (Size)_w, (Size)_h, _data, (Size)0, _alloc);
-    else
-        err = Error(ec::InvalidOperation, "Unsupported channel count", STICK_FILE, STICK_LINE);
-
-    stbi_image_free(_data);
-    if (err)
-        return err;
-    return ret;
+    return decodeImage(&_data[0], _data.count(), DecodeSettings(), _alloc);
 }
 
 Result<ImageUniquePtr> decodeImage(const void * _data, Size _byteCount, Allocator & _alloc)
 {
-    //@TODO: allow loading of HDR/float images using the corresponding stb api
-    int w, h, n;
-    auto * data = stbi_load_from_memory((const stbi_uc *)_data, _byteCount, &w, &h, &n, 0);
-    if (!data)
-    {
-        return Error(ec::InvalidOperation,
-                     "Could not parse image from compressed data",
-                     STICK_FILE,
-                     STICK_LINE);
-    }
-    return createImageFromSTBData(data, w, h, n, _alloc);
+    return decodeImage(_data, _byteCount, DecodeSettings(), _alloc);
 }
 
 Result<ImageUniquePtr> loadImage(const String & _path, Allocator & _alloc)
 {
-    int w, h, n;
-    auto * data = stbi_load(_path.cString(), &w, &h, &n, 0);
-    if (!data)
-    {
-        return Error(ec::InvalidOperation,
-                     String::formatted("Could not parse image from file at %s", _path.cString()),
-                     STICK_FILE,
-                     STICK_LINE);
-    }
-    return createImageFromSTBData(data, w, h, n, _alloc);
+    return loadImage(_path, DecodeSettings(), _alloc);
 }
 
-Error Image::save(const String & _path, const SaveSettings & _settings)
+Result<ImageUniquePtr> decodeImage(const ByteArray & _data,
+                                   const DecodeSettings & _settings,
+                                   Allocator & _alloc)
 {
-    //@TODO simply use a strncmp based approach so we dont need to allocate the extension... this is
-    // nice and easy for now dough
-    String ext = path::extension(_path, allocator());
-    if (ext == ".png")
-    {
-        int success = stbi_write_png(
-            _path.cString(), width(), height(), channelCount(), bytePtr(), bytesPerRow());
-        if (!success)
-            return Error(ec::InvalidOperation, "stbi_write_png failed", STICK_FILE, STICK_LINE);
-    }
-    else
-    {
-        if (rowPadding() != 0)
-            return Error(ec::InvalidOperation,
-                         "Stb only supports row padding for writing png files",
-                         STICK_FILE,
-                         STICK_LINE);
+    return decodeImage(&_data[0], _data.count(), _settings, _alloc);
+}
 
-        if (ext == ".jpg")
-        {
-            //@TODO: put jpg quality in SaveSettings and use it
-            int success =
-                stbi_write_jpg(_path.cString(), width(), height(), channelCount(), bytePtr(), 90);
-            if (!success)
-                return Error(ec::InvalidOperation, "stbi_write_jpg failed", STICK_FILE, STICK_LINE);
-        }
-        else if (ext == ".bmp")
-        {
-            int success =
-                stbi_write_bmp(_path.cString(), width(), height(), channelCount(), bytePtr());
-            if (!success)
-                return Error(ec::InvalidOperation, "stbi_write_bmp failed", STICK_FILE, STICK_LINE);
-        }
-        else if (ext == ".tga")
-        {
-            int success =
-                stbi_write_tga(_path.cString(), width(), height(), channelCount(), bytePtr());
-            if (!success)
-                return Error(ec::InvalidOperation, "stbi_write_tga failed", STICK_FILE, STICK_LINE);
-        }
-    }
-    return Error();
+Result<ImageInfo> probeImage(const ByteArray & _data)
+{
+    return probeImage(&_data[0], _data.count());
+}
+
+Result<ImageUniquePtr> decodeRegion(
+    const ByteArray & _data, Size _left, Size _top, Size _width, Size _height, Allocator & _alloc)
+{
+    return decodeRegion(&_data[0], _data.count(), _left, _top, _width, _height, _alloc);
+}
+
+Error decodeInto(Image & _target, const ByteArray & _data)
+{
+    return decodeInto(_target, &_data[0], _data.count());
+}
+
+Result<AnimatedImage> decodeAnimatedImage(const ByteArray & _data, Allocator & _alloc)
+{
+    return decodeAnimatedImage(&_data[0], _data.count(), _alloc);
+}
+
+Result<AnimatedImage> loadAnimatedImage(const String & _path, Allocator & _alloc)
+{
+    MappedFile file;
+    if (!file.open(_path))
+        return decodeAnimatedImage(file.data(), file.byteCount(), _alloc);
+
+    auto res = loadBinaryFile(_path, _alloc);
+    if (!res)
+        return res.error();
+    return decodeAnimatedImage(res.get(), _alloc);
+}
+
+// the biggest block a ScratchArena keeps around
+static constexpr Size s_scratchArenaMaxByteCount = 16 * 1024 * 1024;
+
+// The temporary buffers of one decode worker, i.e. what stb allocates while decoding. They are
+// handed out from a block the arena keeps around, so the workers of a batch don't contend on the
+// default allocator for them. Requests that don't fit go to the parent allocator. Once everything
+// is freed again, which happens after every image, the arena rewinds and grows its block to what
+// the last image needed.
+class ScratchArena : public Allocator
+{
+  public:
+    ScratchArena(Allocator & _parent = defaultAllocator()) :
+        m_parent(&_parent),
+        m_block({ nullptr, 0 }),
+        m_offset(0),
+        m_requiredByteCount(0),
+        m_liveCount(0)
+    {
+    }
+
+    ~ScratchArena()
+    {
+        if (m_block.ptr)
+            m_parent->deallocate(m_block);
+    }
+
+    ScratchArena(const ScratchArena &) = delete;
+
+    ScratchArena & operator=(const ScratchArena &) = delete;
+
+    Block allocate(Size _byteCount, Size _alignment) override
+    {
+        ++m_liveCount;
+        m_requiredByteCount += _byteCount + _alignment;
+        Size offset = (m_offset + _alignment - 1) / _alignment * _alignment;
+        if (offset + _byteCount > m_block.byteCount)
+            return m_parent->allocate(_byteCount, _alignment);
+        m_offset = offset + _byteCount;
+        return { static_cast<char *>(m_block.ptr) + offset, _byteCount };
+    }
+
+    void deallocate(const Block & _block) override
+    {
+        uintptr_t ptr = (uintptr_t)_block.ptr;
+        uintptr_t base = (uintptr_t)m_block.ptr;
+        if (!m_block.ptr || ptr < base || ptr >= base + m_block.byteCount)
+            m_parent->deallocate(_block);
+        if (--m_liveCount == 0)
+            rewind();
+    }
+
+  private:
+    void rewind()
+    {
+        Size byteCount = std::min(m_requiredByteCount, s_scratchArenaMaxByteCount);
+        m_offset = 0;
+        m_requiredByteCount = 0;
+        if (byteCount <= m_block.byteCount)
+            return;
+
+        if (m_block.ptr)
+            m_parent->deallocate(m_block);
+        m_block = m_parent->allocate(byteCount, 64);
+        if (!m_block.ptr)
+            m_block.byteCount = 0;
+    }
+
+    Allocator * m_parent;
+    Block m_block;
+    Size m_offset;
+    Size m_requiredByteCount;
+    Size m_liveCount;
+};
+
+// the allocator stb takes its temporary buffers from on the calling thread, see ScratchScope
+static thread_local Allocator * t_scratchAllocator = nullptr;
+
+// makes _alloc the allocator of the temporary decoding buffers of the calling thread for as long
+// as the scope is alive. Null leaves them with the allocator of the decoded image.
+struct ScratchScope
+{
+    explicit ScratchScope(Allocator * _alloc) : previous(t_scratchAllocator)
+    {
+        t_scratchAllocator = _alloc;
+    }
+
+    ~ScratchScope()
+    {
+        t_scratchAllocator = previous;
+    }
+
+    Allocator * previous;
+};
+
+// Runs _work(worker) for every worker index, the calling thread being the first worker. The
+// threads only live for one call. A batch is meant to be big enough for starting them to not
+// matter next to decoding it, and their allocators and arenas go away with the call.
+template <class F>
+static void runWorkers(Size _workerCount, F _work)
+{
+    DynamicArray<std::thread> threads;
+    threads.reserve(_workerCount);
+    for (Size i = 1; i < _workerCount; ++i)
+        threads.append(std::thread(_work, i));
+    _work(0);
+    for (std::thread & t : threads)
+        t.join();
+}
+
+Error decodeImages(const ByteArray * _data,
+                   Size _count,
+                   DynamicArray<DecodedImage> & _outResults,
+                   const DecodeImagesSettings & _settings)
+{
+    if (_settings.workerAllocators && !_settings.workerCount)
+        return Error(ec::InvalidOperation,
+                     "workerCount has to be set when passing worker allocators",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    _outResults.clear();
+    _outResults.resize(_count);
+
+    Size workerCount = _settings.workerCount;
+    if (!workerCount)
+        workerCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // workers pull the next image off a shared counter rather than splitting the input up front,
+    // so a few big images in a batch of small ones don't leave the other workers idle
+    std::atomic<Size> next(0);
+    auto work = [&](Size _worker) {
+        Allocator & alloc =
+            _settings.workerAllocators ? *_settings.workerAllocators[_worker] : defaultAllocator();
+        // the images outlive the call, so only the temporary buffers come from an arena
+        ScratchArena scratch;
+        ScratchScope scratchScope(_settings.workerAllocators ? nullptr : &scratch);
+        for (Size i = next++; i < _count; i = next++)
+        {
+            DecodedImage & result = _outResults[i];
+            if (_data[i].isEmpty())
+            {
+                result.error =
+                    Error(ec::InvalidOperation, "No data to decode", STICK_FILE, STICK_LINE);
+                continue;
+            }
+
+            auto res = decodeImage(_data[i], alloc);
+            if (res)
+                result.image = std::move(res.get());
+            else
+                result.error = res.error();
+        }
+    };
+
+    runWorkers(std::min(workerCount, _count), work);
+    return Error();
+}
+
+// the state loadImages shares between the threads that read the files and the decode workers
+class BatchLoad
+{
+  public:
+    BatchLoad(const String * _paths,
+              Size _count,
+              DynamicArray<DecodedImage> & _results,
+              Size _maxBufferCount) :
+        m_paths(_paths),
+        m_results(_results),
+        m_buffers(_count),
+        m_queueFront(0),
+        m_bufferCount(0),
+        m_maxBufferCount(_maxBufferCount),
+        m_isReadingDone(false)
+    {
+        m_queue.reserve(_count);
+    }
+
+    Size count() const
+    {
+        return m_buffers.count();
+    }
+
+    const String & path(Size _index) const
+    {
+        return m_paths[_index];
+    }
+
+    ByteArray & buffer(Size _index)
+    {
+        return m_buffers[_index];
+    }
+
+    // reserves a buffer if fewer than the maximum are read or waiting to be decoded
+    bool tryAcquireBuffer()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_bufferCount == m_maxBufferCount)
+            return false;
+        ++m_bufferCount;
+        return true;
+    }
+
+    void acquireBuffer()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_bufferReleased.wait(lock, [this]() { return m_bufferCount < m_maxBufferCount; });
+        ++m_bufferCount;
+    }
+
+    // blocks until a buffer is free, without reserving it
+    void waitForBuffer()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_bufferReleased.wait(lock, [this]() { return m_bufferCount < m_maxBufferCount; });
+    }
+
+    // hands a file that was read completely to the decode workers
+    void pushRead(Size _index)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.append(_index);
+        }
+        m_fileRead.notify_one();
+    }
+
+    void fail(Size _index, const Error & _err)
+    {
+        m_results[_index].error = _err;
+        releaseBuffer(_index);
+    }
+
+    void finishReading()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isReadingDone = true;
+        }
+        m_fileRead.notify_all();
+    }
+
+    // the loop of a decode worker
+    void decode(const DecodeSettings & _settings, Allocator & _alloc)
+    {
+        while (true)
+        {
+            Size index;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_fileRead.wait(lock, [this]() {
+                    return m_queueFront < m_queue.count() || m_isReadingDone;
+                });
+                if (m_queueFront == m_queue.count())
+                    return;
+                index = m_queue[m_queueFront++];
+            }
+
+            DecodedImage & result = m_results[index];
+            if (m_buffers[index].isEmpty())
+            {
+                result.error =
+                    Error(ec::InvalidOperation, "No data to decode", STICK_FILE, STICK_LINE);
+            }
+            else
+            {
+                auto res = decodeImage(m_buffers[index], _settings, _alloc);
+                if (res)
+                    result.image = std::move(res.get());
+                else
+                    result.error = res.error();
+            }
+            releaseBuffer(index);
+        }
+    }
+
+  private:
+    void releaseBuffer(Size _index)
+    {
+        m_buffers[_index] = ByteArray();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_bufferCount;
+        }
+        m_bufferReleased.notify_one();
+    }
+
+    const String * m_paths;
+    DynamicArray<DecodedImage> & m_results;
+    DynamicArray<ByteArray> m_buffers;
+    std::mutex m_mutex;
+    std::condition_variable m_bufferReleased;
+    std::condition_variable m_fileRead;
+    // the indices of the files that were read, in the order they were read
+    DynamicArray<Size> m_queue;
+    Size m_queueFront;
+    Size m_bufferCount;
+    Size m_maxBufferCount;
+    bool m_isReadingDone;
+};
+
+static Error fileReadError(const String & _path)
+{
+    return Error(ec::InvalidOperation,
+                 String::formatted("Could not read file at %s", _path.cString()),
+                 STICK_FILE,
+                 STICK_LINE);
+}
+
+#ifdef PIC_HAS_MMAP
+// opens the file for loadImages and sizes _outBuffer to hold it
+static Error openForReading(const String & _path, int & _outFd, ByteArray & _outBuffer)
+{
+    _outFd = ::open(_path.cString(), O_RDONLY);
+    if (_outFd == -1)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    struct stat st;
+    if (fstat(_outFd, &st) != 0)
+    {
+        close(_outFd);
+        return fileReadError(_path);
+    }
+    _outBuffer.resize((Size)st.st_size);
+    return Error();
+}
+
+// reads the rest of the file, from _offset to the end of _buffer
+static bool readRest(int _fd, ByteArray & _buffer, Size _offset)
+{
+    while (_offset < _buffer.count())
+    {
+        ssize_t n = pread(_fd, &_buffer[_offset], _buffer.count() - _offset, (off_t)_offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        _offset += (Size)n;
+    }
+    return true;
+}
+#endif // PIC_HAS_MMAP
+
+static Error readFile(const String & _path, ByteArray & _outBuffer)
+{
+#ifdef PIC_HAS_MMAP
+    int fd;
+    Error err = openForReading(_path, fd, _outBuffer);
+    if (err)
+        return err;
+    bool isRead = readRest(fd, _outBuffer, 0);
+    close(fd);
+    return isRead ? Error() : fileReadError(_path);
+#else
+    auto res = loadBinaryFile(_path);
+    if (!res)
+        return res.error();
+    _outBuffer = std::move(res.get());
+    return Error();
+#endif // PIC_HAS_MMAP
+}
+
+#ifdef PIC_HAS_IO_URING
+// The submission and completion queues of an io_uring instance, only as much as loadImages needs
+// to read files.
+class IOURing
+{
+  public:
+    IOURing() :
+        m_fd(-1),
+        m_sqRing(MAP_FAILED),
+        m_cqRing(MAP_FAILED),
+        m_sqes(MAP_FAILED),
+        m_sqRingByteCount(0),
+        m_cqRingByteCount(0),
+        m_sqesByteCount(0),
+        m_unsubmittedCount(0),
+        m_inFlightCount(0)
+    {
+    }
+
+    ~IOURing()
+    {
+        if (m_sqes != MAP_FAILED)
+            munmap(m_sqes, m_sqesByteCount);
+        if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+            munmap(m_cqRing, m_cqRingByteCount);
+        if (m_sqRing != MAP_FAILED)
+            munmap(m_sqRing, m_sqRingByteCount);
+        if (m_fd != -1)
+            close(m_fd);
+    }
+
+    IOURing(const IOURing &) = delete;
+
+    IOURing & operator=(const IOURing &) = delete;
+
+    // fails if the kernel has no io_uring or it is disabled, i.e. in containers
+    bool init(unsigned _entryCount)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_fd = (int)syscall(__NR_io_uring_setup, _entryCount, &params);
+        if (m_fd < 0)
+        {
+            m_fd = -1;
+            return false;
+        }
+
+        m_sqRingByteCount = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingByteCount = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool isSingleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (isSingleMap)
+            m_sqRingByteCount = m_cqRingByteCount =
+                std::max(m_sqRingByteCount, m_cqRingByteCount);
+        m_sqRing = mmap(nullptr,
+                        m_sqRingByteCount,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        m_fd,
+                        IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED)
+            return false;
+        m_cqRing = isSingleMap ? m_sqRing
+                               : mmap(nullptr,
+                                      m_cqRingByteCount,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE,
+                                      m_fd,
+                                      IORING_OFF_CQ_RING);
+        m_sqesByteCount = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = mmap(nullptr,
+                      m_sqesByteCount,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      m_fd,
+                      IORING_OFF_SQES);
+        if (m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED)
+            return false;
+
+        char * sq = static_cast<char *>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqEntryCount = params.sq_entries;
+        m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        char * cq = static_cast<char *>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // queues a read of _byteCount bytes at _offset, returns false if the submission queue is full
+    bool queueRead(int _fd, char * _buffer, unsigned _byteCount, Size _offset, UInt64 _userData)
+    {
+        unsigned tail = *m_sqTail;
+        if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) == m_sqEntryCount)
+            return false;
+
+        unsigned index = tail & m_sqMask;
+        io_uring_sqe & sqe = static_cast<io_uring_sqe *>(m_sqes)[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = _fd;
+        sqe.addr = (UInt64)(uintptr_t)_buffer;
+        sqe.len = _byteCount;
+        sqe.off = (UInt64)_offset;
+        sqe.user_data = _userData;
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++m_unsubmittedCount;
+        return true;
+    }
+
+    // submits the queued reads in one system call and waits until one of the reads is done
+    bool submitAndWait()
+    {
+        while (true)
+        {
+            long n = syscall(__NR_io_uring_enter,
+                             m_fd,
+                             m_unsubmittedCount,
+                             1,
+                             IORING_ENTER_GETEVENTS,
+                             nullptr,
+                             0);
+            if (n >= 0)
+            {
+                m_unsubmittedCount -= (unsigned)n;
+                m_inFlightCount += (unsigned)n;
+                return true;
+            }
+            if (errno != EINTR)
+                return false;
+        }
+    }
+
+    // calls _fn(userData, result) for every completed read
+    template <class F>
+    void reap(F _fn)
+    {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe & cqe = m_cqes[head & m_cqMask];
+            --m_inFlightCount;
+            _fn(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Calls _fn(userData, result) for the reads that were submitted until all of them are done,
+    // without submitting the queued ones. The kernel may write to the buffers of submitted reads
+    // until they complete, even once the ring is closed. If waiting fails the completion queue is
+    // polled, as the completions are posted to it either way.
+    template <class F>
+    void drain(F _fn)
+    {
+        reap(_fn);
+        while (m_inFlightCount)
+        {
+            long n = syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n < 0 && errno != EINTR)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            reap(_fn);
+        }
+    }
+
+  private:
+    int m_fd;
+    void * m_sqRing;
+    void * m_cqRing;
+    void * m_sqes;
+    Size m_sqRingByteCount;
+    Size m_cqRingByteCount;
+    Size m_sqesByteCount;
+    unsigned * m_sqHead;
+    unsigned * m_sqTail;
+    unsigned m_sqMask;
+    unsigned m_sqEntryCount;
+    unsigned * m_sqArray;
+    unsigned * m_cqHead;
+    unsigned * m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe * m_cqes;
+    unsigned m_unsubmittedCount;
+    // submitted reads that did not complete yet
+    unsigned m_inFlightCount;
+};
+
+// Reads the files through io_uring on the calling thread, keeping up to _readsInFlight reads
+// submitted. Returns how many files it went through, which is less than all of them if io_uring
+// is not available or stops working, so the others can be read with threads.
+static Size readFilesWithIOURing(BatchLoad & _load, Size _readsInFlight)
+{
+    // io_uring caps the queue size, there is nothing to gain from more reads in flight anyway
+    _readsInFlight = std::min(_readsInFlight, (Size)4096);
+    IOURing ring;
+    if (!ring.init((unsigned)_readsInFlight))
+        return 0;
+
+    struct PendingRead
+    {
+        Size index;
+        int fd;
+        Size offset;
+    };
+    DynamicArray<PendingRead> reads(_readsInFlight);
+    DynamicArray<Size> freeSlots;
+    freeSlots.reserve(_readsInFlight);
+    for (Size i = 0; i < _readsInFlight; ++i)
+        freeSlots.append(_readsInFlight - 1 - i);
+
+    // reads more than 2GB in several parts, as the length of a read is 32 bit
+    auto queueRead = [&](Size _slot) {
+        PendingRead & read = reads[_slot];
+        ByteArray & buffer = _load.buffer(read.index);
+        Size byteCount = std::min(buffer.count() - read.offset, (Size)1 << 30);
+        ring.queueRead(read.fd, &buffer[read.offset], (unsigned)byteCount, read.offset, _slot);
+    };
+
+    auto finishRead = [&](Size _slot, bool _isRead) {
+        PendingRead & read = reads[_slot];
+        close(read.fd);
+        if (_isRead)
+            _load.pushRead(read.index);
+        else
+            _load.fail(read.index, fileReadError(_load.path(read.index)));
+        freeSlots.append(_slot);
+    };
+
+    Size next = 0;
+    while (next < _load.count() || freeSlots.count() < _readsInFlight)
+    {
+        // queue reads for as many files as there are free slots and buffers
+        while (next < _load.count() && freeSlots.count() && _load.tryAcquireBuffer())
+        {
+            Size index = next++;
+            int fd;
+            Error err = openForReading(_load.path(index), fd, _load.buffer(index));
+            if (err)
+            {
+                _load.fail(index, err);
+                continue;
+            }
+            if (_load.buffer(index).isEmpty())
+            {
+                close(fd);
+                _load.pushRead(index);
+                continue;
+            }
+
+            Size slot = freeSlots.last();
+            freeSlots.removeLast();
+            reads[slot] = { index, fd, 0 };
+            queueRead(slot);
+        }
+
+        // nothing is read, all buffers wait for a decode worker
+        if (freeSlots.count() == _readsInFlight)
+        {
+            _load.waitForBuffer();
+            continue;
+        }
+
+        if (!ring.submitAndWait())
+        {
+            // wait for the reads that were submitted before touching their buffers and fds, then
+            // finish all reads synchronously and leave the other files to the threads
+            ring.drain([&](UInt64 _slot, int _result) {
+                if (_result > 0)
+                    reads[_slot].offset += (Size)_result;
+            });
+            for (Size slot = 0; slot < _readsInFlight; ++slot)
+            {
+                if (std::find(freeSlots.begin(), freeSlots.end(), slot) != freeSlots.end())
+                    continue;
+                PendingRead & read = reads[slot];
+                finishRead(slot, readRest(read.fd, _load.buffer(read.index), read.offset));
+            }
+            return next;
+        }
+
+        ring.reap([&](UInt64 _slot, int _result) {
+            PendingRead & read = reads[_slot];
+            ByteArray & buffer = _load.buffer(read.index);
+            if (_result > 0)
+            {
+                read.offset += (Size)_result;
+                if (read.offset < buffer.count())
+                    queueRead(_slot);
+                else
+                    finishRead(_slot, true);
+            }
+            else if (_result == 0)
+            {
+                // the file got shorter since it was opened
+                finishRead(_slot, false);
+            }
+            else
+            {
+                // i.e. kernels before 5.6 don't know IORING_OP_READ
+                finishRead(_slot, readRest(read.fd, buffer, read.offset));
+            }
+        });
+    }
+    return next;
+}
+#endif // PIC_HAS_IO_URING
+
+// reads the files starting at _first with _threadCount threads, each reading one file at a time
+static void readFilesWithThreads(BatchLoad & _load, Size _first, Size _threadCount)
+{
+    std::atomic<Size> next(_first);
+    runWorkers(_threadCount, [&](Size) {
+        for (Size i = next++; i < _load.count(); i = next++)
+        {
+            _load.acquireBuffer();
+            Error err = readFile(_load.path(i), _load.buffer(i));
+            if (err)
+                _load.fail(i, err);
+            else
+                _load.pushRead(i);
+        }
+    });
+}
+
+Error loadImages(const String * _paths,
+                 Size _count,
+                 DynamicArray<DecodedImage> & _outResults,
+                 const LoadImagesSettings & _settings)
+{
+    if (!_settings.readsInFlight)
+        return Error(ec::InvalidOperation,
+                     "readsInFlight has to be at least 1",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (_settings.workerAllocators && !_settings.workerCount)
+        return Error(ec::InvalidOperation,
+                     "workerCount has to be set when passing worker allocators",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    _outResults.clear();
+    _outResults.resize(_count);
+
+    Size workerCount = _settings.workerCount;
+    if (!workerCount)
+        workerCount = std::max(std::thread::hardware_concurrency(), 1u);
+    workerCount = std::max(std::min(workerCount, _count), (Size)1);
+
+    BatchLoad load(_paths, _count, _outResults, _settings.readsInFlight);
+    DynamicArray<std::thread> workers;
+    workers.reserve(workerCount);
+    for (Size i = 0; i < workerCount; ++i)
+    {
+        Allocator & alloc =
+            _settings.workerAllocators ? *_settings.workerAllocators[i] : defaultAllocator();
+        workers.append(std::thread([&load, &_settings, &alloc]() {
+            ScratchArena scratch;
+            ScratchScope scratchScope(_settings.workerAllocators ? nullptr : &scratch);
+            load.decode(_settings.decodeSettings, alloc);
+        }));
+    }
+
+    Size first = 0;
+#ifdef PIC_HAS_IO_URING
+    if (!_settings.forceThreadedReads)
+        first = readFilesWithIOURing(load, _settings.readsInFlight);
+#endif // PIC_HAS_IO_URING
+    if (first < _count)
+    {
+        Size threadCount = _settings.readThreadCount;
+        if (!threadCount)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        threadCount = std::min(std::min(threadCount, _settings.readsInFlight), _count - first);
+        readFilesWithThreads(load, first, threadCount);
+    }
+
+    load.finishReading();
+    for (std::thread & t : workers)
+        t.join();
+    return Error();
+}
+
+struct ImageIOTask::State
+{
+    State() : isDone(false)
+    {
+    }
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::atomic<bool> isDone;
+    Error error;
+};
+
+ImageIOTask::ImageIOTask()
+{
+}
+
+bool ImageIOTask::isDone() const
+{
+    return m_state && m_state->isDone.load(std::memory_order_acquire);
+}
+
+Error ImageIOTask::wait() const
+{
+    if (!m_state)
+        return Error(ec::InvalidOperation, "The task was never submitted", STICK_FILE, STICK_LINE);
+
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    m_state->done.wait(lock, [this]() { return m_state->isDone.load(); });
+    return m_state->error;
+}
+
+struct ImageIOPool::State
+{
+    struct QueuedTask
+    {
+        std::function<Error()> task;
+        ImageIOTask handle;
+    };
+
+    State() : queueFront(0), queueDepth(0), isStopping(false)
+    {
+    }
+
+    DynamicArray<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable taskQueued;
+    // a ring buffer of maxQueueDepth tasks, the next one to run at queueFront
+    DynamicArray<QueuedTask> queue;
+    Size queueFront;
+    Size queueDepth;
+    bool isStopping;
+};
+
+ImageIOPool::ImageIOPool(const ImageIOPoolSettings & _settings) :
+    m_state(defaultAllocator().create<State>())
+{
+    m_state->queue.resize(std::max(_settings.maxQueueDepth, (Size)1));
+
+    Size threadCount = _settings.threadCount;
+    if (!threadCount)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    m_state->threads.reserve(threadCount);
+    for (Size i = 0; i < threadCount; ++i)
+        m_state->threads.append(std::thread([this]() { work(); }));
+}
+
+ImageIOPool::~ImageIOPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->isStopping = true;
+    }
+    m_state->taskQueued.notify_all();
+    for (std::thread & t : m_state->threads)
+        t.join();
+    defaultAllocator().destroy(m_state);
+}
+
+Result<ImageIOTask> ImageIOPool::submit(std::function<Error()> _task)
+{
+    State & pool = *m_state;
+    ImageIOTask handle;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.queueDepth == pool.queue.count())
+            return Error(ec::InvalidOperation, "The queue is full", STICK_FILE, STICK_LINE);
+
+        handle.m_state = std::make_shared<ImageIOTask::State>();
+        State::QueuedTask & queued =
+            pool.queue[(pool.queueFront + pool.queueDepth) % pool.queue.count()];
+        queued.task = std::move(_task);
+        queued.handle = handle;
+        ++pool.queueDepth;
+    }
+    pool.taskQueued.notify_one();
+    return handle;
+}
+
+Size ImageIOPool::threadCount() const
+{
+    return m_state->threads.count();
+}
+
+Size ImageIOPool::queueDepth() const
+{
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->queueDepth;
+}
+
+Size ImageIOPool::maxQueueDepth() const
+{
+    return m_state->queue.count();
+}
+
+void ImageIOPool::work()
+{
+    State & pool = *m_state;
+    while (true)
+    {
+        State::QueuedTask next;
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.taskQueued.wait(lock, [&pool]() { return pool.queueDepth || pool.isStopping; });
+            // the queued tasks still run when the pool is destroyed
+            if (!pool.queueDepth)
+                return;
+            next = std::move(pool.queue[pool.queueFront]);
+            pool.queueFront = (pool.queueFront + 1) % pool.queue.count();
+            --pool.queueDepth;
+        }
+
+        Error err = next.task();
+        ImageIOTask::State & state = *next.handle.m_state;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.error = err;
+            state.isDone.store(true, std::memory_order_release);
+        }
+        state.done.notify_all();
+    }
+}
+
+ImageIOPool & defaultImageIOPool()
+{
+    static ImageIOPool s_pool;
+    return s_pool;
+}
+
+Result<ImageIOTask> loadImageAsync(const String & _path,
+                                   LoadImageCallback _callback,
+                                   const DecodeSettings & _settings,
+                                   ImageIOPool & _pool,
+                                   Allocator & _alloc)
+{
+    Allocator * alloc = &_alloc;
+    return _pool.submit([_path, _callback, _settings, alloc]() {
+        auto res = loadImage(_path, _settings, *alloc);
+        Error err = res ? Error() : res.error();
+        if (_callback)
+            _callback(std::move(res));
+        return err;
+    });
+}
+
+Result<ImageIOTask> saveAsync(Image & _image,
+                              const String & _path,
+                              SaveImageCallback _callback,
+                              const SaveSettings & _settings,
+                              ImageIOPool & _pool)
+{
+    Image * image = &_image;
+    return _pool.submit([image, _path, _callback, _settings]() {
+        Error err = image->save(_path, _settings);
+        if (_callback)
+            _callback(err);
+        return err;
+    });
+}
+
+// .pic files start with this header, followed by the pixel storage of the image (row padding
+// included) at dataOffset, which is 64 byte aligned.
+struct PicFileHeader
+{
+    char magic[4];
+    // 0x01020304 in the byte order of the writer, files from hosts with a different byte order
+    // are rejected as the pixels are used as they are
+    UInt32 byteOrder;
+    UInt32 version;
+    // the index in s_picPixelFormats, as TypeIDs are not stable between runs
+    UInt32 pixelFormat;
+    UInt32 channelCount;
+    UInt32 bitsPerChannel;
+    UInt32 isFloatingPoint;
+    // crc32 of the pixel data
+    UInt32 checksum;
+    // s_picFlagNoChecksum if the file was written by a StreamEncoder, which only knows the
+    // checksum once the header is written
+    UInt32 flags;
+    UInt32 reserved;
+    UInt64 width;
+    UInt64 height;
+    UInt64 depth;
+    UInt64 rowPadding;
+    UInt64 dataOffset;
+    UInt64 byteCount;
+};
+
+static_assert(sizeof(PicFileHeader) == 88, "unexpected .pic header size");
+
+static const char s_picMagic[4] = { 'P', 'I', 'C', 0x1a };
+static const UInt32 s_picByteOrder = 0x01020304;
+static const UInt32 s_picVersion = 1;
+static const Size s_picDataOffset = 128;
+static const UInt32 s_picFlagNoChecksum = 1;
+
+struct PicPixelFormat
+{
+    TypeID pixelTypeID;
+    TypeID channelLayoutTypeID;
+    UInt32 channelCount;
+    UInt32 bitsPerChannel;
+    bool isFloatingPoint;
+    ImageUniquePtr (*create)(Allocator & _alloc);
+};
+
+template <class T>
+static ImageUniquePtr createPicImage(Allocator & _alloc)
+{
+    return makeUnique<T>(_alloc, _alloc);
+}
+
+template <class T>
+static PicPixelFormat picPixelFormat()
+{
+    return { T::pixelTID,
+             T::channelLayoutTID,
+             T::Pixel::channelCount(),
+             (UInt32)sizeof(typename T::ValueType) * 8,
+             T::Pixel::isFloatingPoint(),
+             createPicImage<T> };
+}
+
+// .pic files store the index of their format in this table, so only ever append to it
+static const PicPixelFormat s_picPixelFormats[] = {
+    picPixelFormat<ImageGray8>(),        picPixelFormat<ImageGrayAlpha8>(),
+    picPixelFormat<ImageAlphaGray8>(),   picPixelFormat<ImageRGB8>(),
+    picPixelFormat<ImageBGR8>(),         picPixelFormat<ImageRGBA8>(),
+    picPixelFormat<ImageBGRA8>(),        picPixelFormat<ImageARGB8>(),
+    picPixelFormat<ImageABGR8>(),        picPixelFormat<ImageGray16>(),
+    picPixelFormat<ImageGrayAlpha16>(),  picPixelFormat<ImageAlphaGray16>(),
+    picPixelFormat<ImageRGB16>(),        picPixelFormat<ImageBGR16>(),
+    picPixelFormat<ImageRGBA16>(),       picPixelFormat<ImageBGRA16>(),
+    picPixelFormat<ImageARGB16>(),       picPixelFormat<ImageABGR16>(),
+    picPixelFormat<ImageGray32>(),       picPixelFormat<ImageGrayAlpha32>(),
+    picPixelFormat<ImageAlphaGray32>(),  picPixelFormat<ImageRGB32>(),
+    picPixelFormat<ImageBGR32>(),        picPixelFormat<ImageRGBA32>(),
+    picPixelFormat<ImageBGRA32>(),       picPixelFormat<ImageARGB32>(),
+    picPixelFormat<ImageABGR32>(),       picPixelFormat<ImageGray32f>(),
+    picPixelFormat<ImageGrayAlpha32f>(), picPixelFormat<ImageAlphaGray32f>(),
+    picPixelFormat<ImageRGB32f>(),       picPixelFormat<ImageBGR32f>(),
+    picPixelFormat<ImageRGBA32f>(),      picPixelFormat<ImageBGRA32f>(),
+    picPixelFormat<ImageARGB32f>(),      picPixelFormat<ImageABGR32f>()
+};
+
+static const Size s_picPixelFormatCount = sizeof(s_picPixelFormats) / sizeof(PicPixelFormat);
+
+static bool isPicFile(const void * _data, Size _byteCount)
+{
+    return _byteCount >= sizeof(PicFileHeader) && memcmp(_data, s_picMagic, 4) == 0;
+}
+
+static bool hasPicExtension(const String & _path)
+{
+    return path::extension(_path) == ".pic";
+}
+
+// validates the header of a .pic file that is _fileByteCount bytes long, of which _byteCount bytes
+// are at _data
+static Error readPicHeader(const void * _data,
+                           Size _byteCount,
+                           Size _fileByteCount,
+                           PicFileHeader & _out)
+{
+    if (!isPicFile(_data, _byteCount))
+        return Error(ec::InvalidOperation, "Not a .pic file", STICK_FILE, STICK_LINE);
+
+    memcpy(&_out, _data, sizeof(PicFileHeader));
+    if (_out.byteOrder != s_picByteOrder)
+        return Error(ec::Unsupported,
+                     "The .pic file was written on a host with a different byte order",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (_out.version != s_picVersion)
+        return Error(ec::Unsupported, "Unsupported .pic file version", STICK_FILE, STICK_LINE);
+    if (_out.pixelFormat >= s_picPixelFormatCount)
+        return Error(ec::Unsupported, "Unsupported .pic pixel format", STICK_FILE, STICK_LINE);
+
+    // the sizes are untrusted, none of the products may wrap around
+    const PicPixelFormat & fmt = s_picPixelFormats[_out.pixelFormat];
+    UInt64 bitsPerPixel = fmt.channelCount * fmt.bitsPerChannel;
+    UInt64 maxValue = std::numeric_limits<UInt64>::max();
+    UInt64 bytesPerRow = 0;
+    bool hasValidSize = _out.width && _out.height && _out.depth &&
+                        _out.width <= maxValue / bitsPerPixel &&
+                        _out.rowPadding <= maxValue - _out.width * bitsPerPixel / 8;
+    if (hasValidSize)
+    {
+        bytesPerRow = _out.width * bitsPerPixel / 8 + _out.rowPadding;
+        hasValidSize = _out.height <= maxValue / bytesPerRow &&
+                       _out.depth <= maxValue / (bytesPerRow * _out.height) &&
+                       _out.byteCount == bytesPerRow * _out.height * _out.depth;
+    }
+    if (!hasValidSize || fmt.channelCount != _out.channelCount ||
+        fmt.bitsPerChannel != _out.bitsPerChannel ||
+        fmt.isFloatingPoint != (_out.isFloatingPoint != 0) || _out.dataOffset % 64 != 0 ||
+        _out.dataOffset > _fileByteCount || _out.byteCount > _fileByteCount - _out.dataOffset)
+        return Error(ec::InvalidOperation, "Corrupt .pic file header", STICK_FILE, STICK_LINE);
+    return Error();
+}
+
+static Error checkPicChecksum(const PicFileHeader & _header, const void * _pixels)
+{
+    if (!(_header.flags & s_picFlagNoChecksum) &&
+        crc32(0, _pixels, _header.byteCount) != _header.checksum)
+        return Error(
+            ec::InvalidOperation, "The .pic file checksum does not match", STICK_FILE, STICK_LINE);
+    return Error();
+}
+
+// creates an image of the right type and size for the pixels of a .pic file
+static Result<ImageUniquePtr> createImageForPicFile(const PicFileHeader & _header,
+                                             const DecodeSettings & _settings,
+                                             Allocator & _alloc)
+{
+    if (_settings.channelCount && _settings.channelCount != _header.channelCount)
+        return Error(ec::Unsupported,
+                     "The channel count can't be converted when reading .pic files",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    ImageUniquePtr ret = s_picPixelFormats[_header.pixelFormat].create(_alloc);
+    ret->resize(_header.width, _header.height, _header.depth, _header.rowPadding);
+    return ret;
+}
+
+static Result<ImageUniquePtr> decodePicFile(const void * _data,
+                                            Size _byteCount,
+                                            const DecodeSettings & _settings,
+                                            Allocator & _alloc)
+{
+    PicFileHeader header;
+    Error err = readPicHeader(_data, _byteCount, _byteCount, header);
+    if (err)
+        return err;
+
+    const char * pixels = static_cast<const char *>(_data) + header.dataOffset;
+    err = checkPicChecksum(header, pixels);
+    if (err)
+        return err;
+
+    auto res = createImageForPicFile(header, _settings, _alloc);
+    if (!res)
+        return res;
+    memcpy(res.get()->bytePtr(), pixels, header.byteCount);
+    if (_settings.flipVertically)
+        res.get()->flipRows();
+    return res;
+}
+
+// reads the pixels from the file straight into the image storage
+static Result<ImageUniquePtr> loadPicFile(const String & _path,
+                                          const DecodeSettings & _settings,
+                                          Allocator & _alloc)
+{
+    FILE * file = fopen(_path.cString(), "rb");
+    if (!file)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    auto load = [&]() -> Result<ImageUniquePtr> {
+        char head[s_picDataOffset];
+        Size headByteCount = fread(head, 1, sizeof(head), file);
+        fseek(file, 0, SEEK_END);
+        Size fileByteCount = (Size)ftell(file);
+
+        PicFileHeader header;
+        Error err = readPicHeader(head, headByteCount, fileByteCount, header);
+        if (err)
+            return err;
+
+        auto res = createImageForPicFile(header, _settings, _alloc);
+        if (!res)
+            return res;
+        char * pixels = res.get()->bytePtr();
+        fseek(file, (long)header.dataOffset, SEEK_SET);
+        if (fread(pixels, 1, header.byteCount, file) != header.byteCount)
+            return Error(ec::InvalidOperation,
+                         String::formatted("Could not read file at %s", _path.cString()),
+                         STICK_FILE,
+                         STICK_LINE);
+
+        err = checkPicChecksum(header, pixels);
+        if (err)
+            return err;
+        if (_settings.flipVertically)
+            res.get()->flipRows();
+        return res;
+    };
+
+    auto ret = load();
+    fclose(file);
+    return ret;
+}
+
+static Result<ImageInfo> probePicFile(const void * _data, Size _byteCount)
+{
+    PicFileHeader header;
+    // the pixel data does not need to be there for probing
+    Error err = readPicHeader(_data, _byteCount, std::numeric_limits<Size>::max(), header);
+    if (err)
+        return err;
+
+    ImageInfo ret;
+    ret.width = header.width;
+    ret.height = header.height;
+    ret.channelCount = header.channelCount;
+    ret.is16Bit = header.bitsPerChannel == 16;
+    ret.isHDR = header.isFloatingPoint != 0;
+    ret.pixelTypeID = s_picPixelFormats[header.pixelFormat].pixelTypeID;
+    return ret;
+}
+
+static Result<ImageInfo> probePicFile(const String & _path)
+{
+    FILE * file = fopen(_path.cString(), "rb");
+    if (!file)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    char head[sizeof(PicFileHeader)];
+    Size byteCount = fread(head, 1, sizeof(head), file);
+    fclose(file);
+    return probePicFile(head, byteCount);
+}
+
+// the index of the pixel type in s_picPixelFormats or an error if it is not in the table
+static Result<UInt32> picPixelFormatIndex(TypeID _pixelTypeID)
+{
+    for (UInt32 i = 0; i < s_picPixelFormatCount; ++i)
+    {
+        if (s_picPixelFormats[i].pixelTypeID == _pixelTypeID)
+            return i;
+    }
+    return Error(ec::Unsupported, "Unsupported pixel type", STICK_FILE, STICK_LINE);
+}
+
+// the first s_picDataOffset bytes of a .pic file, without checksum
+static void writePicHeader(UInt32 _pixelFormat,
+                           Size _width,
+                           Size _height,
+                           Size _depth,
+                           Size _rowPadding,
+                           char (&_out)[s_picDataOffset])
+{
+    const PicPixelFormat & fmt = s_picPixelFormats[_pixelFormat];
+    PicFileHeader header;
+    memcpy(header.magic, s_picMagic, 4);
+    header.byteOrder = s_picByteOrder;
+    header.version = s_picVersion;
+    header.pixelFormat = _pixelFormat;
+    header.channelCount = fmt.channelCount;
+    header.bitsPerChannel = fmt.bitsPerChannel;
+    header.isFloatingPoint = fmt.isFloatingPoint;
+    header.checksum = 0;
+    header.flags = s_picFlagNoChecksum;
+    header.reserved = 0;
+    header.width = _width;
+    header.height = _height;
+    header.depth = _depth;
+    header.rowPadding = _rowPadding;
+    header.dataOffset = s_picDataOffset;
+    header.byteCount =
+        (_width * fmt.channelCount * fmt.bitsPerChannel / 8 + _rowPadding) * _height * _depth;
+
+    memset(_out, 0, s_picDataOffset);
+    memcpy(_out, &header, sizeof(header));
+}
+
+// the index of the pixel format of _image, or an error if it can't be written to a .pic file
+static Result<UInt32> picFileFormat(const Image & _image)
+{
+    auto ret = picPixelFormatIndex(_image.pixelTypeID());
+    if (!ret)
+        return Error(ec::Unsupported,
+                     "The pixel type can't be stored in .pic files",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (!_image.width() || !_image.height() || !_image.depth())
+        return Error(
+            ec::InvalidOperation, "Can't write an empty .pic file", STICK_FILE, STICK_LINE);
+    return ret;
+}
+
+// writes the header and the pixels through _write, which returns false if writing failed
+template <class F>
+static Error writePicFile(const Image & _image, UInt32 _format, F _write)
+{
+    char head[s_picDataOffset];
+    writePicHeader(_format,
+                   _image.width(),
+                   _image.height(),
+                   _image.depth(),
+                   _image.rowPadding(),
+                   head);
+    PicFileHeader & header = reinterpret_cast<PicFileHeader &>(head);
+    header.checksum = crc32(0, _image.bytePtr(), _image.byteCount());
+    header.flags = 0;
+    if (!_write(head, s_picDataOffset) || !_write(_image.bytePtr(), _image.byteCount()))
+        return Error(ec::InvalidOperation, "Could not write .pic file", STICK_FILE, STICK_LINE);
+    return Error();
+}
+
+static Error encodePicFile(const Image & _image, ByteArray & _out)
+{
+    auto format = picFileFormat(_image);
+    if (!format)
+        return format.error();
+
+    _out.reserve(_out.count() + s_picDataOffset + _image.byteCount());
+    return writePicFile(_image, format.get(), [&](const char * _data, Size _byteCount) {
+        _out.insert(_out.end(), _data, _data + _byteCount);
+        return true;
+    });
+}
+
+static Error savePicFile(const Image & _image, const String & _path)
+{
+    // don't truncate an existing file for an image that can't be written
+    auto format = picFileFormat(_image);
+    if (!format)
+        return format.error();
+
+    FILE * file = fopen(_path.cString(), "wb");
+    if (!file)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    Error err = writePicFile(_image, format.get(), [&](const char * _data, Size _byteCount) {
+        return fwrite(_data, 1, _byteCount, file) == _byteCount;
+    });
+    if (fclose(file) != 0 && !err)
+        err = Error(ec::InvalidOperation,
+                    String::formatted("Could not write file at %s", _path.cString()),
+                    STICK_FILE,
+                    STICK_LINE);
+    // don't leave partially written files behind
+    if (err)
+        remove(_path.cString());
+    return err;
+}
+
+MappedImage::MappedImage() :
+    m_mapping(nullptr),
+    m_mappingByteCount(0),
+    m_pixels(nullptr),
+    m_width(0),
+    m_height(0),
+    m_depth(0),
+    m_rowPadding(0),
+    m_byteCount(0),
+    m_channelCount(0),
+    m_bitsPerChannel(0),
+    m_isFloatingPoint(false),
+    m_pixelTypeID()
+{
+}
+
+MappedImage::MappedImage(MappedImage && _other) : MappedImage()
+{
+    *this = std::move(_other);
+}
+
+MappedImage::~MappedImage()
+{
+#ifdef PIC_HAS_MMAP
+    if (m_mapping)
+        munmap(m_mapping, m_mappingByteCount);
+#endif // PIC_HAS_MMAP
+}
+
+MappedImage & MappedImage::operator=(MappedImage && _other)
+{
+    std::swap(m_mapping, _other.m_mapping);
+    std::swap(m_mappingByteCount, _other.m_mappingByteCount);
+    m_pixels = _other.m_pixels;
+    m_width = _other.m_width;
+    m_height = _other.m_height;
+    m_depth = _other.m_depth;
+    m_rowPadding = _other.m_rowPadding;
+    m_byteCount = _other.m_byteCount;
+    m_channelCount = _other.m_channelCount;
+    m_bitsPerChannel = _other.m_bitsPerChannel;
+    m_isFloatingPoint = _other.m_isFloatingPoint;
+    m_pixelTypeID = _other.m_pixelTypeID;
+    return *this;
+}
+
+Size MappedImage::width() const
+{
+    return m_width;
+}
+
+Size MappedImage::height() const
+{
+    return m_height;
+}
+
+Size MappedImage::depth() const
+{
+    return m_depth;
+}
+
+Size MappedImage::rowPadding() const
+{
+    return m_rowPadding;
+}
+
+Size MappedImage::bytesPerRow() const
+{
+    return m_width * m_channelCount * m_bitsPerChannel / 8 + m_rowPadding;
+}
+
+Size MappedImage::byteCount() const
+{
+    return m_byteCount;
+}
+
+UInt32 MappedImage::channelCount() const
+{
+    return m_channelCount;
+}
+
+Size MappedImage::bitsPerChannel() const
+{
+    return m_bitsPerChannel;
+}
+
+bool MappedImage::isFloatingPoint() const
+{
+    return m_isFloatingPoint;
+}
+
+TypeID MappedImage::pixelTypeID() const
+{
+    return m_pixelTypeID;
+}
+
+const char * MappedImage::bytePtr() const
+{
+    return m_pixels;
+}
+
+Result<MappedImage> mapImage(const String & _path, bool _verifyChecksum)
+{
+    MappedFile file;
+    Error err = file.open(_path);
+    if (err)
+        return err;
+
+    PicFileHeader header;
+    err = readPicHeader(file.data(), file.byteCount(), file.byteCount(), header);
+    if (err)
+        return err;
+
+    const char * pixels = static_cast<const char *>(file.data()) + header.dataOffset;
+    if (_verifyChecksum)
+    {
+        err = checkPicChecksum(header, pixels);
+        if (err)
+            return err;
+    }
+
+#ifdef PIC_HAS_MMAP
+    // MappedFile asks for sequential access, views are accessed in any order
+    madvise(const_cast<void *>(file.data()), file.byteCount(), MADV_NORMAL);
+#endif // PIC_HAS_MMAP
+
+    MappedImage ret;
+    ret.m_mappingByteCount = file.byteCount();
+    ret.m_mapping = file.release();
+    ret.m_pixels = pixels;
+    ret.m_width = header.width;
+    ret.m_height = header.height;
+    ret.m_depth = header.depth;
+    ret.m_rowPadding = header.rowPadding;
+    ret.m_byteCount = header.byteCount;
+    ret.m_channelCount = header.channelCount;
+    ret.m_bitsPerChannel = header.bitsPerChannel;
+    ret.m_isFloatingPoint = header.isFloatingPoint != 0;
+    ret.m_pixelTypeID = s_picPixelFormats[header.pixelFormat].pixelTypeID;
+    return ret;
+}
+
+// rows converted to the png layout at a time, along with the row above them
+static const Size s_pngConversionRowCount = 32;
+
+// How the rows of an image are stored in a png: channels in gray (alpha) or rgb(a) order and 16
+// bit values big endian. Rows of images that already match are filtered where they are.
+struct PNGRowFormat
+{
+    Size width;
+    UInt32 channelCount;
+    Size bytesPerChannel;
+    bool reorder;
+    // the source channel of each png channel
+    UInt32 mapping[4];
+};
+
+static PNGRowFormat pngRowFormat(Size _width,
+                                 UInt32 _channelCount,
+                                 Size _bitsPerChannel,
+                                 TypeID _channelLayoutTypeID)
+{
+    PNGRowFormat ret = { _width, _channelCount, _bitsPerChannel / 8, false, { 0, 1, 2, 3 } };
+    UInt32 order[4];
+    if (!canonicalChannelOrder(_channelLayoutTypeID, order))
+        return ret;
+    for (UInt32 i = 0; i < ret.channelCount; ++i)
+    {
+        ret.mapping[order[i]] = i;
+        ret.reorder = ret.reorder || order[i] != i;
+    }
+    return ret;
+}
+
+static PNGRowFormat pngRowFormat(const Image & _image)
+{
+    return pngRowFormat(_image.width(),
+                        _image.channelCount(),
+                        _image.bitsPerChannel(),
+                        _image.channelLayoutTypeID());
+}
+
+static bool needsPNGConversion(const PNGRowFormat & _format)
+{
+    return _format.reorder || _format.bytesPerChannel == 2;
+}
+
+// swaps the bytes of _count 16 bit values, _src and _dst may be the same
+static void byteSwap16(const UInt8 * _src, UInt8 * _dst, Size _count)
+{
+    Size i = 0;
+#ifdef PIC_HAS_SSE2
+    for (; i + 8 <= _count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(_src + i * 2));
+        _mm_storeu_si128((__m128i *)(_dst + i * 2),
+                         _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif // PIC_HAS_SSE2
+    for (; i < _count; ++i)
+    {
+        UInt8 tmp = _src[i * 2];
+        _dst[i * 2] = _src[i * 2 + 1];
+        _dst[i * 2 + 1] = tmp;
+    }
+}
+
+static void convertPNGRow(const PNGRowFormat & _format, const UInt8 * _src, UInt8 * _dst)
+{
+    Size valueCount = _format.width * _format.channelCount;
+    if (_format.reorder)
+    {
+        Size bpc = _format.bytesPerChannel;
+        Size bpp = bpc * _format.channelCount;
+        for (Size x = 0; x < _format.width; ++x)
+            for (UInt32 c = 0; c < _format.channelCount; ++c)
+                memcpy(_dst + x * bpp + c * bpc, _src + x * bpp + _format.mapping[c] * bpc, bpc);
+        _src = _dst;
+    }
+    if (_format.bytesPerChannel == 2)
+        byteSwap16(_src, _dst, valueCount);
+    else if (_src != _dst)
+        memcpy(_dst, _src, valueCount);
+}
+
+static UInt8 paethPredictor(int _a, int _b, int _c)
+{
+    int p = _a + _b - _c;
+    int pa = abs(p - _a);
+    int pb = abs(p - _b);
+    int pc = abs(p - _c);
+    if (pa <= pb && pa <= pc)
+        return (UInt8)_a;
+    return (UInt8)(pb <= pc ? _b : _c);
+}
+
+// Applies png filter _filter to a row of _byteCount bytes with _bpp bytes per pixel. _above is
+// the row above or null for the first row, which the filters treat as all zeros.
+static void filterPNGLine(const UInt8 * _row,
+                          const UInt8 * _above,
+                          Size _byteCount,
+                          Size _bpp,
+                          int _filter,
+                          UInt8 * _out)
+{
+    if (!_above)
+    {
+        // up is none and paeth is sub without a row above
+        if (_filter == 2)
+            _filter = 0;
+        else if (_filter == 4)
+            _filter = 1;
+        else if (_filter == 3)
+        {
+            for (Size i = 0; i < _byteCount; ++i)
+                _out[i] = _row[i] - (i < _bpp ? 0 : _row[i - _bpp] >> 1);
+            return;
+        }
+    }
+
+    Size i = 0;
+    switch (_filter)
+    {
+    case 0:
+        memcpy(_out, _row, _byteCount);
+        break;
+    case 1:
+        for (; i < _bpp; ++i)
+            _out[i] = _row[i];
+        for (; i < _byteCount; ++i)
+            _out[i] = _row[i] - _row[i - _bpp];
+        break;
+    case 2:
+        for (; i < _byteCount; ++i)
+            _out[i] = _row[i] - _above[i];
+        break;
+    case 3:
+        for (; i < _bpp; ++i)
+            _out[i] = _row[i] - (_above[i] >> 1);
+        for (; i < _byteCount; ++i)
+            _out[i] = _row[i] - ((_row[i - _bpp] + _above[i]) >> 1);
+        break;
+    case 4:
+        for (; i < _bpp; ++i)
+            _out[i] = _row[i] - _above[i];
+        for (; i < _byteCount; ++i)
+            _out[i] = _row[i] - paethPredictor(_row[i - _bpp], _above[i], _above[i - _bpp]);
+        break;
+    }
+}
+
+// Writes the filter type and filtered bytes of _rowCount rows. Unless _forceFilter picks one, the
+// filter with the smallest sum of absolute differences is used for each row, like stb does.
+// _rows points at the row above the first one if _hasRowAbove is set, which the filters refer to.
+static void filterPNGRows(const UInt8 * _rows,
+                          Size _stride,
+                          Size _width,
+                          Size _bytesPerPixel,
+                          bool _hasRowAbove,
+                          Size _rowCount,
+                          int _forceFilter,
+                          UInt8 * _lineBuffer,
+                          UInt8 * _out)
+{
+    Size byteCount = _width * _bytesPerPixel;
+    const UInt8 * above = _hasRowAbove ? _rows : nullptr;
+    const UInt8 * row = _hasRowAbove ? _rows + _stride : _rows;
+    for (Size y = 0; y < _rowCount; ++y, above = row, row += _stride, _out += byteCount + 1)
+    {
+        int filter = _forceFilter;
+        if (filter < 0)
+        {
+            Size best = std::numeric_limits<Size>::max();
+            for (int f = 0; f < 5; ++f)
+            {
+                filterPNGLine(row, above, byteCount, _bytesPerPixel, f, _lineBuffer);
+                Size sum = 0;
+                for (Size i = 0; i < byteCount; ++i)
+                    sum += abs((signed char)_lineBuffer[i]);
+                if (sum < best)
+                {
+                    best = sum;
+                    filter = f;
+                }
+            }
+        }
+        _out[0] = (UInt8)filter;
+        filterPNGLine(row, above, byteCount, _bytesPerPixel, filter, _out + 1);
+    }
+}
+
+static void writeBigEndian(UInt32 _value, UInt8 * _out)
+{
+    _out[0] = (UInt8)(_value >> 24);
+    _out[1] = (UInt8)(_value >> 16);
+    _out[2] = (UInt8)(_value >> 8);
+    _out[3] = (UInt8)_value;
+}
+
+// the png signature and IHDR chunk
+static const Size s_pngHeaderByteCount = 8 + 25;
+
+static void writePNGHeader(Size _width, Size _height, const PNGRowFormat & _format, UInt8 * _out)
+{
+    static const UInt8 s_colorTypes[5] = { 0, 0, 4, 2, 6 };
+    static const UInt8 s_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+    memcpy(_out, s_signature, 8);
+    UInt8 * o = _out + 8;
+    writeBigEndian(13, o);
+    memcpy(o + 4, "IHDR", 4);
+    writeBigEndian((UInt32)_width, o + 8);
+    writeBigEndian((UInt32)_height, o + 12);
+    o[16] = (UInt8)(_format.bytesPerChannel * 8);
+    o[17] = s_colorTypes[_format.channelCount];
+    o[18] = o[19] = o[20] = 0;
+    writeBigEndian(crc32(0, o + 4, 17), o + 21);
+}
+
+// the 8 bytes of a png chunk in front of its _byteCount bytes of data and the 4 bytes behind them
+static void writePNGChunkFrame(const char * _type,
+                               UInt8 * _data,
+                               Size _byteCount,
+                               UInt8 * _front,
+                               UInt8 * _back)
+{
+    writeBigEndian((UInt32)_byteCount, _front);
+    memcpy(_front + 4, _type, 4);
+    writeBigEndian(crc32(crc32(0, _front + 4, 4), _data, _byteCount), _back);
+}
+
+// the filtered png bytes deflated at a time when streaming. Every segment ends with a sync flush,
+// which costs a few bytes, so they shouldn't be too small.
+static const Size s_pngStreamSegmentByteCount = 1 << 18;
+// how far back deflate can refer
+static const Size s_deflateWindowSize = 32768;
+
+static void writeLittleEndian(UInt32 _value, Size _byteCount, UInt8 * _out)
+{
+    for (Size i = 0; i < _byteCount; ++i)
+        _out[i] = (UInt8)(_value >> (i * 8));
+}
+
+// run length encodes a tga row of _width pixels of _bpp bytes and returns the encoded byte count
+static Size encodeTGARLE(const UInt8 * _row, Size _width, Size _bpp, UInt8 * _out)
+{
+    UInt8 * o = _out;
+    for (Size i = 0, len = 1; i < _width; i += len, len = 1)
+    {
+        const UInt8 * p = _row + i * _bpp;
+        if (i + 1 < _width && !memcmp(p, p + _bpp, _bpp))
+        {
+            while (i + len < _width && len < 128 && !memcmp(p, p + len * _bpp, _bpp))
+                ++len;
+            *o++ = (UInt8)(0x80 | (len - 1));
+            memcpy(o, p, _bpp);
+            o += _bpp;
+        }
+        else
+        {
+            // raw pixels up to the next two equal ones, which start a run
+            while (i + len < _width && len < 128 &&
+                   (i + len + 1 == _width || memcmp(p + len * _bpp, p + (len + 1) * _bpp, _bpp)))
+                ++len;
+            *o++ = (UInt8)(len - 1);
+            memcpy(o, p, len * _bpp);
+            o += len * _bpp;
+        }
+    }
+    return o - _out;
+}
+
+static PNGRowFormat pngRowFormat(Size _width, UInt32 _pixelFormat)
+{
+    const PicPixelFormat & fmt = s_picPixelFormats[_pixelFormat];
+    return pngRowFormat(_width, fmt.channelCount, fmt.bitsPerChannel, fmt.channelLayoutTypeID);
+}
+
+StreamEncoder::StreamEncoder(Allocator & _alloc) :
+    m_alloc(&_alloc),
+    m_writer(nullptr),
+    m_format(ImageFormat::PNG),
+    m_pixelFormat(0),
+    m_width(0),
+    m_height(0),
+    m_rowCount(0),
+    m_isEncoding(false),
+    m_rows(_alloc),
+    m_lineBuffer(_alloc),
+    m_pending(_alloc),
+    m_dictionaryByteCount(0),
+    m_compressed(_alloc),
+    m_adler(1)
+{
+}
+
+Error StreamEncoder::begin(Writer & _writer,
+                           ImageFormat _format,
+                           TypeID _pixelTypeID,
+                           Size _width,
+                           Size _height,
+                           const SaveSettings & _settings)
+{
+    m_isEncoding = false;
+    auto pixelFormat = picPixelFormatIndex(_pixelTypeID);
+    if (!pixelFormat)
+        return pixelFormat.error();
+    if (!_width || !_height)
+        return Error(ec::InvalidOperation, "Can't encode an empty image", STICK_FILE, STICK_LINE);
+
+    const PicPixelFormat & fmt = s_picPixelFormats[pixelFormat.get()];
+    if (_format == ImageFormat::PNG)
+    {
+        if (fmt.isFloatingPoint || fmt.bitsPerChannel > 16)
+            return Error(ec::Unsupported,
+                         "Only 8 and 16 bit images can be written to png files",
+                         STICK_FILE,
+                         STICK_LINE);
+        if (_width > 0x7fffffff || _height > 0x7fffffff)
+            return Error(
+                ec::InvalidOperation, "The image is too big for a png", STICK_FILE, STICK_LINE);
+    }
+    else if (_format == ImageFormat::BMP || _format == ImageFormat::TGA)
+    {
+        if (fmt.bitsPerChannel != 8)
+            return Error(ec::Unsupported,
+                         "Only 8 bit images can be written to bmp and tga files",
+                         STICK_FILE,
+                         STICK_LINE);
+        Size maxSize = _format == ImageFormat::TGA ? 0xffff : 0x7fffffff / 4;
+        if (_width > maxSize || _height > maxSize)
+            return Error(ec::InvalidOperation,
+                         "The image is too big for a bmp or tga",
+                         STICK_FILE,
+                         STICK_LINE);
+    }
+    else if (_format != ImageFormat::Pic)
+        return Error(ec::Unsupported,
+                     "Only png, bmp, tga and .pic files can be encoded as a stream",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    m_writer = &_writer;
+    m_format = _format;
+    m_settings = _settings;
+    m_pixelFormat = pixelFormat.get();
+    m_width = _width;
+    m_height = _height;
+    m_rowCount = 0;
+    m_pending.clear();
+    m_dictionaryByteCount = 0;
+    m_adler = 1;
+
+    PNGRowFormat format = pngRowFormat(_width, m_pixelFormat);
+    Size rowByteCount = _width * format.channelCount * format.bytesPerChannel;
+    Error err;
+    if (_format == ImageFormat::PNG)
+    {
+        // the converted rows go behind the last row of the previous batch
+        m_rows.resize((s_pngConversionRowCount + 1) * rowByteCount);
+        m_lineBuffer.resize(rowByteCount);
+        UInt8 head[s_pngHeaderByteCount];
+        writePNGHeader(_width, _height, format, head);
+        err = _writer.write((const char *)head, sizeof(head));
+    }
+    else if (_format == ImageFormat::BMP)
+    {
+        // stored top down, with a negative height
+        Size bmpRowByteCount = (_width * 3 + 3) & ~(Size)3;
+        UInt8 head[54] = { 'B', 'M' };
+        writeLittleEndian((UInt32)(54 + bmpRowByteCount * _height), 4, head + 2);
+        writeLittleEndian(54, 4, head + 10);
+        writeLittleEndian(40, 4, head + 14);
+        writeLittleEndian((UInt32)_width, 4, head + 18);
+        writeLittleEndian((UInt32)-(Int32)_height, 4, head + 22);
+        writeLittleEndian(1, 2, head + 26);
+        writeLittleEndian(24, 2, head + 28);
+        // the converted row followed by the bmp row, whose padding stays zero
+        m_rows.resize(rowByteCount + bmpRowByteCount);
+        memset(m_rows.begin(), 0, m_rows.count());
+        err = _writer.write((const char *)head, sizeof(head));
+    }
+    else if (_format == ImageFormat::TGA)
+    {
+        // stored top down, which bit 5 of the image descriptor says
+        bool hasAlpha = format.channelCount == 2 || format.channelCount == 4;
+        UInt8 head[18] = {};
+        head[2] = (UInt8)((format.channelCount < 3 ? 3 : 2) + (_settings.tgaRLE ? 8 : 0));
+        writeLittleEndian((UInt32)_width, 2, head + 12);
+        writeLittleEndian((UInt32)_height, 2, head + 14);
+        head[16] = (UInt8)(format.channelCount * 8);
+        head[17] = (UInt8)((hasAlpha ? 8 : 0) | 0x20);
+        // the converted row followed by the tga row, which run length encoding can make one byte
+        // per pixel longer
+        m_rows.resize(rowByteCount * 2 + _width);
+        err = _writer.write((const char *)head, sizeof(head));
+    }
+    else
+    {
+        char head[s_picDataOffset];
+        writePicHeader(m_pixelFormat, _width, _height, 1, 0, head);
+        err = _writer.write(head, sizeof(head));
+    }
+
+    m_isEncoding = !err;
+    return err;
+}
+
+Error StreamEncoder::writeRows(const void * _rows, Size _rowCount, Size _stride)
+{
+    if (!m_isEncoding)
+        return Error(ec::InvalidOperation, "The encoder was not started", STICK_FILE, STICK_LINE);
+    if (_rowCount > m_height - m_rowCount)
+        return fail(Error(ec::InvalidOperation,
+                          "More rows were written than the image has",
+                          STICK_FILE,
+                          STICK_LINE));
+
+    const char * rows = static_cast<const char *>(_rows);
+    if (m_format == ImageFormat::PNG)
+        return writePNGRows(rows, _rowCount, _stride);
+    if (m_format == ImageFormat::BMP || m_format == ImageFormat::TGA)
+        return writeBMPOrTGARows(rows, _rowCount, _stride);
+
+    const PicPixelFormat & fmt = s_picPixelFormats[m_pixelFormat];
+    Size rowByteCount = m_width * fmt.channelCount * fmt.bitsPerChannel / 8;
+    for (Size i = 0; i < _rowCount; ++i, ++m_rowCount)
+    {
+        Error err = m_writer->write(rows + i * _stride, rowByteCount);
+        if (err)
+            return fail(err);
+    }
+    return Error();
+}
+
+Error StreamEncoder::writePNGRows(const char * _rows, Size _rowCount, Size _stride)
+{
+    PNGRowFormat format = pngRowFormat(m_width, m_pixelFormat);
+    Size bpp = format.channelCount * format.bytesPerChannel;
+    Size rowByteCount = m_width * bpp;
+    int forceFilter = m_settings.pngFilter < 5 ? m_settings.pngFilter : -1;
+    UInt8 * rows = (UInt8 *)m_rows.begin();
+    while (_rowCount)
+    {
+        Size count = std::min(_rowCount, s_pngConversionRowCount);
+        for (Size i = 0; i < count; ++i)
+            convertPNGRow(
+                format, (const UInt8 *)_rows + i * _stride, rows + (i + 1) * rowByteCount);
+
+        Size start = m_pending.count();
+        m_pending.resize(start + count * (rowByteCount + 1));
+        bool hasRowAbove = m_rowCount > 0;
+        filterPNGRows(hasRowAbove ? rows : rows + rowByteCount,
+                      rowByteCount,
+                      m_width,
+                      bpp,
+                      hasRowAbove,
+                      count,
+                      forceFilter,
+                      (UInt8 *)m_lineBuffer.begin(),
+                      (UInt8 *)m_pending.begin() + start);
+        // the last row is the row above the next batch
+        memcpy(rows, rows + count * rowByteCount, rowByteCount);
+
+        m_rowCount += count;
+        _rows += count * _stride;
+        _rowCount -= count;
+        if (m_pending.count() - m_dictionaryByteCount >= s_pngStreamSegmentByteCount)
+        {
+            Error err = deflatePNGRows(false);
+            if (err)
+                return err;
+        }
+    }
+    return Error();
+}
+
+// Deflates the pending rows and writes them as one IDAT chunk. The chunks are one zlib stream,
+// with the zlib header in front of the first one and the checksum at the end of the last one.
+Error StreamEncoder::deflatePNGRows(bool _final)
+{
+    const UInt8 * data = (const UInt8 *)m_pending.begin() + m_dictionaryByteCount;
+    Size byteCount = m_pending.count() - m_dictionaryByteCount;
+    m_adler = adler32(m_adler, data, byteCount);
+
+    // chunk length and type, zlib header, deflated rows, adler32 and chunk crc
+    m_compressed.resize(8 + 2 + zlibCompressBound(byteCount) + 4 + 4);
+    UInt8 * chunk = (UInt8 *)m_compressed.begin();
+    UInt8 * idat = chunk + 8;
+    Size idatByteCount = 0;
+    if (!m_dictionaryByteCount)
+    {
+        writeZlibHeader(m_settings.pngCompressionLevel, idat);
+        idatByteCount = 2;
+    }
+
+    Size deflated = deflateSegment(data,
+                                   byteCount,
+                                   m_dictionaryByteCount,
+                                   m_settings.pngCompressionLevel,
+                                   _final,
+                                   idat + idatByteCount,
+                                   *m_alloc);
+    if (!deflated)
+        return fail(Error(
+            ec::InvalidOperation, "Failed to allocate the deflate state", STICK_FILE, STICK_LINE));
+    idatByteCount += deflated;
+    if (_final)
+    {
+        writeBigEndian(m_adler, idat + idatByteCount);
+        idatByteCount += 4;
+    }
+    writePNGChunkFrame("IDAT", idat, idatByteCount, chunk, idat + idatByteCount);
+    Error err = m_writer->write((const char *)chunk, idatByteCount + 12);
+    if (err)
+        return fail(err);
+
+    // keep the window that the next rows can refer back to
+    Size keep = std::min(m_pending.count(), s_deflateWindowSize);
+    memmove(m_pending.begin(), m_pending.end() - keep, keep);
+    m_pending.resize(keep);
+    m_dictionaryByteCount = keep;
+    return Error();
+}
+
+Error StreamEncoder::writeBMPOrTGARows(const char * _rows, Size _rowCount, Size _stride)
+{
+    PNGRowFormat format = pngRowFormat(m_width, m_pixelFormat);
+    UInt32 n = format.channelCount;
+    Size rowByteCount = m_width * n;
+    UInt8 * row = (UInt8 *)m_rows.begin();
+    UInt8 * out = row + rowByteCount;
+    for (Size i = 0; i < _rowCount; ++i, ++m_rowCount)
+    {
+        // png and both of these want gray (alpha) or rgb(a), which bmp and tga store as bgr(a)
+        convertPNGRow(format, (const UInt8 *)_rows + i * _stride, row);
+        Size outByteCount;
+        if (m_format == ImageFormat::BMP)
+        {
+            // always 24 bit, gray is expanded and alpha dropped like stb does
+            for (Size x = 0; x < m_width; ++x)
+            {
+                const UInt8 * p = row + x * n;
+                out[x * 3] = p[n > 2 ? 2 : 0];
+                out[x * 3 + 1] = p[n > 2 ? 1 : 0];
+                out[x * 3 + 2] = p[0];
+            }
+            outByteCount = (m_width * 3 + 3) & ~(Size)3;
+        }
+        else
+        {
+            if (n > 2)
+            {
+                for (Size x = 0; x < m_width; ++x)
+                    std::swap(row[x * n], row[x * n + 2]);
+            }
+            if (m_settings.tgaRLE)
+                outByteCount = encodeTGARLE(row, m_width, n, out);
+            else
+            {
+                memcpy(out, row, rowByteCount);
+                outByteCount = rowByteCount;
+            }
+        }
+
+        Error err = m_writer->write((const char *)out, outByteCount);
+        if (err)
+            return fail(err);
+    }
+    return Error();
+}
+
+Error StreamEncoder::finish()
+{
+    if (!m_isEncoding)
+        return Error(ec::InvalidOperation, "The encoder was not started", STICK_FILE, STICK_LINE);
+    if (m_rowCount != m_height)
+        return fail(Error(ec::InvalidOperation,
+                          "Not all rows of the image were written",
+                          STICK_FILE,
+                          STICK_LINE));
+
+    m_isEncoding = false;
+    if (m_format != ImageFormat::PNG)
+        return Error();
+
+    Error err = deflatePNGRows(true);
+    if (err)
+        return err;
+    UInt8 end[12];
+    writePNGChunkFrame("IEND", end + 8, 0, end, end + 8);
+    return m_writer->write((const char *)end, sizeof(end));
+}
+
+Size StreamEncoder::rowsWritten() const
+{
+    return m_rowCount;
+}
+
+// stops encoding after an error, the image can only be started over
+Error StreamEncoder::fail(Error _err)
+{
+    m_isEncoding = false;
+    return _err;
+}
+
+static UInt32 readBigEndian(const UInt8 * _data)
+{
+    return (UInt32)_data[0] << 24 | (UInt32)_data[1] << 16 | (UInt32)_data[2] << 8 | _data[3];
+}
+
+static UInt32 readLittleEndian(const UInt8 * _data, Size _byteCount)
+{
+    UInt32 ret = 0;
+    for (Size i = 0; i < _byteCount; ++i)
+        ret |= (UInt32)_data[i] << (i * 8);
+    return ret;
+}
+
+// Reverts png filter _filter on a row of _byteCount bytes with _bpp bytes per pixel in place.
+// Returns false for an invalid filter.
+static bool unfilterPNGLine(
+    UInt8 _filter, UInt8 * _row, const UInt8 * _above, Size _byteCount, Size _bpp)
+{
+    switch (_filter)
+    {
+    case 0:
+        break;
+    case 1:
+        for (Size i = _bpp; i < _byteCount; ++i)
+            _row[i] += _row[i - _bpp];
+        break;
+    case 2:
+        for (Size i = 0; i < _byteCount; ++i)
+            _row[i] += _above[i];
+        break;
+    case 3:
+        for (Size i = 0; i < _bpp; ++i)
+            _row[i] += _above[i] >> 1;
+        for (Size i = _bpp; i < _byteCount; ++i)
+            _row[i] += (_row[i - _bpp] + _above[i]) >> 1;
+        break;
+    case 4:
+        for (Size i = 0; i < _bpp; ++i)
+            _row[i] += _above[i];
+        for (Size i = _bpp; i < _byteCount; ++i)
+            _row[i] += paethPredictor(_row[i - _bpp], _above[i], _above[i - _bpp]);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// the value of pixel _x in a row of _bits bit values, most significant bits first
+static UInt32 unpackBits(const UInt8 * _row, Size _x, UInt32 _bits)
+{
+    Size bit = _x * _bits;
+    return (_row[bit / 8] >> (8 - _bits - bit % 8)) & ((1u << _bits) - 1);
+}
+
+// the pixel formats of the rows StreamDecoder returns, by bit depth and channel count
+static const UInt32 s_streamPixelFormats[2][4] = { { 0, 1, 3, 5 }, { 9, 10, 12, 14 } };
+
+static Error truncatedImageError()
+{
+    return Error(ec::InvalidOperation, "The image data is truncated", STICK_FILE, STICK_LINE);
+}
+
+static Error pngChecksumError()
+{
+    return Error(
+        ec::InvalidOperation, "The png chunk checksum does not match", STICK_FILE, STICK_LINE);
+}
+
+static Error corruptImageError(const char * _format)
+{
+    return Error(ec::InvalidOperation,
+                 String::formatted("Corrupt %s image", _format),
+                 STICK_FILE,
+                 STICK_LINE);
+}
+
+StreamDecoder::StreamDecoder(Allocator & _alloc) :
+    m_reader(nullptr),
+    m_format(Format::PNG),
+    m_info(),
+    m_rowCount(0),
+    m_isBottomUp(false),
+    m_isDecoding(false),
+    m_channelCount(0),
+    m_bitsPerChannel(0),
+    m_storedRowByteCount(0),
+    m_input(_alloc),
+    m_row(_alloc),
+    m_palette(_alloc),
+    m_hasPaletteAlpha(false),
+    m_inflater(_alloc),
+    m_compressed(_alloc),
+    m_chunkByteCount(0),
+    m_crc(0),
+    m_expectedCRC(0),
+    m_verifyCRC(false),
+    m_isDataAtEnd(false),
+    m_isRunLengthEncoded(false),
+    m_packetPixelCount(0),
+    m_isRunPacket(false)
+{
+}
+
+Error StreamDecoder::begin(Reader & _reader)
+{
+    m_isDecoding = false;
+    m_reader = &_reader;
+    m_info = ImageInfo();
+    m_rowCount = 0;
+    m_isBottomUp = false;
+    m_palette.clear();
+    m_hasPaletteAlpha = false;
+    m_inputError = Error();
+    m_isRunLengthEncoded = false;
+    m_packetPixelCount = 0;
+
+    char magic[2];
+    if (!readBytes(magic, 2))
+        return truncatedImageError();
+
+    Error err;
+    if (magic[0] == (char)0x89 && magic[1] == 'P')
+        err = beginPNG(magic);
+    else if (magic[0] == 'B' && magic[1] == 'M')
+        err = beginBMP(magic);
+    else if (magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6'))
+        err = beginPNM(magic);
+    else if (magic[0] == s_picMagic[0] && magic[1] == s_picMagic[1])
+        err = beginPic(magic);
+    else
+        // tga files don't have a signature, only a header that can be checked for sanity
+        err = beginTGA(magic);
+    if (err)
+        return err;
+
+    if (m_format != Format::Pic)
+    {
+        UInt32 pixelFormat = s_streamPixelFormats[m_info.is16Bit][m_info.channelCount - 1];
+        m_info.pixelTypeID = s_picPixelFormats[pixelFormat].pixelTypeID;
+        m_row.resize(m_info.width * m_info.channelCount * (m_info.is16Bit ? 2 : 1));
+    }
+    m_isDecoding = true;
+    return Error();
+}
+
+Error StreamDecoder::beginPNG(const char * _magic)
+{
+    static const UInt8 s_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    UInt8 signature[8];
+    memcpy(signature, _magic, 2);
+    if (!readBytes((char *)signature + 2, 6))
+        return truncatedImageError();
+    if (memcmp(signature, s_signature, 8))
+        return Error(ec::Unsupported, "Not a png image", STICK_FILE, STICK_LINE);
+
+    // the chunks in front of the image data, PLTE and tRNS are at most 768 bytes long
+    UInt8 chunk[8 + 768 + 4];
+    UInt8 colorType = 0;
+    bool hasHeader = false;
+    while (true)
+    {
+        if (!readBytes((char *)chunk, 8))
+            return truncatedImageError();
+        UInt32 length = readBigEndian(chunk);
+        const char * type = (const char *)chunk + 4;
+        if (!memcmp(type, "IDAT", 4))
+        {
+            if (!hasHeader)
+                return corruptImageError("png");
+            m_chunkByteCount = length;
+            m_crc = crc32(0, type, 4);
+            break;
+        }
+
+        bool isHeader = !memcmp(type, "IHDR", 4);
+        bool isPalette = !memcmp(type, "PLTE", 4);
+        bool isTransparency = !memcmp(type, "tRNS", 4);
+        if (!isHeader && !isPalette && !isTransparency)
+        {
+            if (!memcmp(type, "IEND", 4) || !hasHeader)
+                return corruptImageError("png");
+            // unknown critical chunks, like the CgBI one of iphone optimized pngs
+            if (!(type[0] & 32))
+                return Error(ec::Unsupported,
+                             "The png needs a feature that can't be decoded row by row",
+                             STICK_FILE,
+                             STICK_LINE);
+            m_reader->skip((Size)length + 4);
+            continue;
+        }
+
+        if (length > 768 || isHeader != !hasHeader)
+            return corruptImageError("png");
+        UInt8 * data = chunk + 8;
+        if (!readBytes((char *)data, length + 4))
+            return truncatedImageError();
+        if (crc32(crc32(0, type, 4), data, length) != readBigEndian(data + length))
+            return pngChecksumError();
+
+        if (isHeader)
+        {
+            if (length != 13)
+                return corruptImageError("png");
+            m_info.width = readBigEndian(data);
+            m_info.height = readBigEndian(data + 4);
+            m_bitsPerChannel = data[8];
+            colorType = data[9];
+            // the bit depths each color type allows
+            static const UInt8 s_bitDepths[7] = { 31, 0, 24, 15, 24, 0, 24 };
+            if (!m_info.width || !m_info.height || m_info.width > 0x7fffffff ||
+                m_info.height > 0x7fffffff || colorType > 6 || m_bitsPerChannel > 16 ||
+                !(s_bitDepths[colorType] & m_bitsPerChannel) ||
+                (m_bitsPerChannel & (m_bitsPerChannel - 1)) || data[10] || data[11])
+                return corruptImageError("png");
+            if (data[12])
+                return Error(ec::Unsupported,
+                             "Interlaced pngs can't be decoded row by row",
+                             STICK_FILE,
+                             STICK_LINE);
+            static const UInt32 s_channelCounts[7] = { 1, 0, 3, 1, 2, 0, 4 };
+            m_channelCount = s_channelCounts[colorType];
+            hasHeader = true;
+        }
+        else if (isPalette)
+        {
+            if (length % 3)
+                return corruptImageError("png");
+            // truecolor pngs may suggest a palette, which isn't needed to decode them
+            if (colorType != 3)
+                continue;
+            m_palette.resize(256 * 4);
+            memset(m_palette.begin(), 0, m_palette.count());
+            for (UInt32 i = 0; i < length / 3; ++i)
+            {
+                memcpy(&m_palette[i * 4], data + i * 3, 3);
+                m_palette[i * 4 + 3] = (char)255;
+            }
+        }
+        else if (colorType == 3)
+        {
+            if (m_palette.isEmpty() || length > 256)
+                return corruptImageError("png");
+            for (UInt32 i = 0; i < length; ++i)
+                m_palette[i * 4 + 3] = (char)data[i];
+            m_hasPaletteAlpha = true;
+        }
+    }
+    if (colorType == 3 && m_palette.isEmpty())
+        return corruptImageError("png");
+
+    m_format = Format::PNG;
+    m_info.is16Bit = m_bitsPerChannel == 16;
+    // Palettes are expanded to rgb(a). Like decodeImage, the transparent color of gray and rgb
+    // pngs is ignored.
+    m_info.channelCount = colorType == 3 ? (m_hasPaletteAlpha ? 4 : 3) : m_channelCount;
+    m_storedRowByteCount = (m_info.width * m_channelCount * m_bitsPerChannel + 7) / 8;
+    // the row above, the filter type and the current row
+    m_input.resize(m_storedRowByteCount * 2 + 1);
+    memset(m_input.begin(), 0, m_storedRowByteCount);
+    m_compressed.resize(1 << 16);
+    m_isDataAtEnd = false;
+    return m_inflater.begin(fillInflater, this);
+}
+
+Size StreamDecoder::fillInflater(void * _userData, const UInt8 ** _outData)
+{
+    StreamDecoder & self = *static_cast<StreamDecoder *>(_userData);
+    while (!self.m_chunkByteCount)
+    {
+        if (self.m_isDataAtEnd)
+            return 0;
+        // the crc of the chunk that was just read and the header of the next one
+        UInt8 buf[12];
+        if (!self.readBytes((char *)buf, 12))
+            self.m_inputError = truncatedImageError();
+        else if (readBigEndian(buf) != self.m_crc)
+            self.m_inputError = pngChecksumError();
+        if (self.m_inputError || memcmp(buf + 8, "IDAT", 4))
+        {
+            self.m_isDataAtEnd = true;
+            return 0;
+        }
+        self.m_chunkByteCount = readBigEndian(buf + 4);
+        self.m_crc = crc32(0, buf + 8, 4);
+    }
+
+    Size byteCount =
+        self.m_reader->read(self.m_compressed.begin(),
+                            std::min(self.m_compressed.count(), self.m_chunkByteCount));
+    if (!byteCount)
+    {
+        self.m_inputError = truncatedImageError();
+        self.m_isDataAtEnd = true;
+        return 0;
+    }
+    self.m_crc = crc32(self.m_crc, self.m_compressed.begin(), byteCount);
+    self.m_chunkByteCount -= byteCount;
+    *_outData = (const UInt8 *)self.m_compressed.begin();
+    return byteCount;
+}
+
+Error StreamDecoder::beginBMP(const char * _magic)
+{
+    // the file header, the largest info header and the color masks that can follow the smallest
+    UInt8 head[14 + 124 + 12];
+    memcpy(head, _magic, 2);
+    if (!readBytes((char *)head + 2, 16))
+        return truncatedImageError();
+    UInt32 headerByteCount = readLittleEndian(head + 14, 4);
+    if (headerByteCount != 12 && (headerByteCount < 40 || headerByteCount > 124))
+        return corruptImageError("bmp");
+    if (!readBytes((char *)head + 18, headerByteCount - 4))
+        return truncatedImageError();
+    Size position = 14 + headerByteCount;
+
+    Int32 width, height;
+    UInt32 bitsPerPixel, compression = 0, paletteCount = 0;
+    if (headerByteCount == 12)
+    {
+        width = (Int32)readLittleEndian(head + 18, 2);
+        height = (Int32)readLittleEndian(head + 20, 2);
+        bitsPerPixel = readLittleEndian(head + 24, 2);
+    }
+    else
+    {
+        width = (Int32)readLittleEndian(head + 18, 4);
+        height = (Int32)readLittleEndian(head + 22, 4);
+        bitsPerPixel = readLittleEndian(head + 28, 2);
+        compression = readLittleEndian(head + 30, 4);
+        paletteCount = readLittleEndian(head + 46, 4);
+    }
+    // Like decodeImage, 32 bit pixels have alpha only if the masks say so. Plain 32 bit bmps
+    // with a 40 byte header can't be decoded row by row, their alpha is replaced with 255 if it
+    // is 0 everywhere, which is only known once all rows are read.
+    UInt32 channelCount = 3;
+    if (bitsPerPixel == 32)
+    {
+        // v4 and v5 headers hold the masks, 40 byte headers are followed by them for bitfields
+        bool hasMasks = headerByteCount >= 108 || (headerByteCount == 40 && compression == 3);
+        if (headerByteCount == 40 && compression == 3)
+        {
+            if (!readBytes((char *)head + 54, 12))
+                return truncatedImageError();
+            position += 12;
+        }
+        UInt32 alphaMask = headerByteCount >= 108 ? readLittleEndian(head + 66, 4) : 0;
+        bool isBGRA = hasMasks && (compression == 0 || compression == 3) &&
+                      readLittleEndian(head + 54, 4) == 0xff0000 &&
+                      readLittleEndian(head + 58, 4) == 0xff00 &&
+                      readLittleEndian(head + 62, 4) == 0xff &&
+                      (alphaMask == 0 || alphaMask == 0xff000000);
+        compression = isBGRA ? 0 : 1;
+        channelCount = alphaMask ? 4 : 3;
+    }
+    if (compression || (bitsPerPixel != 1 && bitsPerPixel != 4 && bitsPerPixel != 8 &&
+                        bitsPerPixel != 24 && bitsPerPixel != 32))
+        return Error(ec::Unsupported,
+                     "Only uncompressed 1, 4, 8, 24 and 32 bit bgr(a) bmps can be decoded row by "
+                     "row",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (width <= 0 || height == 0 || height == std::numeric_limits<Int32>::min())
+        return corruptImageError("bmp");
+
+    m_isBottomUp = height > 0;
+    m_info.width = width;
+    m_info.height = height > 0 ? height : -height;
+    m_info.channelCount = channelCount;
+    if (bitsPerPixel <= 8)
+    {
+        UInt32 entryByteCount = headerByteCount == 12 ? 3 : 4;
+        if (!paletteCount)
+            paletteCount = 1u << bitsPerPixel;
+        if (paletteCount > 256)
+            return corruptImageError("bmp");
+        UInt8 palette[256 * 4];
+        if (!readBytes((char *)palette, paletteCount * entryByteCount))
+            return truncatedImageError();
+        position += paletteCount * entryByteCount;
+        m_palette.resize(256 * 4);
+        memset(m_palette.begin(), 0, m_palette.count());
+        for (UInt32 i = 0; i < paletteCount; ++i)
+        {
+            const UInt8 * bgr = palette + i * entryByteCount;
+            m_palette[i * 4] = (char)bgr[2];
+            m_palette[i * 4 + 1] = (char)bgr[1];
+            m_palette[i * 4 + 2] = (char)bgr[0];
+        }
+    }
+
+    Size dataOffset = readLittleEndian(head + 10, 4);
+    if (dataOffset < position)
+        return corruptImageError("bmp");
+    m_reader->skip(dataOffset - position);
+
+    m_format = Format::BMP;
+    m_channelCount = bitsPerPixel > 8 ? bitsPerPixel / 8 : 1;
+    m_bitsPerChannel = bitsPerPixel > 8 ? 8 : bitsPerPixel;
+    m_storedRowByteCount = (m_info.width * bitsPerPixel + 31) / 32 * 4;
+    m_input.resize(m_storedRowByteCount);
+    return Error();
+}
+
+Error StreamDecoder::beginTGA(const char * _magic)
+{
+    UInt8 head[18];
+    memcpy(head, _magic, 2);
+    if (!readBytes((char *)head + 2, 16))
+        return truncatedImageError();
+
+    UInt32 colorMapType = head[1];
+    UInt32 imageType = head[2] & 7;
+    UInt32 firstIndex = readLittleEndian(head + 3, 2);
+    UInt32 colorCount = readLittleEndian(head + 5, 2);
+    UInt32 entryBits = head[7];
+    UInt32 bitsPerPixel = head[16];
+    bool isIndexed = imageType == 1;
+    if (colorMapType > 1 || (head[2] & ~11) || imageType < 1 || imageType > 3 ||
+        (isIndexed && !colorMapType) || !readLittleEndian(head + 12, 2) ||
+        !readLittleEndian(head + 14, 2))
+        return Error(ec::Unsupported,
+                     "Only png, bmp, tga, pnm and .pic images can be decoded row by row",
+                     STICK_FILE,
+                     STICK_LINE);
+    UInt32 pixelBits = isIndexed ? entryBits : bitsPerPixel;
+    if ((imageType != 2 && bitsPerPixel != 8) ||
+        (imageType != 3 && pixelBits != 24 && pixelBits != 32))
+        return Error(ec::Unsupported,
+                     "Only 8 bit gray, 24 and 32 bit tgas can be decoded row by row",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (head[17] & 0x10)
+        return Error(ec::Unsupported,
+                     "Right to left tgas can't be decoded row by row",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    m_reader->skip(head[0]);
+    if (colorMapType)
+    {
+        Size entryByteCount = (entryBits + 7) / 8;
+        if (!isIndexed)
+            m_reader->skip(colorCount * entryByteCount);
+        else
+        {
+            if (firstIndex + colorCount > 256)
+                return corruptImageError("tga");
+            UInt8 palette[256 * 4];
+            if (!readBytes((char *)palette, colorCount * entryByteCount))
+                return truncatedImageError();
+            m_palette.resize(256 * 4);
+            memset(m_palette.begin(), 0, m_palette.count());
+            for (UInt32 i = 0; i < colorCount; ++i)
+            {
+                const UInt8 * bgra = palette + i * entryByteCount;
+                char * rgba = &m_palette[(firstIndex + i) * 4];
+                rgba[0] = (char)bgra[2];
+                rgba[1] = (char)bgra[1];
+                rgba[2] = (char)bgra[0];
+                rgba[3] = (char)(entryBits == 32 ? bgra[3] : 255);
+            }
+        }
+    }
+
+    m_format = Format::TGA;
+    m_isBottomUp = !(head[17] & 0x20);
+    m_isRunLengthEncoded = (head[2] & 8) != 0;
+    m_info.width = readLittleEndian(head + 12, 2);
+    m_info.height = readLittleEndian(head + 14, 2);
+    m_info.channelCount = isIndexed ? entryBits / 8 : bitsPerPixel / 8;
+    m_channelCount = bitsPerPixel / 8;
+    m_bitsPerChannel = 8;
+    m_storedRowByteCount = m_info.width * m_channelCount;
+    m_input.resize(m_storedRowByteCount);
+    return Error();
+}
+
+Error StreamDecoder::beginPNM(const char * _magic)
+{
+    // width, height and the maximum value, each followed by a single whitespace character
+    UInt32 values[3];
+    char c;
+    for (Size i = 0; i < 3; ++i)
+    {
+        do
+        {
+            if (!readBytes(&c, 1))
+                return truncatedImageError();
+            // comments run to the end of the line
+            while (c == '#')
+            {
+                while (c != '\n' && c != '\r')
+                {
+                    if (!readBytes(&c, 1))
+                        return truncatedImageError();
+                }
+            }
+        } while (isspace(c));
+
+        UInt64 value = 0;
+        while (c >= '0' && c <= '9' && value <= 0x7fffffff)
+        {
+            value = value * 10 + (c - '0');
+            if (!readBytes(&c, 1))
+                return truncatedImageError();
+        }
+        if (!isspace(c) || value > 0x7fffffff)
+            return corruptImageError("pnm");
+        values[i] = (UInt32)value;
+    }
+    if (!values[0] || !values[1] || !values[2] || values[2] > 65535)
+        return corruptImageError("pnm");
+
+    m_format = Format::PNM;
+    m_info.width = values[0];
+    m_info.height = values[1];
+    m_info.channelCount = _magic[1] == '5' ? 1 : 3;
+    m_info.is16Bit = values[2] > 255;
+    m_channelCount = m_info.channelCount;
+    m_bitsPerChannel = m_info.is16Bit ? 16 : 8;
+    m_storedRowByteCount = m_info.width * m_channelCount * m_bitsPerChannel / 8;
+    m_input.resize(m_storedRowByteCount);
+    return Error();
+}
+
+Error StreamDecoder::beginPic(const char * _magic)
+{
+    char head[sizeof(PicFileHeader)];
+    memcpy(head, _magic, 2);
+    if (!readBytes(head + 2, sizeof(head) - 2))
+        return truncatedImageError();
+    PicFileHeader header;
+    Error err = readPicHeader(head, sizeof(head), std::numeric_limits<Size>::max(), header);
+    if (err)
+        return err;
+    if (header.depth != 1)
+        return Error(ec::Unsupported,
+                     "Only .pic files with one layer can be decoded row by row",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (header.dataOffset < sizeof(head))
+        return corruptImageError(".pic");
+    m_reader->skip(header.dataOffset - sizeof(head));
+
+    const PicPixelFormat & fmt = s_picPixelFormats[header.pixelFormat];
+    m_format = Format::Pic;
+    m_info.width = header.width;
+    m_info.height = header.height;
+    m_info.channelCount = fmt.channelCount;
+    m_info.is16Bit = fmt.bitsPerChannel == 16;
+    m_info.isHDR = fmt.isFloatingPoint;
+    m_info.pixelTypeID = fmt.pixelTypeID;
+    m_storedRowByteCount = header.byteCount / header.height;
+    m_input.resize(m_storedRowByteCount);
+    m_crc = 0;
+    m_expectedCRC = header.checksum;
+    m_verifyCRC = !(header.flags & s_picFlagNoChecksum);
+    return Error();
+}
+
+const ImageInfo & StreamDecoder::info() const
+{
+    return m_info;
+}
+
+Result<const char *> StreamDecoder::nextRow()
+{
+    if (!m_isDecoding)
+        return Error(
+            ec::InvalidOperation, "There are no rows left to decode", STICK_FILE, STICK_LINE);
+
+    Error err = m_format == Format::PNG ? decodePNGRow() : readStoredRow();
+    if (err)
+        return fail(err);
+    if (m_format == Format::Pic)
+        m_crc = crc32(m_crc, m_input.begin(), m_storedRowByteCount);
+    else if (m_format != Format::PNG)
+        convertStoredRow();
+
+    if (++m_rowCount == m_info.height)
+    {
+        m_isDecoding = false;
+        if (m_format == Format::PNG)
+        {
+            // reading past the last row verifies the zlib checksum, the crc of the last chunk is
+            // verified once the rest of the image data is read
+            char next;
+            auto res = m_inflater.read(&next, 1);
+            const UInt8 * data;
+            while (!m_inputError && fillInflater(this, &data))
+            {
+            }
+            if (m_inputError)
+                return m_inputError;
+            if (!res)
+                return res.error();
+        }
+        else if (m_format == Format::Pic && m_verifyCRC && m_crc != m_expectedCRC)
+            return Error(ec::InvalidOperation,
+                         "The .pic file checksum does not match",
+                         STICK_FILE,
+                         STICK_LINE);
+    }
+    return m_format == Format::Pic ? m_input.begin() : m_row.begin();
+}
+
+Error StreamDecoder::decodePNGRow()
+{
+    Size byteCount = m_storedRowByteCount;
+    UInt8 * above = (UInt8 *)m_input.begin();
+    UInt8 * row = above + byteCount + 1;
+    auto res = m_inflater.read(row - 1, byteCount + 1);
+    if (!res || res.get() != byteCount + 1)
+        return m_inputError ? m_inputError : !res ? res.error() : truncatedImageError();
+
+    Size bpp = std::max((Size)1, (Size)(m_channelCount * m_bitsPerChannel / 8));
+    if (!unfilterPNGLine(row[-1], row, above, byteCount, bpp))
+        return corruptImageError("png");
+
+    Size width = m_info.width;
+    UInt32 n = m_info.channelCount;
+    UInt8 * out = (UInt8 *)m_row.begin();
+    if (!m_palette.isEmpty())
+    {
+        for (Size x = 0; x < width; ++x)
+            memcpy(out + x * n, &m_palette[unpackBits(row, x, m_bitsPerChannel) * 4], n);
+    }
+    else if (m_bitsPerChannel < 8)
+    {
+        // gray, scaled to the full 8 bit range
+        static const UInt8 s_scale[5] = { 0, 255, 85, 0, 17 };
+        UInt8 scale = s_scale[m_bitsPerChannel];
+        for (Size x = 0; x < width; ++x)
+            out[x] = (UInt8)(unpackBits(row, x, m_bitsPerChannel) * scale);
+    }
+    else if (m_bitsPerChannel == 16)
+        byteSwap16(row, out, width * n);
+    else
+        memcpy(out, row, byteCount);
+
+    memcpy(above, row, byteCount);
+    return Error();
+}
+
+Error StreamDecoder::readStoredRow()
+{
+    UInt8 * row = (UInt8 *)m_input.begin();
+    if (!m_isRunLengthEncoded)
+        return readBytes((char *)row, m_storedRowByteCount) ? Error() : truncatedImageError();
+
+    Size bpp = m_channelCount;
+    for (Size x = 0; x < m_info.width;)
+    {
+        if (!m_packetPixelCount)
+        {
+            UInt8 head;
+            if (!readBytes((char *)&head, 1))
+                return truncatedImageError();
+            m_isRunPacket = (head & 0x80) != 0;
+            m_packetPixelCount = (head & 0x7f) + 1;
+            if (m_isRunPacket && !readBytes((char *)m_runPixel, bpp))
+                return truncatedImageError();
+        }
+
+        Size count = std::min(m_packetPixelCount, m_info.width - x);
+        if (!m_isRunPacket)
+        {
+            if (!readBytes((char *)row + x * bpp, count * bpp))
+                return truncatedImageError();
+        }
+        else
+        {
+            for (Size i = 0; i < count; ++i)
+                memcpy(row + (x + i) * bpp, m_runPixel, bpp);
+        }
+        x += count;
+        m_packetPixelCount -= count;
+    }
+    return Error();
+}
+
+void StreamDecoder::convertStoredRow()
+{
+    const UInt8 * row = (const UInt8 *)m_input.begin();
+    UInt8 * out = (UInt8 *)m_row.begin();
+    Size width = m_info.width;
+    UInt32 n = m_info.channelCount;
+    if (!m_palette.isEmpty())
+    {
+        for (Size x = 0; x < width; ++x)
+            memcpy(out + x * n, &m_palette[unpackBits(row, x, m_bitsPerChannel) * 4], n);
+    }
+    else if (m_bitsPerChannel == 16)
+        byteSwap16(row, out, width * n);
+    else if (m_format == Format::PNM || n == 1)
+        memcpy(out, row, width * n);
+    else
+    {
+        // bmp and tga store bgr(a), 32 bit bmps without alpha have an unused fourth byte
+        for (Size x = 0; x < width; ++x, row += m_channelCount, out += n)
+        {
+            out[0] = row[2];
+            out[1] = row[1];
+            out[2] = row[0];
+            if (n == 4)
+                out[3] = row[3];
+        }
+    }
+}
+
+Size StreamDecoder::nextRowIndex() const
+{
+    return m_isBottomUp ? m_info.height - 1 - m_rowCount : m_rowCount;
+}
+
+Size StreamDecoder::rowsDecoded() const
+{
+    return m_rowCount;
+}
+
+bool StreamDecoder::readBytes(char * _out, Size _byteCount)
+{
+    while (_byteCount)
+    {
+        Size n = m_reader->read(_out, _byteCount);
+        if (!n)
+            return false;
+        _out += n;
+        _byteCount -= n;
+    }
+    return true;
+}
+
+// stops decoding after an error, the image can only be started over
+Error StreamDecoder::fail(Error _err)
+{
+    m_isDecoding = false;
+    return _err;
+}
+
+static bool isJPEG(const void * _data, Size _byteCount)
+{
+    const UInt8 * bytes = (const UInt8 *)_data;
+    return _byteCount >= 2 && bytes[0] == 0xFF && bytes[1] == 0xD8;
+}
+
+// feeds a block of memory to a StreamDecoder
+class MemoryReader : public Reader
+{
+  public:
+    MemoryReader(const void * _data, Size _byteCount) :
+        m_data((const char *)_data),
+        m_byteCount(_byteCount),
+        m_position(0)
+    {
+    }
+
+    Size read(char * _buffer, Size _byteCount) override
+    {
+        Size n = std::min(_byteCount, m_byteCount - m_position);
+        memcpy(_buffer, m_data + m_position, n);
+        m_position += n;
+        return n;
+    }
+
+    void skip(Size _byteCount) override
+    {
+        m_position += std::min(_byteCount, m_byteCount - m_position);
+    }
+
+    bool isAtEnd() const override
+    {
+        return m_position == m_byteCount;
+    }
+
+  private:
+    const char * m_data;
+    Size m_byteCount;
+    Size m_position;
+};
+
+static Error checkRegion(
+    Size _left, Size _top, Size _width, Size _height, Size _imageWidth, Size _imageHeight)
+{
+    if (!_width || !_height)
+        return Error(ec::InvalidOperation, "The region is empty", STICK_FILE, STICK_LINE);
+    if (_left >= _imageWidth || _width > _imageWidth - _left || _top >= _imageHeight ||
+        _height > _imageHeight - _top)
+        return Error(
+            ec::InvalidOperation, "The region is outside of the image", STICK_FILE, STICK_LINE);
+    return Error();
+}
+
+// decodes rows until all rows of the region are in. Bottom up images deliver the rows below the
+// region first, the rows after it are never decoded.
+static Result<ImageUniquePtr> decodeRegionRows(
+    StreamDecoder & _dec, Size _left, Size _top, Size _width, Size _height, Allocator & _alloc)
+{
+    const ImageInfo & info = _dec.info();
+    Error err = checkRegion(_left, _top, _width, _height, info.width, info.height);
+    if (err)
+        return err;
+    auto format = picPixelFormatIndex(info.pixelTypeID);
+    if (!format)
+        return format.error();
+
+    ImageUniquePtr ret = s_picPixelFormats[format.get()].create(_alloc);
+    ret->resize(_width, _height);
+    Size offset = _left * ret->bytesPerPixel();
+    Size byteCount = _width * ret->bytesPerPixel();
+    for (Size rowCount = 0; rowCount < _height;)
+    {
+        Size y = _dec.nextRowIndex();
+        auto row = _dec.nextRow();
+        if (!row)
+            return row.error();
+        if (y >= _top && y < _top + _height)
+        {
+            memcpy(ret->bytePtr() + (y - _top) * ret->bytesPerRow(), row.get() + offset, byteCount);
+            ++rowCount;
+        }
+    }
+    return ret;
+}
+
+// for the formats and variants StreamDecoder can't decode
+static Result<ImageUniquePtr> cropImage(
+    const Image & _img, Size _left, Size _top, Size _width, Size _height, Allocator & _alloc)
+{
+    if (_img.depth() != 1)
+        return Error(ec::Unsupported,
+                     "Regions can only be decoded from 2D images",
+                     STICK_FILE,
+                     STICK_LINE);
+    Error err = checkRegion(_left, _top, _width, _height, _img.width(), _img.height());
+    if (err)
+        return err;
+    auto format = picPixelFormatIndex(_img.pixelTypeID());
+    if (!format)
+        return format.error();
+
+    ImageUniquePtr ret = s_picPixelFormats[format.get()].create(_alloc);
+    ret->resize(_width, _height);
+    for (Size y = 0; y < _height; ++y)
+        memcpy(ret->bytePtr() + y * ret->bytesPerRow(),
+               _img.bytePtr() + (_top + y) * _img.bytesPerRow() + _left * _img.bytesPerPixel(),
+               _width * ret->bytesPerPixel());
+    return ret;
+}
+
+static Result<ImageUniquePtr> decodeRegionStreamed(const void * _data,
+                                                   Size _byteCount,
+                                                   Size _left,
+                                                   Size _top,
+                                                   Size _width,
+                                                   Size _height,
+                                                   Allocator & _alloc)
+{
+    MemoryReader reader(_data, _byteCount);
+    StreamDecoder dec(_alloc);
+    if (!dec.begin(reader))
+        return decodeRegionRows(dec, _left, _top, _width, _height, _alloc);
+
+    auto res = decodeImage(_data, _byteCount, _alloc);
+    if (!res)
+        return res;
+    return cropImage(*res.get(), _left, _top, _width, _height, _alloc);
+}
+
+struct PushDecoder::State
+{
+    State(Allocator & _alloc) :
+        input(_alloc),
+        readPosition(0),
+        keepReadInput(true),
+        isFinished(false),
+        isCancelled(false),
+        hasFailed(false),
+        rowCount(0)
+    {
+    }
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable inputChanged;
+    // the data that was fed and not read yet. Until the format is known it holds all data that was
+    // fed, so decoding can start over if StreamDecoder can't decode the image.
+    ByteArray input;
+    Size readPosition;
+    bool keepReadInput;
+    bool isFinished;
+    bool isCancelled;
+    std::atomic<bool> hasFailed;
+    Error error;
+    ImageUniquePtr image;
+    std::atomic<Size> rowCount;
+};
+
+class PushDecoder::InputReader : public Reader
+{
+  public:
+    InputReader(PushDecoder & _decoder) : m_decoder(_decoder)
+    {
+    }
+
+    Size read(char * _buffer, Size _byteCount) override
+    {
+        State & dec = *m_decoder.m_state;
+        std::unique_lock<std::mutex> lock(dec.mutex);
+        waitForInput(lock);
+        Size n = std::min(_byteCount, dec.input.count() - dec.readPosition);
+        if (!n)
+            return 0;
+        memcpy(_buffer, &dec.input[dec.readPosition], n);
+        dec.readPosition += n;
+
+        // move the unread data to the front once most of the buffer was read
+        Size unread = dec.input.count() - dec.readPosition;
+        if (!dec.keepReadInput && dec.readPosition >= s_compactByteCount &&
+            dec.readPosition > unread)
+        {
+            if (unread)
+                memmove(&dec.input[0], &dec.input[dec.readPosition], unread);
+            dec.input.resize(unread);
+            dec.readPosition = 0;
+        }
+        return n;
+    }
+
+    void skip(Size _byteCount) override
+    {
+        while (_byteCount)
+        {
+            char buffer[256];
+            Size n = read(buffer, std::min(_byteCount, sizeof(buffer)));
+            if (!n)
+                return;
+            _byteCount -= n;
+        }
+    }
+
+    bool isAtEnd() const override
+    {
+        State & dec = *m_decoder.m_state;
+        std::unique_lock<std::mutex> lock(dec.mutex);
+        waitForInput(lock);
+        return dec.readPosition == dec.input.count();
+    }
+
+  private:
+    static const Size s_compactByteCount = 1 << 16;
+
+    // waits until there is unread data or there won't be any more
+    void waitForInput(std::unique_lock<std::mutex> & _lock) const
+    {
+        State & dec = *m_decoder.m_state;
+        dec.inputChanged.wait(_lock, [&dec]() {
+            return dec.readPosition < dec.input.count() || dec.isFinished ||
+                   dec.isCancelled;
+        });
+        // cancelled decoders see the end of the data, which fails decoding quickly
+        if (dec.isCancelled)
+            dec.readPosition = dec.input.count();
+    }
+
+    PushDecoder & m_decoder;
+};
+
+PushDecoder::PushDecoder(Allocator & _alloc) :
+    m_alloc(&_alloc),
+    m_state(_alloc.create<State>(_alloc))
+{
+}
+
+PushDecoder::~PushDecoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->isCancelled = true;
+    }
+    m_state->inputChanged.notify_all();
+    if (m_state->worker.joinable())
+        m_state->worker.join();
+    m_alloc->destroy(m_state);
+}
+
+Error PushDecoder::feed(const void * _data, Size _byteCount)
+{
+    if (m_state->hasFailed.load(std::memory_order_acquire))
+        return m_state->error;
+
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (m_state->isFinished)
+            return Error(ec::InvalidOperation,
+                         "Can't feed data after finish was called",
+                         STICK_FILE,
+                         STICK_LINE);
+        const char * data = static_cast<const char *>(_data);
+        m_state->input.insert(m_state->input.end(), data, data + _byteCount);
+    }
+    m_state->inputChanged.notify_one();
+
+    if (!m_state->worker.joinable())
+        m_state->worker = std::thread([this]() { decode(); });
+    return Error();
+}
+
+Size PushDecoder::rowsAvailable() const
+{
+    return m_state->rowCount.load(std::memory_order_acquire);
+}
+
+const Image * PushDecoder::image() const
+{
+    return rowsAvailable() ? m_state->image.get() : nullptr;
+}
+
+Result<ImageUniquePtr> PushDecoder::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (m_state->isFinished)
+            return Error(
+                ec::InvalidOperation, "finish was called already", STICK_FILE, STICK_LINE);
+        m_state->isFinished = true;
+    }
+    m_state->inputChanged.notify_one();
+
+    if (!m_state->worker.joinable())
+        m_state->worker = std::thread([this]() { decode(); });
+    m_state->worker.join();
+    if (m_state->hasFailed.load(std::memory_order_acquire))
+        return m_state->error;
+    return std::move(m_state->image);
+}
+
+void PushDecoder::decode()
+{
+    InputReader reader(*this);
+    Error err;
+    char magic[2];
+    if (isJPEG(magic, peek(magic, 2)))
+    {
+        dropReadInput();
+        err = decodeJPEG(reader);
+    }
+    else
+    {
+        StreamDecoder dec(*m_alloc);
+        if (!dec.begin(reader))
+        {
+            dropReadInput();
+            err = decodeStreamed(dec);
+        }
+        else
+        {
+            // i.e. an interlaced png or a gif, start over with all the data that was read
+            {
+                std::lock_guard<std::mutex> lock(m_state->mutex);
+                m_state->readPosition = 0;
+            }
+            dropReadInput();
+            err = decodeWhole(reader);
+        }
+    }
+
+    if (err)
+    {
+        m_state->error = err;
+        m_state->hasFailed.store(true, std::memory_order_release);
+        return;
+    }
+    m_state->rowCount.store(m_state->image->height(), std::memory_order_release);
+}
+
+Size PushDecoder::peek(char * _out, Size _byteCount)
+{
+    State & state = *m_state;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.inputChanged.wait(lock, [&]() {
+        return state.input.count() - state.readPosition >= _byteCount || state.isFinished ||
+               state.isCancelled;
+    });
+    Size n = std::min(_byteCount, state.input.count() - state.readPosition);
+    if (n)
+        memcpy(_out, &state.input[state.readPosition], n);
+    return n;
+}
+
+void PushDecoder::dropReadInput()
+{
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->keepReadInput = false;
+}
+
+Error PushDecoder::decodeStreamed(StreamDecoder & _decoder)
+{
+    const ImageInfo & info = _decoder.info();
+    auto format = picPixelFormatIndex(info.pixelTypeID);
+    if (!format)
+        return format.error();
+
+    ImageUniquePtr img = s_picPixelFormats[format.get()].create(*m_alloc);
+    img->resize(info.width, info.height);
+    m_state->image = std::move(img);
+
+    // rowsAvailable counts from the top, so the rows of bottom up images only become available
+    // once all of them are in
+    bool isTopDown = _decoder.nextRowIndex() == 0;
+    Image & target = *m_state->image;
+    return _decoder.decodeRows([&](Size _y, const char * _row) {
+        memcpy(target.bytePtr() + _y * target.bytesPerRow(), _row, target.bytesPerRow());
+        if (isTopDown)
+            m_state->rowCount.store(_y + 1, std::memory_order_release);
+    });
+}
+
+Error PushDecoder::decodeWhole(Reader & _reader)
+{
+    auto res = decodeImage(_reader, *m_alloc);
+    if (!res)
+        return res.error();
+    m_state->image = std::move(res.get());
+    return Error();
+}
+
+static Error checkDecodeSettings(const DecodeSettings & _settings)
+{
+    UInt32 denominator = _settings.jpegScaleDenominator;
+    if (denominator != 1 && denominator != 2 && denominator != 4 && denominator != 8)
+        return Error(ec::InvalidOperation,
+                     "The jpeg scale denominator has to be 1, 2, 4 or 8",
+                     STICK_FILE,
+                     STICK_LINE);
+    return Error();
+}
+
+#ifdef PIC_IMPLEMENTATION_FREEIMAGE
+static Result<ImageUniquePtr> decodeFreeImage(const void * _data,
+                                              Size _byteCount,
+                                              Allocator & _alloc)
+{
+    typedef Result<ImageUniquePtr> ResultType;
+    FIMEMORY * memStream = FreeImage_OpenMemory((unsigned char *)_data, _byteCount);
+    FREE_IMAGE_FORMAT fileType = FreeImage_GetFileTypeFromMemory(memStream, _byteCount);
+
+    if (fileType != FIF_UNKNOWN)
+    {
+        FIBITMAP * img = FreeImage_LoadFromMemory(fileType, memStream);
+        FREE_IMAGE_COLOR_TYPE colorType = FreeImage_GetColorType(img);
+        FREE_IMAGE_TYPE imageType = FreeImage_GetImageType(img);
+
+        int bpp = FreeImage_GetBPP(img);
+        int width = FreeImage_GetWidth(img);
+        int height = FreeImage_GetHeight(img);
+        int pitch = FreeImage_GetPitch(img);
+        int bytePaddingPerRow = pitch - width * (bpp / 8);
+
+        if (imageType == FIT_RGBF)
+        {
+            return ResultType(ImageUniquePtr(
+                _alloc.create<ImageRGB32f>(
+                    width, height, (float *)FreeImage_GetBits(img), bytePaddingPerRow, _alloc),
+                _alloc));
+        }
+        else if (imageType == FIT_RGBAF)
+        {
+            return ResultType(ImageUniquePtr(
+                _alloc.create<ImageRGBA32f>(
+                    width, height, (float *)FreeImage_GetBits(img), bytePaddingPerRow, _alloc),
+                _alloc));
+        }
+        else
+        {
+            // grayscale image
+            if (colorType == FIC_MINISBLACK)
+            {
+                if (bpp == 8)
+                {
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageGray8>(width,
+                                                  height,
+                                                  (unsigned char *)FreeImage_GetBits(img),
+                                                  bytePaddingPerRow,
+                                                  _alloc),
+                        _alloc));
+                }
+                else if (bpp == 16)
+                {
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageGray16>(width,
+                                                   height,
+                                                   (unsigned short *)FreeImage_GetBits(img),
+                                                   bytePaddingPerRow,
+                                                   _alloc),
+                        _alloc));
+                }
+                else
+                {
+                    return Error(ec::Unsupported,
+                                 "Grayscale images are only supported in 8 or 16 bits per pixel.",
+                                 STICK_FILE,
+                                 STICK_LINE);
+                }
+            }
+            else if (colorType == FIC_RGB)
+            {
+                // free image uses BGR, so we do too for speed
+                if (bpp == 24)
+                {
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageBGR8>(width,
+                                                 height,
+                                                 (unsigned char *)FreeImage_GetBits(img),
+                                                 bytePaddingPerRow,
+                                                 _alloc),
+                        _alloc));
+                }
+                // this is a FreeImage oddity that happens if we call FreeImage_ConvertTo32Bits
+                // as it won't change the color type to FIC_RGBALPHA (this a bug? who knows daawg)
+                else if (bpp == 32)
+                {
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageBGRA8>(width,
+                                                  height,
+                                                  (unsigned char *)FreeImage_GetBits(img),
+                                                  bytePaddingPerRow,
+                                                  _alloc),
+                        _alloc));
+                }
+                else if (bpp == 48)
+                {
+                    // 48 bit on the other hand are natively stored as rgb in freeimage....
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageRGB16>(width,
+                                                  height,
+                                                  (unsigned short *)FreeImage_GetBits(img),
+                                                  bytePaddingPerRow,
+                                                  _alloc),
+                        _alloc));
+                }
+                else
+                {
+                    return Error(ec::Unsupported,
+                                 "RGB images are only supported in 24 or 48 bits per pixel.",
+                                 STICK_FILE,
+                                 STICK_LINE);
+                }
+            }
+            else if (colorType == FIC_RGBALPHA)
+            {
+                // free image uses BGR, so we do too for speed
+                if (bpp == 32)
+                {
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageBGRA8>(width,
+                                                  height,
+                                                  (unsigned char *)FreeImage_GetBits(img),
+                                                  bytePaddingPerRow,
+                                                  _alloc),
+                        _alloc));
+                }
+                else if (bpp == 64)
+                {
+                    // 64 bit on the other hand are natively stored as rgb in freeimage....
+                    return ResultType(ImageUniquePtr(
+                        _alloc.create<ImageRGBA16>(width,
+                                                   height,
+                                                   (unsigned short *)FreeImage_GetBits(img),
+                                                   bytePaddingPerRow,
+                                                   _alloc),
+                        _alloc));
+                }
+                else
+                {
+                    return Error(ec::Unsupported,
+                                 "RGBA images are only supported in 32 or 64 bits per pixel.",
+                                 STICK_FILE,
+                                 STICK_LINE);
+                }
+            }
+        }
+    }
+
+    FreeImage_CloseMemory(memStream);
+    return Error(ec::Unsupported, "The image format is not supported.", STICK_FILE, STICK_LINE);
+}
+
+Result<ImageUniquePtr> decodeImage(const void * _data,
+                                   Size _byteCount,
+                                   const DecodeSettings & _settings,
+                                   Allocator & _alloc)
+{
+    if (isPicFile(_data, _byteCount))
+        return decodePicFile(_data, _byteCount, _settings, _alloc);
+
+    Error err = checkDecodeSettings(_settings);
+    if (err)
+        return err;
+    if (isJPEG(_data, _byteCount) && _settings.jpegScaleDenominator != 1)
+        return Error(ec::Unsupported,
+                     "FreeImage can't scale jpegs down when decoding",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    // FreeImage has no decoding options, so the settings are applied to the decoded image
+    auto res = decodeFreeImage(_data, _byteCount, _alloc);
+    if (!res)
+        return res;
+
+    if (_settings.channelCount && res.get()->channelCount() != _settings.channelCount)
+        return Error(ec::Unsupported,
+                     "FreeImage can't convert the channel count when decoding",
+                     STICK_FILE,
+                     STICK_LINE);
+    if (_settings.flipVertically)
+        res.get()->flipRows();
+    return res;
+}
+
+Result<ImageUniquePtr> loadImage(const String & _path,
+                                 const DecodeSettings & _settings,
+                                 Allocator & _alloc)
+{
+    if (hasPicExtension(_path))
+        return loadPicFile(_path, _settings, _alloc);
+
+    MappedFile file;
+    if (!file.open(_path))
+        return decodeImage(file.data(), file.byteCount(), _settings, _alloc);
+
+    // fall back to reading the whole file where it can't be mapped
+    auto res = loadBinaryFile(_path, _alloc);
+    if (res)
+    {
+        return decodeImage(&res.get()[0], res.get().count(), _settings, _alloc);
+    }
+    return res.error();
+}
+
+// FreeImage always decodes whole images, so jpeg regions are cropped from the full image
+Result<ImageUniquePtr> decodeRegion(const void * _data,
+                                    Size _byteCount,
+                                    Size _left,
+                                    Size _top,
+                                    Size _width,
+                                    Size _height,
+                                    Allocator & _alloc)
+{
+    return decodeRegionStreamed(_data, _byteCount, _left, _top, _width, _height, _alloc);
+}
+
+// FreeImage's handle based loading needs to seek, which streams can't do, so we read everything
+static void readStream(Reader & _reader, ByteArray & _out)
+{
+    Size count = 0;
+    while (!_reader.isAtEnd())
+    {
+        _out.resize(std::max(count + 4096, count * 2));
+        Size n = _reader.read(&_out[count], _out.count() - count);
+        if (!n)
+            break;
+        count += n;
+    }
+    _out.resize(count);
+}
+
+Result<ImageUniquePtr> decodeImage(Reader & _reader, Allocator & _alloc)
+{
+    ByteArray data(_alloc);
+    readStream(_reader, data);
+    if (data.isEmpty())
+        return Error(ec::InvalidOperation, "The stream is empty", STICK_FILE, STICK_LINE);
+    return decodeImage(data, _alloc);
+}
+
+static Error copyDecodedInto(Image & _target, const Result<ImageUniquePtr> & _res)
+{
+    if (!_res)
+        return _res.error();
+
+    // FreeImage decodes to a fixed pixel type per format, so we can only reorder channels
+    const Image & src = *_res.get();
+    if (src.valueTypeID() != _target.valueTypeID() || src.channelCount() != _target.channelCount())
+        return Error(ec::Unsupported,
+                     "FreeImage can't convert the channel count or value type when decoding",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    _target.loadRawPixels(src.width(), src.height(), src.depth(), src.bytePtr(), src.rowPadding());
+    return convertChannelOrder(_target, src.channelLayoutTypeID());
+}
+
+Error decodeInto(Image & _target, const void * _data, Size _byteCount)
+{
+    return copyDecodedInto(_target, decodeImage(_data, _byteCount, _target.allocator()));
+}
+
+Error decodeInto(Image & _target, Reader & _reader)
+{
+    return copyDecodedInto(_target, decodeImage(_reader, _target.allocator()));
+}
+
+Error loadInto(Image & _target, const String & _path)
+{
+    return copyDecodedInto(_target, loadImage(_path, _target.allocator()));
+}
+
+Result<AnimatedImage> decodeAnimatedImage(const void * _data, Size _byteCount, Allocator & _alloc)
+{
+    FIMEMORY * memStream = FreeImage_OpenMemory((unsigned char *)_data, _byteCount);
+    if (FreeImage_GetFileTypeFromMemory(memStream, _byteCount) != FIF_GIF)
+    {
+        FreeImage_CloseMemory(memStream);
+        return Error(ec::Unsupported, "Only gifs can be animated", STICK_FILE, STICK_LINE);
+    }
+
+    // GIF_PLAYBACK composites the frames to 32 bit images of the full logical screen size
+    FIMULTIBITMAP * multi = FreeImage_LoadMultiBitmapFromMemory(FIF_GIF, memStream, GIF_PLAYBACK);
+    int frameCount = multi ? FreeImage_GetPageCount(multi) : 0;
+    if (frameCount <= 0)
+    {
+        if (multi)
+            FreeImage_CloseMultiBitmap(multi);
+        FreeImage_CloseMemory(memStream);
+        return Error(ec::InvalidOperation, "Could not parse gif", STICK_FILE, STICK_LINE);
+    }
+
+    AnimatedImage ret = { ImageRGBA8(_alloc), DynamicArray<UInt32>(_alloc) };
+    ret.delays.resize(frameCount);
+    for (int i = 0; i < frameCount; ++i)
+    {
+        FIBITMAP * page = FreeImage_LockPage(multi, i);
+        if (i == 0)
+            ret.frames.resize(FreeImage_GetWidth(page), FreeImage_GetHeight(page), frameCount, 0);
+
+        // converting to raw bits also flips the bottom up FreeImage rows
+        Size frameByteCount = ret.frames.width() * ret.frames.height() * 4;
+        FreeImage_ConvertToRawBits((BYTE *)ret.frames.bytePtr() + i * frameByteCount,
+                                   page,
+                                   ret.frames.width() * 4,
+                                   32,
+                                   FI_RGBA_RED_MASK,
+                                   FI_RGBA_GREEN_MASK,
+                                   FI_RGBA_BLUE_MASK,
+                                   TRUE);
+
+        FITAG * tag = nullptr;
+        ret.delays[i] = 0;
+        if (FreeImage_GetMetadata(FIMD_ANIMATION, page, "FrameTime", &tag) && tag)
+            ret.delays[i] = *static_cast<const LONG *>(FreeImage_GetTagValue(tag));
+        FreeImage_UnlockPage(multi, page, FALSE);
+    }
+    FreeImage_CloseMultiBitmap(multi);
+    FreeImage_CloseMemory(memStream);
+
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+    Error err = convertChannelOrder(ret.frames, ChannelLayoutBGRA::channelLayoutTypeID());
+    if (err)
+        return err;
+#endif // FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+    return ret;
+}
+
+// expects a bitmap loaded with FIF_LOAD_NOPIXELS and takes ownership of it
+static Result<ImageInfo> probeFreeImage(FIBITMAP * _img)
+{
+    if (!_img)
+        return Error(ec::InvalidOperation, "Could not parse image header", STICK_FILE, STICK_LINE);
+
+    FREE_IMAGE_COLOR_TYPE colorType = FreeImage_GetColorType(_img);
+    FREE_IMAGE_TYPE imageType = FreeImage_GetImageType(_img);
+    unsigned bpp = FreeImage_GetBPP(_img);
+
+    // mirrors the pixel types picked by decodeImage
+    ImageInfo ret = { FreeImage_GetWidth(_img), FreeImage_GetHeight(_img), 0, false, false, 0 };
+    if (imageType == FIT_RGBF)
+    {
+        ret.channelCount = 3;
+        ret.isHDR = true;
+        ret.pixelTypeID = ImageRGB32f::pixelTID;
+    }
+    else if (imageType == FIT_RGBAF)
+    {
+        ret.channelCount = 4;
+        ret.isHDR = true;
+        ret.pixelTypeID = ImageRGBA32f::pixelTID;
+    }
+    else if (colorType == FIC_MINISBLACK && (bpp == 8 || bpp == 16))
+    {
+        ret.channelCount = 1;
+        ret.is16Bit = bpp == 16;
+        ret.pixelTypeID = bpp == 8 ? ImageGray8::pixelTID : ImageGray16::pixelTID;
+    }
+    else if (colorType == FIC_RGB && (bpp == 24 || bpp == 32 || bpp == 48))
+    {
+        ret.channelCount = bpp == 32 ? 4 : 3;
+        ret.is16Bit = bpp == 48;
+        ret.pixelTypeID = bpp == 24 ? ImageBGR8::pixelTID
+                                    : bpp == 32 ? ImageBGRA8::pixelTID : ImageRGB16::pixelTID;
+    }
+    else if (colorType == FIC_RGBALPHA && (bpp == 32 || bpp == 64))
+    {
+        ret.channelCount = 4;
+        ret.is16Bit = bpp == 64;
+        ret.pixelTypeID = bpp == 32 ? ImageBGRA8::pixelTID : ImageRGBA16::pixelTID;
+    }
+    FreeImage_Unload(_img);
+
+    if (!ret.channelCount)
+        return Error(
+            ec::Unsupported, "The image format is not supported.", STICK_FILE, STICK_LINE);
+    return ret;
+}
+
+Result<ImageInfo> probeImage(const void * _data, Size _byteCount)
+{
+    if (isPicFile(_data, _byteCount))
+        return probePicFile(_data, _byteCount);
+
+    FIMEMORY * memStream = FreeImage_OpenMemory((unsigned char *)_data, _byteCount);
+    FREE_IMAGE_FORMAT fileType = FreeImage_GetFileTypeFromMemory(memStream, _byteCount);
+    if (fileType == FIF_UNKNOWN)
+    {
+        FreeImage_CloseMemory(memStream);
+        return Error(
+            ec::Unsupported, "The image format is not supported.", STICK_FILE, STICK_LINE);
+    }
+    auto ret = probeFreeImage(FreeImage_LoadFromMemory(fileType, memStream, FIF_LOAD_NOPIXELS));
+    FreeImage_CloseMemory(memStream);
+    return ret;
+}
+
+Result<ImageInfo> probeImage(const String & _path)
+{
+    if (hasPicExtension(_path))
+        return probePicFile(_path);
+
+    FREE_IMAGE_FORMAT fileType = FreeImage_GetFileType(_path.cString());
+    if (fileType == FIF_UNKNOWN)
+        return Error(
+            ec::Unsupported, "The image format is not supported.", STICK_FILE, STICK_LINE);
+    return probeFreeImage(FreeImage_Load(fileType, _path.cString(), FIF_LOAD_NOPIXELS));
+}
+
+// maps the settings to FreeImage's save flags. FreeImage can't force a png filter.
+static int freeImageSaveFlags(FREE_IMAGE_FORMAT _fif, const SaveSettings & _settings)
+{
+    if (_fif == FIF_JPEG)
+        return (int)std::min(std::max(_settings.jpegQuality, 1u), 100u);
+    else if (_fif == FIF_PNG)
+        return _settings.pngCompressionLevel <= 0 ? PNG_Z_NO_COMPRESSION
+                                                  : std::min(_settings.pngCompressionLevel, 9);
+    else if (_fif == FIF_TARGA)
+        return _settings.tgaRLE ? TARGA_SAVE_RLE : 0;
+    return 0;
+}
+
+static Error encodeFreeImage(const Image & _image,
+                             FREE_IMAGE_FORMAT _fif,
+                             ByteArray & _out,
+                             const SaveSettings & _settings)
+{
+    // the channel masks don't seem to do anything in FreeImage_ConvertFromRawBits (bug?), so we
+    // convert RGB to BGR for RGB images as that is what freeimage expects
+    ImageUniquePtr tmp;
+    const Image * imgToSave = &_image;
+    if (_image.channelLayoutTypeID() == ChannelLayoutRGB::TypeInfo::typeID() ||
+        _image.channelLayoutTypeID() == ChannelLayoutRGBA::TypeInfo::typeID())
+    {
+        tmp = ImageUniquePtr(_image.clone(_image.allocator()), _image.allocator());
+        tmp->swapChannels(0, 2);
+        imgToSave = tmp.get();
+    }
+
+    FIBITMAP * img = FreeImage_ConvertFromRawBits((BYTE *)imgToSave->bytePtr(),
+                                                  imgToSave->width(),
+                                                  imgToSave->height(),
+                                                  imgToSave->bytesPerRow(),
+                                                  imgToSave->bitsPerPixel(),
+                                                  FI_RGBA_RED_MASK,
+                                                  FI_RGBA_GREEN_MASK,
+                                                  FI_RGBA_BLUE_MASK,
+                                                  false);
+
+    FIMEMORY * mem = FreeImage_OpenMemory();
+    bool result = FreeImage_SaveToMemory(_fif, img, mem, freeImageSaveFlags(_fif, _settings));
+    if (result)
+    {
+        BYTE * ptr = NULL;
+        DWORD sizeInBytes = 0;
+        FreeImage_AcquireMemory(mem, &ptr, &sizeInBytes);
+        _out.insert(_out.end(), (const char *)ptr, (const char *)ptr + sizeInBytes);
+    }
+    FreeImage_CloseMemory(mem);
+    FreeImage_Unload(img);
+
+    if (!result)
+        return Error(ec::ComposeFailed, "Could not encode image.", STICK_FILE, STICK_LINE);
+    return Error();
+}
+
+Error encodeImage(const Image & _image,
+                  ImageFormat _format,
+                  ByteArray & _out,
+                  const SaveSettings & _settings)
+{
+    if (_format == ImageFormat::Pic)
+        return encodePicFile(_image, _out);
+
+    FREE_IMAGE_FORMAT fif = FIF_PNG;
+    if (_format == ImageFormat::JPEG)
+        fif = FIF_JPEG;
+    else if (_format == ImageFormat::BMP)
+        fif = FIF_BMP;
+    else if (_format == ImageFormat::TGA)
+        fif = FIF_TARGA;
+    else if (_format == ImageFormat::HDR)
+        fif = FIF_HDR;
+    return encodeFreeImage(_image, fif, _out, _settings);
+}
+
+Error Image::save(const String & _path, const SaveSettings & _settings)
+{
+    if (hasPicExtension(_path))
+        return savePicFile(*this, _path);
+
+    FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename(toString(_path).cString());
+    if (fif == FIF_UNKNOWN)
+        return Error(
+            ec::Unsupported, "The requested image type is not supported.", STICK_FILE, STICK_LINE);
+
+    ByteArray data(allocator());
+    Error err = encodeFreeImage(*this, fif, data, _settings);
+    if (err)
+        return err;
+    return saveBinaryFile(data, _path);
+}
+
+// FreeImage can't decode jpegs row by row
+Error PushDecoder::decodeJPEG(Reader & _reader)
+{
+    return decodeWhole(_reader);
+}
+
+#elif defined(PIC_IMPLEMENTATION_STB)
+
+namespace detail
+{
+// Routes all stb image allocations of the calling thread through a stick allocator for as long as
+// the scope is alive. If a target buffer is provided, the first allocation that fits it is served
+// from it, which lets stb decode straight into the storage of the ImageT that we return.
+struct STBAllocationScope
+{
+    STBAllocationScope(Allocator & _alloc,
+                       char * _target = nullptr,
+                       Size _targetByteCount = 0,
+                       Size _targetCapacity = 0);
+
+    ~STBAllocationScope();
+
+    Allocator * allocator;
+    char * target;
+    Size targetByteCount;
+    Size targetCapacity;
+    bool targetInUse;
+    STBAllocationScope * previous;
+};
+
+// every allocation that is not the target is prefixed with this header so that we know how to
+// free it, even if that happens after the scope it was allocated in is gone.
+struct STBAllocationHeader
+{
+    Allocator * allocator;
+    Size byteCount;
+};
+
+static constexpr Size s_stbHeaderSize = 16;
+static_assert(sizeof(STBAllocationHeader) <= s_stbHeaderSize, "stb allocation header too big");
+
+static thread_local STBAllocationScope * t_stbScope = nullptr;
+
+STBAllocationScope::STBAllocationScope(Allocator & _alloc,
+                                       char * _target,
+                                       Size _targetByteCount,
+                                       Size _targetCapacity) :
+    allocator(&_alloc),
+    target(_target),
+    targetByteCount(_targetByteCount),
+    targetCapacity(_targetCapacity),
+    targetInUse(false),
+    previous(t_stbScope)
+{
+    t_stbScope = this;
+}
+
+STBAllocationScope::~STBAllocationScope()
+{
+    t_stbScope = previous;
+}
+
+void * stbMalloc(Size _byteCount)
+{
+    STBAllocationScope * scope = t_stbScope;
+    if (scope && scope->target && !scope->targetInUse && _byteCount >= scope->targetByteCount &&
+        _byteCount <= scope->targetCapacity)
+    {
+        scope->targetInUse = true;
+        return scope->target;
+    }
+
+    Allocator & alloc = t_scratchAllocator ? *t_scratchAllocator
+                        : scope            ? *scope->allocator
+                                           : defaultAllocator();
+    Block blk = alloc.allocate(_byteCount + s_stbHeaderSize, s_stbHeaderSize);
+    if (!blk.ptr)
+        return nullptr;
+    STBAllocationHeader * header = reinterpret_cast<STBAllocationHeader *>(blk.ptr);
+    header->allocator = &alloc;
+    header->byteCount = blk.byteCount;
+    return static_cast<char *>(blk.ptr) + s_stbHeaderSize;
+}
+
+void stbFree(void * _ptr)
+{
+    if (!_ptr)
+        return;
+
+    STBAllocationScope * scope = t_stbScope;
+    if (scope && _ptr == scope->target)
+    {
+        scope->targetInUse = false;
+        return;
+    }
+
+    char * base = static_cast<char *>(_ptr) - s_stbHeaderSize;
+    STBAllocationHeader * header = reinterpret_cast<STBAllocationHeader *>(base);
+    header->allocator->deallocate({ base, header->byteCount });
+}
+
+void * stbRealloc(void * _ptr, Size _byteCount)
+{
+    if (!_ptr)
+        return stbMalloc(_byteCount);
+
+    STBAllocationScope * scope = t_stbScope;
+    Size oldByteCount;
+    if (scope && _ptr == scope->target)
+        oldByteCount = scope->targetByteCount;
+    else
+        oldByteCount = reinterpret_cast<STBAllocationHeader *>(static_cast<char *>(_ptr) -
+                                                               s_stbHeaderSize)
+                           ->byteCount -
+                       s_stbHeaderSize;
+
+    // stick allocators can't grow a block in place, so we always move
+    void * ret = stbMalloc(_byteCount);
+    if (!ret)
+        return nullptr;
+    memcpy(ret, _ptr, std::min(oldByteCount, _byteCount));
+    stbFree(_ptr);
+    return ret;
+}
+
+// the deflate implementation png encoding on the calling thread uses, set by encodeSTB
+static thread_local DeflateImplementation t_pngDeflate = DeflateImplementation::Pic;
+
+unsigned char * stbZlibCompress(unsigned char * _data, int _byteCount, int * _outLen, int _level)
+{
+    if (t_pngDeflate == DeflateImplementation::STB)
+        return stbiw__zlib_compress_builtin(_data, _byteCount, _outLen, _level);
+
+    // allocated through the hooks, as stb frees the result with STBIW_FREE
+    unsigned char * ret = (unsigned char *)stbMalloc(zlibCompressBound(_byteCount));
+    if (!ret)
+        return nullptr;
+    STBAllocationScope * scope = t_stbScope;
+    Size byteCount = zlibCompress(
+        _data, _byteCount, _level, ret, scope ? *scope->allocator : defaultAllocator());
+    if (!byteCount)
+    {
+        stbFree(ret);
+        return nullptr;
+    }
+    *_outLen = (int)byteCount;
+    return ret;
+}
+} // namespace detail
+
+// where stb reads the encoded image from
+struct STBSource
+{
+    const stbi_uc * data;
+    int byteCount;
+    FILE * file;
+    // for streams, data only holds the beginning of the stream for the header queries and the
+    // image itself is loaded through the callbacks
+    const stbi_io_callbacks * callbacks;
+    void * user;
+};
+
+static bool stbInfo(const STBSource & _src, int * _w, int * _h, int * _n)
+{
+    // the stb file functions restore the file position, so we can query them one after another
+    if (_src.file)
+        return stbi_info_from_file(_src.file, _w, _h, _n);
+    return stbi_info_from_memory(_src.data, _src.byteCount, _w, _h, _n);
+}
+
+static bool stbIsHDR(const STBSource & _src)
+{
+    if (_src.file)
+        return stbi_is_hdr_from_file(_src.file);
+    return stbi_is_hdr_from_memory(_src.data, _src.byteCount);
+}
+
+static bool stbIs16Bit(const STBSource & _src)
+{
+    if (_src.file)
+        return stbi_is_16_bit_from_file(_src.file);
+    return stbi_is_16_bit_from_memory(_src.data, _src.byteCount);
+}
+
+// the ImageT types that stb image data maps to and the matching stb loader, by channel value type
+template <class T>
+struct STBTraits;
+
+template <>
+struct STBTraits<UInt8>
+{
+    typedef ImageGray8 Gray;
+    typedef ImageGrayAlpha8 GrayAlpha;
+    typedef ImageRGB8 RGB;
+    typedef ImageRGBA8 RGBA;
+    static const bool convertsChannelOrder = true;
+
+    static UInt8 * load(const STBSource & _src, int * _w, int * _h, int _channelCount)
+    {
+        int n;
+        if (_src.file)
+            return stbi_load_from_file(_src.file, _w, _h, &n, _channelCount);
+        if (_src.callbacks)
+            return stbi_load_from_callbacks(_src.callbacks, _src.user, _w, _h, &n, _channelCount);
+        return stbi_load_from_memory(_src.data, _src.byteCount, _w, _h, &n, _channelCount);
+    }
+};
+
+template <>
+struct STBTraits<UInt16>
+{
+    typedef ImageGray16 Gray;
+    typedef ImageGrayAlpha16 GrayAlpha;
+    typedef ImageRGB16 RGB;
+    typedef ImageRGBA16 RGBA;
+    static const bool convertsChannelOrder = true;
+
+    static UInt16 * load(const STBSource & _src, int * _w, int * _h, int _channelCount)
+    {
+        int n;
+        if (_src.file)
+            return stbi_load_from_file_16(_src.file, _w, _h, &n, _channelCount);
+        if (_src.callbacks)
+            return stbi_load_16_from_callbacks(
+                _src.callbacks, _src.user, _w, _h, &n, _channelCount);
+        return stbi_load_16_from_memory(_src.data, _src.byteCount, _w, _h, &n, _channelCount);
+    }
+};
+
+template <>
+struct STBTraits<Float32>
+{
+    typedef ImageGray32f Gray;
+    typedef ImageGrayAlpha32f GrayAlpha;
+    typedef ImageRGB32f RGB;
+    typedef ImageRGBA32f RGBA;
+    // stb makes floats out of its 8 bit result, expecting the alpha last
+    static const bool convertsChannelOrder = false;
+
+    static Float32 * load(const STBSource & _src, int * _w, int * _h, int _channelCount)
+    {
+        int n;
+        if (_src.file)
+            return stbi_loadf_from_file(_src.file, _w, _h, &n, _channelCount);
+        if (_src.callbacks)
+            return stbi_loadf_from_callbacks(_src.callbacks, _src.user, _w, _h, &n, _channelCount);
+        return stbi_loadf_from_memory(_src.data, _src.byteCount, _w, _h, &n, _channelCount);
+    }
+};
+
+template <class T>
+static ImageUniquePtr createImageForChannelCount(int _channelCount, Allocator & _alloc)
+{
+    typedef STBTraits<T> Traits;
+    if (_channelCount == 1)
+        return makeUnique<typename Traits::Gray>(_alloc, _alloc);
+    else if (_channelCount == 2)
+        return makeUnique<typename Traits::GrayAlpha>(_alloc, _alloc);
+    else if (_channelCount == 3)
+        return makeUnique<typename Traits::RGB>(_alloc, _alloc);
+    else if (_channelCount == 4)
+        return makeUnique<typename Traits::RGBA>(_alloc, _alloc);
+    return ImageUniquePtr();
+}
+
+template <class T>
+static TypeID stbPixelTypeID(int _channelCount)
+{
+    typedef STBTraits<T> Traits;
+    if (_channelCount == 1)
+        return Traits::Gray::pixelTID;
+    else if (_channelCount == 2)
+        return Traits::GrayAlpha::pixelTID;
+    else if (_channelCount == 3)
+        return Traits::RGB::pixelTID;
+    return Traits::RGBA::pixelTID;
+}
+
+// the channel layout stb image produces for a channel count
+static TypeID stbChannelLayout(UInt32 _channelCount)
+{
+    if (_channelCount == 1)
+        return ChannelLayoutGray::channelLayoutTypeID();
+    else if (_channelCount == 2)
+        return ChannelLayoutGrayAlpha::channelLayoutTypeID();
+    else if (_channelCount == 3)
+        return ChannelLayoutRGB::channelLayoutTypeID();
+    return ChannelLayoutRGBA::channelLayoutTypeID();
+}
+
+// Decodes into the target, letting stb convert to the channel count and value type of the target.
+// The target is preallocated based on the image header, so that in the common case stb writes its
+// final buffer directly into the target and no copy is needed.
+// stb only has global or thread local switches for these, so we set them for the calling thread
+// before every decode
+static void applySTBDecodeSettings(const DecodeSettings & _settings)
+{
+    stbi_set_flip_vertically_on_load_thread(_settings.flipVertically);
+    stbi_convert_iphone_png_to_rgb_thread(_settings.unpremultiply);
+    stbi_set_unpremultiply_on_load_thread(_settings.unpremultiply);
+    stbi_set_jpeg_scale_thread(_settings.jpegScaleDenominator == 8   ? 3
+                               : _settings.jpegScaleDenominator == 4 ? 2
+                               : _settings.jpegScaleDenominator == 2 ? 1
+                                                                     : 0);
+    stbi_set_jpeg_region_thread(0, 0, 0, 0);
+}
+
+// lets stb write the channels in the order of the target while it converts them to the channel
+// count of the target, see stbi_set_channel_order_thread
+static void setSTBChannelOrder(const Image & _target)
+{
+    UInt32 order[4];
+    if (_target.channelCount() < 3 ||
+        !canonicalChannelOrder(_target.channelLayoutTypeID(), order))
+    {
+        stbi_set_channel_order_thread(0, nullptr);
+        return;
+    }
+
+    int stbOrder[4];
+    bool isIdentity = true;
+    for (UInt32 i = 0; i < _target.channelCount(); ++i)
+    {
+        stbOrder[i] = (int)order[i];
+        isIdentity = isIdentity && order[i] == i;
+    }
+    stbi_set_channel_order_thread(isIdentity ? 0 : (int)_target.channelCount(), stbOrder);
+}
+
+// the part of a jpeg to decode, see decodeRegion
+struct STBRegion
+{
+    int left;
+    int top;
+    int width;
+    int height;
+};
+
+template <class T>
+static Error decodeSTBInto(Image & _target,
+                           const STBSource & _src,
+                           const DecodeSettings & _settings,
+                           const STBRegion * _region)
+{
+    Error err = checkDecodeSettings(_settings);
+    if (err)
+        return err;
+
+    // stb reports the scaled down or region size of jpegs once the settings are applied
+    applySTBDecodeSettings(_settings);
+    if (_region)
+        stbi_set_jpeg_region_thread(
+            _region->left, _region->top, _region->width, _region->height);
+    int w, h, n;
+    if (!stbInfo(_src, &w, &h, &n))
+        return Error(ec::InvalidOperation,
+                     "Could not parse image from compressed data",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    // stb's jpeg decoder allocates its output with one byte of slack. Reserving only grows the
+    // storage, so decoding same sized images into the same target does not reallocate.
+    Size byteCount = (Size)w * (Size)h * _target.bytesPerPixel();
+    _target.reserve(byteCount + 1);
+    _target.resize((Size)w, (Size)h, 1, 0);
+
+    detail::STBAllocationScope scope(
+        _target.allocator(), _target.bytePtr(), byteCount, byteCount + 1);
+    if (STBTraits<T>::convertsChannelOrder)
+        setSTBChannelOrder(_target);
+    T * data = STBTraits<T>::load(_src, &w, &h, (int)_target.channelCount());
+    bool isReordered = stbi_channel_order_applied_thread() != 0;
+    stbi_set_channel_order_thread(0, nullptr);
+    if (!data)
+        return Error(ec::InvalidOperation,
+                     "Could not parse image from compressed data",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    if ((char *)data != _target.bytePtr())
+    {
+        // stb allocated the final buffer on its own (i.e. interlaced png), copy it over
+        _target.loadRawPixels((Size)w, (Size)h, 1, (const char *)data);
+        stbi_image_free(data);
+    }
+
+    // images stb did not convert (i.e. an rgba png loaded as bgra) are reordered in place
+    if (isReordered)
+        return Error();
+    return convertChannelOrder(_target, stbChannelLayout(_target.channelCount()));
+}
+
+static Error decodeSTBInto(Image & _target,
+                           const STBSource & _src,
+                           const DecodeSettings & _settings,
+                           const STBRegion * _region = nullptr)
+{
+    if (_target.isFloatingPoint() && _target.bitsPerChannel() == 32)
+        return decodeSTBInto<Float32>(_target, _src, _settings, _region);
+    else if (!_target.isFloatingPoint() && _target.bitsPerChannel() == 16)
+        return decodeSTBInto<UInt16>(_target, _src, _settings, _region);
+    else if (!_target.isFloatingPoint() && _target.bitsPerChannel() == 8)
+        return decodeSTBInto<UInt8>(_target, _src, _settings, _region);
+
+    return Error(ec::Unsupported,
+                 "Stb can only decode to 8 bit, 16 bit and 32 bit floating point images",
+                 STICK_FILE,
+                 STICK_LINE);
+}
+
+static Result<ImageUniquePtr> decodeSTB(const STBSource & _src,
+                                        const DecodeSettings & _settings,
+                                        Allocator & _alloc)
+{
+    int w, h, n;
+    if (!stbInfo(_src, &w, &h, &n))
+        return Error(ec::InvalidOperation,
+                     "Could not parse image from compressed data",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    if (_settings.channelCount)
+        n = (int)_settings.channelCount;
+
+    // pick the ImageT that matches the source, so 16 bit and hdr sources don't lose precision
+    ImageUniquePtr img;
+    if (stbIsHDR(_src))
+        img = createImageForChannelCount<Float32>(n, _alloc);
+    else if (stbIs16Bit(_src))
+        img = createImageForChannelCount<UInt16>(n, _alloc);
+    else
+        img = createImageForChannelCount<UInt8>(n, _alloc);
+
+    if (!img)
+        return Error(ec::InvalidOperation, "Unsupported channel count", STICK_FILE, STICK_LINE);
+
+    Error err = decodeSTBInto(*img, _src, _settings);
+    if (err)
+        return err;
+    return img;
+}
+
+Result<ImageUniquePtr> decodeImage(const void * _data,
+                                   Size _byteCount,
+                                   const DecodeSettings & _settings,
+                                   Allocator & _alloc)
+{
+    if (isPicFile(_data, _byteCount))
+        return decodePicFile(_data, _byteCount, _settings, _alloc);
+
+    STBSource src = { (const stbi_uc *)_data, (int)_byteCount, nullptr, nullptr, nullptr };
+    return decodeSTB(src, _settings, _alloc);
+}
+
+Result<ImageUniquePtr> decodeRegion(const void * _data,
+                                    Size _byteCount,
+                                    Size _left,
+                                    Size _top,
+                                    Size _width,
+                                    Size _height,
+                                    Allocator & _alloc)
+{
+    if (!isJPEG(_data, _byteCount))
+        return decodeRegionStreamed(_data, _byteCount, _left, _top, _width, _height, _alloc);
+
+    STBSource src = { (const stbi_uc *)_data, (int)_byteCount, nullptr, nullptr, nullptr };
+    applySTBDecodeSettings(DecodeSettings());
+    int w, h, n;
+    if (!stbInfo(src, &w, &h, &n))
+        return Error(
+            ec::InvalidOperation, "Could not parse image header", STICK_FILE, STICK_LINE);
+    Error err = checkRegion(_left, _top, _width, _height, (Size)w, (Size)h);
+    if (err)
+        return err;
+
+    ImageUniquePtr img = createImageForChannelCount<UInt8>(n, _alloc);
+    STBRegion region = { (int)_left, (int)_top, (int)_width, (int)_height };
+    err = decodeSTBInto(*img, src, DecodeSettings(), &region);
+    if (err)
+        return err;
+    return img;
+}
+
+// Calls _fn with an stb source for the file at _path. The file is memory mapped where possible and
+// only read through stdio if it can't be mapped.
+template <class F>
+static auto withSTBFileSource(const String & _path, F _fn) -> decltype(_fn(STBSource()))
+{
+    MappedFile mapped;
+    if (!mapped.open(_path) && mapped.byteCount() <= (Size)INT_MAX)
+    {
+        STBSource src = {
+            (const stbi_uc *)mapped.data(), (int)mapped.byteCount(), nullptr, nullptr, nullptr
+        };
+        return _fn(src);
+    }
+
+    FILE * file = stbi__fopen(_path.cString(), "rb");
+    if (!file)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    STBSource src = { nullptr, 0, file, nullptr, nullptr };
+    auto ret = _fn(src);
+    fclose(file);
+    return ret;
+}
+
+Result<ImageUniquePtr> loadImage(const String & _path,
+                                 const DecodeSettings & _settings,
+                                 Allocator & _alloc)
+{
+    if (hasPicExtension(_path))
+        return loadPicFile(_path, _settings, _alloc);
+
+    return withSTBFileSource(
+        _path, [&](const STBSource & _src) { return decodeSTB(_src, _settings, _alloc); });
+}
+
+// .pic files are stored as they are, so only the channel order can be changed on the way in
+static Error copyPicFileInto(Image & _target, const Result<ImageUniquePtr> & _res)
+{
+    if (!_res)
+        return _res.error();
+
+    const Image & src = *_res.get();
+    if (src.valueTypeID() != _target.valueTypeID() || src.channelCount() != _target.channelCount())
+        return Error(ec::Unsupported,
+                     "Can't convert the channel count or value type of a .pic file",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    _target.loadRawPixels(src.width(), src.height(), src.depth(), src.bytePtr(), src.rowPadding());
+    return convertChannelOrder(_target, src.channelLayoutTypeID());
+}
+
+Error decodeInto(Image & _target, const void * _data, Size _byteCount)
+{
+    if (isPicFile(_data, _byteCount))
+        return copyPicFileInto(
+            _target, decodePicFile(_data, _byteCount, DecodeSettings(), _target.allocator()));
+
+    STBSource src = { (const stbi_uc *)_data, (int)_byteCount, nullptr, nullptr, nullptr };
+    return decodeSTBInto(_target, src, DecodeSettings());
+}
+
+Result<AnimatedImage> decodeAnimatedImage(const void * _data, Size _byteCount, Allocator & _alloc)
+{
+    // stb grows the frame buffer as it finds frames, so the frame count isn't known up front and
+    // we copy the frames into the result once at the end
+    int w, h, frameCount, n;
+    int * delays = nullptr;
+    stbi_uc * data;
+    {
+        detail::STBAllocationScope scope(_alloc);
+        applySTBDecodeSettings(DecodeSettings());
+        data = stbi_load_gif_from_memory(
+            (const stbi_uc *)_data, (int)_byteCount, &delays, &w, &h, &frameCount, &n, 4);
+    }
+    if (!data)
+        return Error(ec::InvalidOperation, "Could not parse gif", STICK_FILE, STICK_LINE);
+
+    AnimatedImage ret = { ImageRGBA8(_alloc), DynamicArray<UInt32>(_alloc) };
+    ret.frames.loadRawPixels((Size)w, (Size)h, (Size)frameCount, (const char *)data);
+    ret.delays.resize(frameCount);
+    for (int i = 0; i < frameCount; ++i)
+        ret.delays[i] = delays ? (UInt32)delays[i] : 0;
+    stbi_image_free(data);
+    stbi_image_free(delays);
+    return ret;
+}
+
+// Serves the beginning of the stream that was read to parse the header before the rest of the
+// reader, so stb sees the whole stream.
+struct STBReaderStream
+{
+    Reader * reader;
+    const char * prefix;
+    Size prefixByteCount;
+    Size prefixPosition;
+
+    // stb treats short reads as the end of the data, so this only returns less than _size at the
+    // end of the stream
+    static int read(void * _user, char * _data, int _size)
+    {
+        STBReaderStream & self = *static_cast<STBReaderStream *>(_user);
+        Size fromPrefix = std::min(self.prefixByteCount - self.prefixPosition, (Size)_size);
+        memcpy(_data, self.prefix + self.prefixPosition, fromPrefix);
+        self.prefixPosition += fromPrefix;
+
+        Size count = fromPrefix;
+        while (count < (Size)_size)
+        {
+            Size n = self.reader->read(_data + count, (Size)_size - count);
+            if (!n)
+                break;
+            count += n;
+        }
+        return (int)count;
+    }
+
+    static void skip(void * _user, int _n)
+    {
+        // stb never skips backwards when reading from callbacks
+        STBReaderStream & self = *static_cast<STBReaderStream *>(_user);
+        Size n = (Size)_n;
+        Size prefixLeft = self.prefixByteCount - self.prefixPosition;
+        Size fromPrefix = std::min(prefixLeft, n);
+        self.prefixPosition += fromPrefix;
+        if (n > fromPrefix)
+            self.reader->skip(n - fromPrefix);
+    }
+
+    static int eof(void * _user)
+    {
+        STBReaderStream & self = *static_cast<STBReaderStream *>(_user);
+        return self.prefixPosition == self.prefixByteCount && self.reader->isAtEnd();
+    }
+};
+
+// Reads from the stream until stb can parse the image header, doubling the amount read each time.
+// Giving up after a megabyte, which is plenty even for jpegs with big exif blocks in front.
+static bool readSTBHeader(Reader & _reader, ByteArray & _prefix)
+{
+    Size count = 0;
+    Size target = 4096;
+    while (true)
+    {
+        _prefix.resize(target);
+        while (count < target)
+        {
+            Size n = _reader.read(&_prefix[count], target - count);
+            if (!n)
+                break;
+            count += n;
+        }
+        _prefix.resize(count);
+
+        int w, h, n;
+        if (count && stbi_info_from_memory((const stbi_uc *)&_prefix[0], (int)count, &w, &h, &n))
+            return true;
+        if (count < target || target >= 1024 * 1024)
+            return false;
+        target *= 2;
+    }
+}
+
+// Calls _fn with an stb source that holds the header for the queries and decodes the stream
+// through the callbacks.
+template <class F>
+static auto withSTBReaderSource(Reader & _reader, Allocator & _alloc, F _fn)
+    -> decltype(_fn(STBSource()))
+{
+    ByteArray prefix(_alloc);
+    if (!readSTBHeader(_reader, prefix))
+        return Error(ec::InvalidOperation,
+                     "Could not parse image header from stream",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    static const stbi_io_callbacks s_callbacks = {
+        STBReaderStream::read, STBReaderStream::skip, STBReaderStream::eof
+    };
+    STBReaderStream stream = { &_reader, &prefix[0], prefix.count(), 0 };
+    STBSource src = {
+        (const stbi_uc *)&prefix[0], (int)prefix.count(), nullptr, &s_callbacks, &stream
+    };
+    return _fn(src);
+}
+
+Result<ImageUniquePtr> decodeImage(Reader & _reader, Allocator & _alloc)
+{
+    return withSTBReaderSource(
+        _reader, _alloc, [&](const STBSource & _src) {
+            return decodeSTB(_src, DecodeSettings(), _alloc);
+        });
+}
+
+Error decodeInto(Image & _target, Reader & _reader)
+{
+    return withSTBReaderSource(_reader, _target.allocator(), [&](const STBSource & _src) {
+        return decodeSTBInto(_target, _src, DecodeSettings());
+    });
+}
+
+// the image a PushDecoder decodes a jpeg into and its row count
+struct PushedJPEGRows
+{
+    Image * image;
+    std::atomic<Size> * rowCount;
+
+    static void rowDecoded(void * _user, int _y, const stbi_uc * _row)
+    {
+        PushedJPEGRows & self = *static_cast<PushedJPEGRows *>(_user);
+        char * target = self.image->bytePtr() + (Size)_y * self.image->bytesPerRow();
+        // stb usually decodes straight into the image
+        if ((const char *)_row != target)
+            memcpy(target, _row, self.image->bytesPerRow());
+        self.rowCount->store((Size)_y + 1, std::memory_order_release);
+    }
+};
+
+Error PushDecoder::decodeJPEG(Reader & _reader)
+{
+    return withSTBReaderSource(_reader, *m_alloc, [&](const STBSource & _src) {
+        applySTBDecodeSettings(DecodeSettings());
+        int w, h, n;
+        if (!stbInfo(_src, &w, &h, &n))
+            return Error(
+                ec::InvalidOperation, "Could not parse image header", STICK_FILE, STICK_LINE);
+
+        State & state = *m_state;
+        state.image = createImageForChannelCount<UInt8>(n, *m_alloc);
+        PushedJPEGRows rows = { state.image.get(), &state.rowCount };
+        stbi_set_jpeg_row_callback_thread(PushedJPEGRows::rowDecoded, &rows);
+        Error err = decodeSTBInto(*state.image, _src, DecodeSettings());
+        stbi_set_jpeg_row_callback_thread(nullptr, nullptr);
+        return err;
+    });
+}
+
+Error loadInto(Image & _target, const String & _path)
+{
+    if (hasPicExtension(_path))
+        return copyPicFileInto(_target,
+                               loadPicFile(_path, DecodeSettings(), _target.allocator()));
+
+    return withSTBFileSource(_path,
+                             [&](const STBSource & _src) {
+                                 return decodeSTBInto(_target, _src, DecodeSettings());
+                             });
+}
+
+static Result<ImageInfo> probeSTB(const STBSource & _src)
+{
+    // the full size, even if the last decode on this thread scaled a jpeg down
+    applySTBDecodeSettings(DecodeSettings());
+    int w, h, n;
+    if (!stbInfo(_src, &w, &h, &n))
+        return Error(
+            ec::InvalidOperation, "Could not parse image header", STICK_FILE, STICK_LINE);
+
+    ImageInfo ret = { (Size)w,
+                      (Size)h,
+                      (UInt32)n,
+                      stbIs16Bit(_src),
+                      stbIsHDR(_src),
+                      stbPixelTypeID<UInt8>(n) };
+    if (ret.isHDR)
+        ret.pixelTypeID = stbPixelTypeID<Float32>(n);
+    else if (ret.is16Bit)
+        ret.pixelTypeID = stbPixelTypeID<UInt16>(n);
+    return ret;
+}
+
+Result<ImageInfo> probeImage(const void * _data, Size _byteCount)
+{
+    if (isPicFile(_data, _byteCount))
+        return probePicFile(_data, _byteCount);
+
+    STBSource src = { (const stbi_uc *)_data, (int)_byteCount, nullptr, nullptr, nullptr };
+    return probeSTB(src);
+}
+
+Result<ImageInfo> probeImage(const String & _path)
+{
+    if (hasPicExtension(_path))
+        return probePicFile(_path);
+
+    return withSTBFileSource(_path, probeSTB);
+}
+
+// the uncompressed bytes per band when encoding pngs in parallel. Bigger bands than pigz's 128K
+// amortize setting up the match finder and lose less compression at the band boundaries.
+static const Size s_pngBandByteCount = 1 << 19;
+
+// filters the rows _firstRow to _endRow, converting them to the png layout in _scratch first if
+// needed, which has room for s_pngConversionRowCount + 1 rows
+static void filterPNGBand(const Image & _image,
+                          const PNGRowFormat & _format,
+                          Size _firstRow,
+                          Size _endRow,
+                          int _forceFilter,
+                          UInt8 * _scratch,
+                          UInt8 * _lineBuffer,
+                          UInt8 * _out)
+{
+    Size bpp = _format.bytesPerChannel * _format.channelCount;
+    Size rowByteCount = _format.width * bpp;
+    const UInt8 * pixels = (const UInt8 *)_image.bytePtr();
+    if (!needsPNGConversion(_format))
+    {
+        Size top = _firstRow ? 1 : 0;
+        filterPNGRows(pixels + (_firstRow - top) * _image.bytesPerRow(),
+                      _image.bytesPerRow(),
+                      _format.width,
+                      bpp,
+                      top != 0,
+                      _endRow - _firstRow,
+                      _forceFilter,
+                      _lineBuffer,
+                      _out);
+        return;
+    }
+
+    for (Size y = _firstRow; y < _endRow; y += s_pngConversionRowCount)
+    {
+        Size end = std::min(y + s_pngConversionRowCount, _endRow);
+        Size top = y ? 1 : 0;
+        for (Size r = y - top; r < end; ++r)
+            convertPNGRow(_format,
+                          pixels + r * _image.bytesPerRow(),
+                          _scratch + (r - (y - top)) * rowByteCount);
+        filterPNGRows(_scratch,
+                      rowByteCount,
+                      _format.width,
+                      bpp,
+                      top != 0,
+                      end - y,
+                      _forceFilter,
+                      _lineBuffer,
+                      _out + (y - _firstRow) * (rowByteCount + 1));
+    }
+}
+
+// Pic's own png writer for what stb_image_write can't do: 16 bit images, channel layouts other
+// than gray (alpha) and rgb(a), and encoding on more than one thread. The rows are filtered and
+// deflated in bands, one band for the whole image on a single thread. Every band is deflated on
+// its own with the end of the previous band as its dictionary and ends with a sync flush, so that
+// the bands can be written one after the other as one zlib stream in a single IDAT chunk. The
+// checksums of the bands are combined rather than computed over the whole stream.
+static Error encodePNG(const Image & _image,
+                       stbi_write_func * _func,
+                       void * _context,
+                       const SaveSettings & _settings,
+                       Size _threadCount)
+{
+    PNGRowFormat format = pngRowFormat(_image);
+    Size w = _image.width();
+    Size h = _image.height();
+    Size bpp = format.bytesPerChannel * format.channelCount;
+    Size rowByteCount = w * bpp + 1;
+    Size rowsPerBand = h;
+    if (_threadCount > 1)
+        rowsPerBand = std::max(std::min((s_pngBandByteCount + rowByteCount - 1) / rowByteCount,
+                                        (h + _threadCount - 1) / _threadCount),
+                               (Size)1);
+    Size bandCount = (h + rowsPerBand - 1) / rowsPerBand;
+    Size bandByteCount = rowsPerBand * rowByteCount;
+    Size bandBound = zlibCompressBound(bandByteCount);
+    Size workerCount = std::min(_threadCount, bandCount);
+    int forceFilter = _settings.pngFilter < 5 ? _settings.pngFilter : -1;
+
+    // all buffers are allocated up front on the calling thread, as the image allocator does not
+    // have to be thread safe. The match finders of the workers use the default allocator.
+    Allocator & alloc = _image.allocator();
+    ByteArray filtered(alloc);
+    filtered.resize(rowByteCount * h);
+    ByteArray compressed(alloc);
+    compressed.resize(bandBound * bandCount);
+    ByteArray lineBuffers(alloc);
+    lineBuffers.resize(w * bpp * workerCount);
+    Size scratchByteCount =
+        needsPNGConversion(format) ? (s_pngConversionRowCount + 1) * (rowByteCount - 1) : 0;
+    ByteArray scratch(alloc);
+    scratch.resize(scratchByteCount * workerCount);
+
+    struct Band
+    {
+        Size byteCount;
+        UInt32 adler;
+        UInt32 crc;
+    };
+    DynamicArray<Band> bands(alloc);
+    bands.resize(bandCount);
+
+    UInt8 * filteredPtr = (UInt8 *)&filtered[0];
+    UInt8 * compressedPtr = (UInt8 *)&compressed[0];
+
+    std::atomic<Size> next(0);
+    runWorkers(workerCount, [&](Size _worker) {
+        UInt8 * lineBuffer = (UInt8 *)&lineBuffers[0] + w * bpp * _worker;
+        UInt8 * scratchPtr = (UInt8 *)scratch.begin() + scratchByteCount * _worker;
+        for (Size i = next++; i < bandCount; i = next++)
+            filterPNGBand(_image,
+                          format,
+                          i * rowsPerBand,
+                          std::min((i + 1) * rowsPerBand, h),
+                          forceFilter,
+                          scratchPtr,
+                          lineBuffer,
+                          filteredPtr + i * bandByteCount);
+    });
+
+    // the dictionary of a band is the end of the previous one, so all rows have to be filtered
+    // before deflating starts
+    next = 0;
+    std::atomic<bool> failed(false);
+    runWorkers(workerCount, [&](Size) {
+        for (Size i = next++; i < bandCount; i = next++)
+        {
+            Size start = i * bandByteCount;
+            Size byteCount = std::min(bandByteCount, filtered.count() - start);
+            UInt8 * out = compressedPtr + i * bandBound;
+            Band & band = bands[i];
+            band.byteCount = deflateSegment(filteredPtr + start,
+                                            byteCount,
+                                            start,
+                                            _settings.pngCompressionLevel,
+                                            i == bandCount - 1,
+                                            out);
+            if (!band.byteCount)
+                failed = true;
+            band.adler = adler32(1, filteredPtr + start, byteCount);
+            band.crc = crc32(0, out, band.byteCount);
+        }
+    });
+    if (failed)
+        return Error(ec::InvalidOperation,
+                     "Failed to allocate the deflate state",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    UInt8 head[s_pngHeaderByteCount + 8 + 2];
+    writePNGHeader(w, h, format, head);
+    UInt8 * o = head + s_pngHeaderByteCount;
+
+    Size idatByteCount = 2 + 4;
+    UInt32 adler = 1;
+    for (Size i = 0; i < bandCount; ++i)
+    {
+        idatByteCount += bands[i].byteCount;
+        adler = adler32Combine(
+            adler, bands[i].adler, std::min(bandByteCount, filtered.count() - i * bandByteCount));
+    }
+    if (idatByteCount > 0x7fffffff)
+        return Error(ec::InvalidOperation,
+                     "The compressed image is too big for one png chunk",
+                     STICK_FILE,
+                     STICK_LINE);
+
+    writeBigEndian((UInt32)idatByteCount, o);
+    memcpy(o + 4, "IDAT", 4);
+    writeZlibHeader(_settings.pngCompressionLevel, o + 8);
+    UInt32 crc = crc32(0, o + 4, 6);
+    _func(_context, head, sizeof(head));
+
+    for (Size i = 0; i < bandCount; ++i)
+    {
+        crc = crc32Combine(crc, bands[i].crc, bands[i].byteCount);
+        _func(_context, compressedPtr + i * bandBound, (int)bands[i].byteCount);
+    }
+
+    UInt8 tail[4 + 4 + 12] = {};
+    writeBigEndian(adler, tail);
+    writeBigEndian(crc32(crc, tail, 4), tail + 4);
+    memcpy(tail + 12, "IEND", 4);
+    writeBigEndian(crc32(0, tail + 12, 4), tail + 16);
+    _func(_context, tail, sizeof(tail));
+
+    return Error();
+}
+
+// Serves the rows of an image to stb's row writers straight from the image storage, so that
+// padded images are written without repacking them
+static const void * stbImageRow(void * _image, int _y)
+{
+    const Image & image = *static_cast<const Image *>(_image);
+    return image.bytePtr() + _y * image.bytesPerRow();
+}
+
+// Encodes through stb's *_to_func writers, so that the same code can write to files and memory
+// whether encodeSTB can write the image in the format, so Image::save can check before it opens
+// (and truncates) the file
+static Error checkSTBEncode(const Image & _image, ImageFormat _format)
+{
+    if (_format == ImageFormat::HDR)
+    {
+        if (!_image.isFloatingPoint() || _image.bitsPerChannel() != 32 || _image.rowPadding() != 0)
+            return Error(ec::InvalidOperation,
+                         "Stb can only write unpadded 32 bit floating point images to hdr files",
+                         STICK_FILE,
+                         STICK_LINE);
+    }
+    else if (_format == ImageFormat::PNG)
+    {
+        if (_image.isFloatingPoint() ||
+            (_image.bitsPerChannel() != 8 && _image.bitsPerChannel() != 16))
+            return Error(ec::InvalidOperation,
+                         "Only 8 and 16 bit images can be written to png files",
+                         STICK_FILE,
+                         STICK_LINE);
+    }
+    else if (_image.bitsPerChannel() != 8)
+        return Error(ec::InvalidOperation,
+                     "Stb can only write 8 bit images to jpg, bmp and tga files",
+                     STICK_FILE,
+                     STICK_LINE);
+    return Error();
+}
+
+static Error encodeSTB(const Image & _image,
+                       ImageFormat _format,
+                       stbi_write_func * _func,
+                       void * _context,
+                       const SaveSettings & _settings)
+{
+    Error err = checkSTBEncode(_image, _format);
+    if (err)
+        return err;
+
+    int w = (int)_image.width();
+    int h = (int)_image.height();
+    int n = (int)_image.channelCount();
+    const char * pixels = _image.bytePtr();
+
+    // stb_image_write only has switches for these, which Pic keeps thread local. Set them for the
+    // calling thread before every encode, so that they don't carry over from a previous call.
+    stbi_write_png_compression_level = _settings.pngCompressionLevel;
+    stbi_write_force_png_filter = _settings.pngFilter;
+    stbi_write_tga_with_rle = _settings.tgaRLE;
+    detail::t_pngDeflate = _settings.pngDeflate;
+
+    // png encoding allocates its scratch buffers through stb's allocation hooks
+    detail::STBAllocationScope scope(_image.allocator());
+    if (_format == ImageFormat::HDR)
+    {
+        if (!stbi_write_hdr_to_func(
+                _func, _context, w, h, n, reinterpret_cast<const float *>(pixels)))
+            return Error(ec::InvalidOperation, "stbi_write_hdr failed", STICK_FILE, STICK_LINE);
+        return Error();
+    }
+
+    if (_format == ImageFormat::PNG)
+    {
+        Size threadCount = _settings.pngThreadCount;
+        if (!threadCount)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        if ((threadCount > 1 && h > 1) || needsPNGConversion(pngRowFormat(_image)))
+            return encodePNG(_image, _func, _context, _settings, threadCount);
+
+        if (!stbi_write_png_to_func(_func, _context, w, h, n, pixels, (int)_image.bytesPerRow()))
+            return Error(ec::InvalidOperation, "stbi_write_png failed", STICK_FILE, STICK_LINE);
+        return Error();
+    }
+
+    void * image = const_cast<Image *>(&_image);
+    if (_format == ImageFormat::JPEG)
+    {
+        if (!stbi_write_jpg_rows_to_func(
+                _func, _context, w, h, n, stbImageRow, image, (int)_settings.jpegQuality))
+            return Error(ec::InvalidOperation, "stbi_write_jpg failed", STICK_FILE, STICK_LINE);
+    }
+    else if (_format == ImageFormat::BMP)
+    {
+        if (!stbi_write_bmp_rows_to_func(_func, _context, w, h, n, stbImageRow, image))
+            return Error(ec::InvalidOperation, "stbi_write_bmp failed", STICK_FILE, STICK_LINE);
+    }
+    else if (_format == ImageFormat::TGA)
+    {
+        if (!stbi_write_tga_rows_to_func(_func, _context, w, h, n, stbImageRow, image))
+            return Error(ec::InvalidOperation, "stbi_write_tga failed", STICK_FILE, STICK_LINE);
+    }
+    return Error();
+}
+
+static void appendToByteArray(void * _context, void * _data, int _byteCount)
+{
+    ByteArray & out = *static_cast<ByteArray *>(_context);
+    const char * data = static_cast<const char *>(_data);
+    out.insert(out.end(), data, data + _byteCount);
+}
+
+static void writeToFile(void * _context, void * _data, int _byteCount)
+{
+    fwrite(_data, 1, _byteCount, static_cast<FILE *>(_context));
+}
+
+Error encodeImage(const Image & _image,
+                  ImageFormat _format,
+                  ByteArray & _out,
+                  const SaveSettings & _settings)
+{
+    if (_format == ImageFormat::Pic)
+        return encodePicFile(_image, _out);
+
+    Size byteCount = _out.count();
+    Error err = encodeSTB(_image, _format, appendToByteArray, &_out, _settings);
+    // don't leave partially encoded data behind
+    if (err)
+        _out.resize(byteCount);
+    return err;
+}
+
+Error Image::save(const String & _path, const SaveSettings & _settings)
+{
+    //@TODO simply use a strncmp based approach so we dont need to allocate the extension... this is
+    // nice and easy for now dough
+    String ext = path::extension(_path, allocator());
+    ImageFormat format;
+    if (ext == ".pic")
+        return savePicFile(*this, _path);
+    else if (ext == ".png")
+        format = ImageFormat::PNG;
+    else if (ext == ".jpg")
+        format = ImageFormat::JPEG;
+    else if (ext == ".bmp")
+        format = ImageFormat::BMP;
+    else if (ext == ".tga")
+        format = ImageFormat::TGA;
+    else if (ext == ".hdr")
+        format = ImageFormat::HDR;
+    else
+        return Error(
+            ec::Unsupported, "The requested image type is not supported.", STICK_FILE, STICK_LINE);
+
+    // an image that can't be written must not destroy an existing file
+    Error err = checkSTBEncode(*this, format);
+    if (err)
+        return err;
+
+    FILE * file = stbiw__fopen(_path.cString(), "wb");
+    if (!file)
+        return Error(ec::InvalidOperation,
+                     String::formatted("Could not open file at %s", _path.cString()),
+                     STICK_FILE,
+                     STICK_LINE);
+
+    err = encodeSTB(*this, format, writeToFile, file, _settings);
+    bool writeFailed = ferror(file) != 0;
+    fclose(file);
+    if (!err && writeFailed)
+        err = Error(ec::InvalidOperation,
+                    String::formatted("Could not write file at %s", _path.cString()),
+                    STICK_FILE,
+                    STICK_LINE);
+    // don't leave empty or partially written files behind
+    if (err)
+        remove(_path.cString());
+    return err;
 }
 #endif // PIC_IMPLEMENTATION_FREEIMAGE
 
@@ -1,6 +1,7 @@
 #ifndef PIC_IMAGE_HPP
 #define PIC_IMAGE_HPP
 
+#include <Pic/Deflate.hpp>
 #include <Pic/Pixel.hpp>
 #include <Pic/PixelIterator.hpp>
 #include <Stick/DynamicArray.hpp>
@@ -11,14 +12,81 @@
 
 //@TODO: Do we need these?
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <new>
 
 namespace pic
 {
 
-//@TODO: for future use to hold jpg quality and similar settings
+// the zlib compressor that png encoding uses
+enum class DeflateImplementation
+{
+    // Pic's own, see Pic/Deflate.hpp
+    Pic,
+    // the one that ships with stb_image_write
+    STB
+};
+
+// per call encoding options, see Image::save and encodeImage
 struct STICK_API SaveSettings
-{};
+{
+    // 1 - 100
+    stick::UInt32 jpegQuality = 90;
+    // the zlib compression level 0 - 9, higher values compress better but are slower. 8 is the
+    // default of stb_image_write.
+    stick::Int32 pngCompressionLevel = 8;
+    // -1 picks a filter for each row, 0 - 4 forces one of the png filters for all rows
+    stick::Int32 pngFilter = -1;
+    // Only used by the stb implementation, and only for 8 bit gray (alpha) and rgb(a) images
+    // encoded on one thread. Pic writes all other pngs itself, with its own deflate.
+    DeflateImplementation pngDeflate = DeflateImplementation::Pic;
+    // The threads png encoding uses, 0 picks one per hardware thread. With more than one, the
+    // image is split into bands of rows that are deflated in parallel, which compresses slightly
+    // worse and always uses Pic's deflate. Only used by the stb implementation.
+    stick::Size pngThreadCount = 1;
+    bool tgaRLE = true;
+};
+
+enum class ImageFormat
+{
+    PNG,
+    JPEG,
+    BMP,
+    TGA,
+    HDR,
+    // Pic's own uncompressed container (.pic), see mapImage
+    Pic
+};
+
+// per call decoding options, see decodeImage
+struct STICK_API DecodeSettings
+{
+    // flips the rows of the decoded image, i.e. to upload it as an OpenGL texture. Jpegs are
+    // written flipped while decoding, other formats are flipped in place once they are decoded.
+    bool flipVertically = false;
+    // Only affects iphone optimized (CgBI) pngs, which store BGR with premultiplied alpha. If set,
+    // they are converted to RGB with straight alpha. All other images are left as they are.
+    bool unpremultiply = false;
+    // the channel count to convert to while decoding, 0 keeps the channel count of the source
+    stick::UInt32 channelCount = 0;
+    // 1, 2, 4 or 8. Jpegs are decoded at 1/jpegScaleDenominator of their size (rounding up)
+    // straight from the DCT coefficients, which is a lot faster than decoding them fully to make
+    // thumbnails. Other formats ignore it.
+    stick::UInt32 jpegScaleDenominator = 1;
+};
+
+// describes an encoded image without decoding its pixels, see probeImage
+struct STICK_API ImageInfo
+{
+    stick::Size width;
+    stick::Size height;
+    stick::UInt32 channelCount;
+    bool is16Bit;
+    bool isHDR;
+    // the pixel type id of the ImageT that decodeImage would return for this image
+    stick::TypeID pixelTypeID;
+};
 
 class STICK_API Image
 {
@@ -84,6 +152,11 @@ class STICK_API Image
 
     virtual const char * bytePtr() const = 0;
 
+    virtual char * bytePtr() = 0;
+
+    // reserves raw pixel storage in bytes without changing the dimensions of the image
+    virtual void reserve(stick::Size _byteCount) = 0;
+
     virtual void flipRows() = 0;
 
     virtual void flipColumns() = 0;
@@ -118,6 +191,28 @@ class STICK_API Image
 
 typedef stick::UniquePtr<Image> ImageUniquePtr;
 
+// encodes the image and appends the encoded bytes to _out. Reserve _out up front and reuse it to
+// avoid reallocating it for every image.
+STICK_API stick::Error encodeImage(const Image & _image,
+                                   ImageFormat _format,
+                                   stick::ByteArray & _out,
+                                   const SaveSettings & _settings = SaveSettings());
+
+// a source of encoded image data that is consumed front to back, i.e. a pipe or a chunked http body
+class STICK_API Reader
+{
+  public:
+    virtual ~Reader() = default;
+
+    // reads up to _byteCount bytes into _buffer and returns how many were read. Blocks until at
+    // least one byte is available and only returns 0 at the end of the stream.
+    virtual stick::Size read(char * _buffer, stick::Size _byteCount) = 0;
+
+    virtual void skip(stick::Size _byteCount) = 0;
+
+    virtual bool isAtEnd() const = 0;
+};
+
 STICK_API stick::Result<ImageUniquePtr> decodeImage(
     const stick::ByteArray & _data, stick::Allocator & _alloc = stick::defaultAllocator());
 
@@ -129,6 +224,223 @@ STICK_API stick::Result<ImageUniquePtr> decodeImage(
 STICK_API stick::Result<ImageUniquePtr> loadImage(
     const stick::String & _path, stick::Allocator & _alloc = stick::defaultAllocator());
 
+// the settings only apply to this call, so threads can decode with different settings at once
+STICK_API stick::Result<ImageUniquePtr> decodeImage(
+    const stick::ByteArray & _data,
+    const DecodeSettings & _settings,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+STICK_API stick::Result<ImageUniquePtr> decodeImage(
+    const void * _data,
+    stick::Size _byteCount,
+    const DecodeSettings & _settings,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+STICK_API stick::Result<ImageUniquePtr> loadImage(
+    const stick::String & _path,
+    const DecodeSettings & _settings,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+// decodes while the data arrives, without buffering the whole encoded image first
+STICK_API stick::Result<ImageUniquePtr> decodeImage(
+    Reader & _reader, stick::Allocator & _alloc = stick::defaultAllocator());
+
+// Decodes only the _width x _height pixels at _left, _top, i.e. a tile or a preview window of a
+// huge image. Png, bmp, tga, pnm and .pic images are decoded row by row until the last row of the
+// region, and jpegs only transform and store the MCUs that cover it, so the memory use depends on
+// the size of the region rather than the image. Other images are decoded fully and cropped.
+STICK_API stick::Result<ImageUniquePtr> decodeRegion(
+    const stick::ByteArray & _data,
+    stick::Size _left,
+    stick::Size _top,
+    stick::Size _width,
+    stick::Size _height,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+STICK_API stick::Result<ImageUniquePtr> decodeRegion(
+    const void * _data,
+    stick::Size _byteCount,
+    stick::Size _left,
+    stick::Size _top,
+    stick::Size _width,
+    stick::Size _height,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+// only parses the image header, which is a lot cheaper than decoding it
+STICK_API stick::Result<ImageInfo> probeImage(const stick::ByteArray & _data);
+
+STICK_API stick::Result<ImageInfo> probeImage(const void * _data, stick::Size _byteCount);
+
+STICK_API stick::Result<ImageInfo> probeImage(const stick::String & _path);
+
+// the outcome of decoding one image with decodeImages
+struct STICK_API DecodedImage
+{
+    ImageUniquePtr image;
+    stick::Error error;
+};
+
+struct STICK_API DecodeImagesSettings
+{
+    // 0 picks one worker per hardware thread
+    stick::Size workerCount = 0;
+    // optional, workerCount allocators, one for each worker. The images a worker decodes are
+    // allocated from its allocator, so the allocators don't need to be thread safe but have to
+    // outlive the images. If null, the images are allocated from the default allocator and every
+    // worker keeps the temporary buffers of decoding in an arena of its own.
+    stick::Allocator * const * workerAllocators = nullptr;
+};
+
+// decodes _count images in parallel. The results are stored in input order, with per image errors
+// in DecodedImage::error. Only invalid settings are reported through the returned error.
+STICK_API stick::Error decodeImages(
+    const stick::ByteArray * _data,
+    stick::Size _count,
+    stick::DynamicArray<DecodedImage> & _outResults,
+    const DecodeImagesSettings & _settings = DecodeImagesSettings());
+
+struct STICK_API LoadImagesSettings
+{
+    // How many files are read at once. Files that were read and wait for a decode worker count
+    // as well, so this also limits how much encoded data is held in memory.
+    stick::Size readsInFlight = 32;
+    // 0 picks one decode worker per hardware thread
+    stick::Size workerCount = 0;
+    // optional, workerCount allocators, one for each decode worker, see DecodeImagesSettings
+    stick::Allocator * const * workerAllocators = nullptr;
+    // how every image is decoded
+    DecodeSettings decodeSettings;
+    // how many threads read the files where io_uring is not used, at most readsInFlight. 0 picks
+    // one per hardware thread.
+    stick::Size readThreadCount = 0;
+    // reads with threads even where io_uring is available
+    bool forceThreadedReads = false;
+};
+
+// Loads _count files in parallel, i.e. to ingest a directory of images. On Linux the reads are
+// submitted in batches through io_uring, elsewhere or if io_uring is not available readThreadCount
+// threads read the files with pread. Each file is handed to a decode worker as soon as it is read.
+// The results are stored in input order like with decodeImages.
+STICK_API stick::Error loadImages(const stick::String * _paths,
+                                  stick::Size _count,
+                                  stick::DynamicArray<DecodedImage> & _outResults,
+                                  const LoadImagesSettings & _settings = LoadImagesSettings());
+
+// a handle to a task of an ImageIOPool, i.e. a loadImageAsync or saveAsync call
+class STICK_API ImageIOTask
+{
+  public:
+    ImageIOTask();
+
+    // true once the task and its callback ran
+    bool isDone() const;
+
+    // blocks until the task and its callback ran and returns the error of the task
+    stick::Error wait() const;
+
+  private:
+    friend class ImageIOPool;
+
+    struct State;
+
+    std::shared_ptr<State> m_state;
+};
+
+struct STICK_API ImageIOPoolSettings
+{
+    // 0 picks one worker per hardware thread
+    stick::Size threadCount = 0;
+    // how many tasks can wait for a worker before submitting more fails, at least 1
+    stick::Size maxQueueDepth = 256;
+};
+
+// Worker threads that read, decode, encode and write images off the calling thread, so ui and
+// request threads don't stall on the file system. Tasks run in the order they are submitted.
+class STICK_API ImageIOPool
+{
+  public:
+    ImageIOPool(const ImageIOPoolSettings & _settings = ImageIOPoolSettings());
+
+    // runs the tasks that are still queued and waits for the workers
+    ~ImageIOPool();
+
+    ImageIOPool(const ImageIOPool &) = delete;
+
+    ImageIOPool & operator=(const ImageIOPool &) = delete;
+
+    // Queues _task to run on one of the workers. Fails right away rather than blocking if
+    // maxQueueDepth tasks are waiting already.
+    stick::Result<ImageIOTask> submit(std::function<stick::Error()> _task);
+
+    stick::Size threadCount() const;
+
+    // how many tasks are waiting for a worker, not counting the running ones
+    stick::Size queueDepth() const;
+
+    stick::Size maxQueueDepth() const;
+
+  private:
+    struct State;
+
+    void work();
+
+    // the workers and the queue they share with the submitting threads
+    State * m_state;
+};
+
+// the pool that loadImageAsync and saveAsync use by default, with the default settings. It is
+// created on first use and waits for its tasks when the program exits.
+STICK_API ImageIOPool & defaultImageIOPool();
+
+typedef std::function<void(stick::Result<ImageUniquePtr>)> LoadImageCallback;
+
+typedef std::function<void(const stick::Error &)> SaveImageCallback;
+
+// Loads the image at _path on a worker of _pool and passes the result to _callback, which runs on
+// the worker thread. The allocator has to be thread safe.
+STICK_API stick::Result<ImageIOTask> loadImageAsync(
+    const stick::String & _path,
+    LoadImageCallback _callback,
+    const DecodeSettings & _settings = DecodeSettings(),
+    ImageIOPool & _pool = defaultImageIOPool(),
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+// Saves _image on a worker of _pool like Image::save and passes the error to _callback, which runs
+// on the worker thread and may be empty. The image must not change or go away until the task is
+// done.
+STICK_API stick::Result<ImageIOTask> saveAsync(
+    Image & _image,
+    const stick::String & _path,
+    SaveImageCallback _callback = SaveImageCallback(),
+    const SaveSettings & _settings = SaveSettings(),
+    ImageIOPool & _pool = defaultImageIOPool());
+
+// decode into an existing image, converting to its channel count, channel order and value type.
+// The pixel storage of the target is reused if it is big enough, so decoding a sequence of same
+// sized frames into the same image does not reallocate it.
+STICK_API stick::Error decodeInto(Image & _target, const stick::ByteArray & _data);
+
+STICK_API stick::Error decodeInto(Image & _target, const void * _data, stick::Size _byteCount);
+
+STICK_API stick::Error decodeInto(Image & _target, Reader & _reader);
+
+STICK_API stick::Error loadInto(Image & _target, const stick::String & _path);
+
+// decode straight to a specific ImageT, i.e. ImageRGBA8 for texture upload, without a separate
+// conversion pass
+template <class ImageT>
+stick::Result<ImageT> decodeImageAs(const stick::ByteArray & _data,
+                                    stick::Allocator & _alloc = stick::defaultAllocator());
+
+template <class ImageT>
+stick::Result<ImageT> decodeImageAs(const void * _data,
+                                    stick::Size _byteCount,
+                                    stick::Allocator & _alloc = stick::defaultAllocator());
+
+template <class ImageT>
+stick::Result<ImageT> loadImageAs(const stick::String & _path,
+                                  stick::Allocator & _alloc = stick::defaultAllocator());
+
 template <class PixelT>
 class STICK_API ImageT : public Image
 {
@@ -187,6 +499,8 @@ class STICK_API ImageT : public Image
 
     void clear();
 
+    void reserve(stick::Size _byteCount) override;
+
     void loadPixels(stick::Size _width,
                     stick::Size _height,
                     const ValueType * _pixels,
@@ -307,6 +621,8 @@ class STICK_API ImageT : public Image
 
     const char * bytePtr() const override;
 
+    char * bytePtr() override;
+
     stick::Allocator & allocator() const override;
 
   private:
@@ -454,6 +770,12 @@ void ImageT<C>::clear()
     m_data.clear();
 }
 
+template <class C>
+void ImageT<C>::reserve(stick::Size _byteCount)
+{
+    m_data.reserve(_byteCount);
+}
+
 template <class C>
 void ImageT<C>::loadPixels(stick::Size _width,
                            stick::Size _height,
@@ -812,12 +1134,46 @@ const char * ImageT<C>::bytePtr() const
     return reinterpret_cast<const char *>(ptr());
 }
 
+template <class C>
+char * ImageT<C>::bytePtr()
+{
+    return reinterpret_cast<char *>(ptr());
+}
+
 template <class C>
 stick::Allocator & ImageT<C>::allocator() const
 {
     return m_data.allocator();
 }
 
+template <class ImageT>
+stick::Result<ImageT> decodeImageAs(const stick::ByteArray & _data, stick::Allocator & _alloc)
+{
+    return decodeImageAs<ImageT>(&_data[0], _data.count(), _alloc);
+}
+
+template <class ImageT>
+stick::Result<ImageT> decodeImageAs(const void * _data,
+                                    stick::Size _byteCount,
+                                    stick::Allocator & _alloc)
+{
+    ImageT ret(_alloc);
+    stick::Error err = decodeInto(ret, _data, _byteCount);
+    if (err)
+        return err;
+    return ret;
+}
+
+template <class ImageT>
+stick::Result<ImageT> loadImageAs(const stick::String & _path, stick::Allocator & _alloc)
+{
+    ImageT ret(_alloc);
+    stick::Error err = loadInto(ret, _path);
+    if (err)
+        return err;
+    return ret;
+}
+
 typedef ImageT<PixelGray8> ImageGray8;
 typedef ImageT<PixelGrayAlpha8> ImageGrayAlpha8;
 typedef ImageT<PixelAlphaGray8> ImageAlphaGray8;
@@ -857,6 +1213,508 @@ typedef ImageT<PixelRGBA32f> ImageRGBA32f;
 typedef ImageT<PixelBGRA32f> ImageBGRA32f;
 typedef ImageT<PixelARGB32f> ImageARGB32f;
 typedef ImageT<PixelABGR32f> ImageABGR32f;
+
+// all frames of an animation, stored as the layers of one image
+struct STICK_API AnimatedImage
+{
+    ImageRGBA8 frames;
+    // how long each frame is shown in milliseconds
+    stick::DynamicArray<stick::UInt32> delays;
+};
+
+// decodes every frame of an animated gif in one go. Frames are fully composited, so each layer
+// can be displayed on its own.
+STICK_API stick::Result<AnimatedImage> decodeAnimatedImage(
+    const stick::ByteArray & _data, stick::Allocator & _alloc = stick::defaultAllocator());
+
+STICK_API stick::Result<AnimatedImage> decodeAnimatedImage(
+    const void * _data,
+    stick::Size _byteCount,
+    stick::Allocator & _alloc = stick::defaultAllocator());
+
+STICK_API stick::Result<AnimatedImage> loadAnimatedImage(
+    const stick::String & _path, stick::Allocator & _alloc = stick::defaultAllocator());
+
+// A read only view of pixels that are owned by something else, i.e. a mapped .pic file. For 3D
+// volumes, layer returns a view of a single slice.
+template <class PixelT>
+class ConstImageViewT
+{
+  public:
+    typedef PixelT Pixel;
+    typedef typename PixelT::ValueType ValueType;
+
+    ConstImageViewT();
+
+    ConstImageViewT(const char * _data,
+                    stick::Size _width,
+                    stick::Size _height,
+                    stick::Size _depth = 1,
+                    stick::Size _rowPadding = 0);
+
+    const Pixel & pixel(stick::Size _left, stick::Size _top) const;
+
+    const Pixel & pixel(stick::Size _left, stick::Size _top, stick::Size _layer) const;
+
+    ConstImageViewT layer(stick::Size _layer) const;
+
+    stick::Size width() const;
+
+    stick::Size height() const;
+
+    stick::Size depth() const;
+
+    stick::Size rowPadding() const;
+
+    stick::Size bytesPerRow() const;
+
+    stick::Size byteCount() const;
+
+    const char * bytePtr() const;
+
+  private:
+    const char * m_data;
+    stick::Size m_width;
+    stick::Size m_height;
+    stick::Size m_depth;
+    stick::Size m_rowPadding;
+};
+
+// A .pic file mapped into memory. The pixels are read straight from the mapping, nothing is
+// copied and only the pages that are accessed are read from disk. The mapping is released when
+// the MappedImage is destroyed, which invalidates all views of it.
+class STICK_API MappedImage
+{
+  public:
+    MappedImage();
+
+    MappedImage(MappedImage && _other);
+
+    ~MappedImage();
+
+    MappedImage(const MappedImage &) = delete;
+
+    MappedImage & operator=(const MappedImage &) = delete;
+
+    MappedImage & operator=(MappedImage && _other);
+
+    stick::Size width() const;
+
+    stick::Size height() const;
+
+    stick::Size depth() const;
+
+    stick::Size rowPadding() const;
+
+    stick::Size bytesPerRow() const;
+
+    stick::Size byteCount() const;
+
+    stick::UInt32 channelCount() const;
+
+    stick::Size bitsPerChannel() const;
+
+    bool isFloatingPoint() const;
+
+    stick::TypeID pixelTypeID() const;
+
+    // 64 byte aligned
+    const char * bytePtr() const;
+
+    // PixelT has to be the pixel type of the file
+    template <class PixelT>
+    ConstImageViewT<PixelT> view() const;
+
+  private:
+    friend STICK_API stick::Result<MappedImage> mapImage(const stick::String &, bool);
+
+    void * m_mapping;
+    stick::Size m_mappingByteCount;
+    const char * m_pixels;
+    stick::Size m_width;
+    stick::Size m_height;
+    stick::Size m_depth;
+    stick::Size m_rowPadding;
+    stick::Size m_byteCount;
+    stick::UInt32 m_channelCount;
+    stick::Size m_bitsPerChannel;
+    bool m_isFloatingPoint;
+    stick::TypeID m_pixelTypeID;
+};
+
+// Maps a .pic file written with ImageFormat::Pic. Verifying the checksum reads the whole file,
+// so it is off by default. loadImage and decodeImage read .pic files, too, and always verify it.
+STICK_API stick::Result<MappedImage> mapImage(const stick::String & _path,
+                                              bool _verifyChecksum = false);
+
+// a sink for encoded image data that is written front to back, i.e. a file or a socket
+class STICK_API Writer
+{
+  public:
+    virtual ~Writer() = default;
+
+    // writes all _byteCount bytes or returns an error
+    virtual stick::Error write(const char * _data, stick::Size _byteCount) = 0;
+};
+
+// Encodes an image that is produced a few rows at a time, i.e. by a renderer that works in
+// bands, without assembling the whole image first. The encoded data is passed to the writer as
+// soon as it is produced, so the memory used depends on the rows passed per call rather than the
+// size of the image. Writes png (8 and 16 bit), bmp and tga (8 bit) and .pic files (any pixel
+// type). Other channel orders than gray (alpha) and rgb(a) are converted while encoding.
+class STICK_API StreamEncoder
+{
+  public:
+    StreamEncoder(stick::Allocator & _alloc = stick::defaultAllocator());
+
+    StreamEncoder(const StreamEncoder &) = delete;
+
+    StreamEncoder & operator=(const StreamEncoder &) = delete;
+
+    // Starts encoding a _width x _height image of PixelT pixels to _writer and writes the header.
+    // The writer has to stay alive until finish.
+    template <class PixelT>
+    stick::Error begin(Writer & _writer,
+                       ImageFormat _format,
+                       stick::Size _width,
+                       stick::Size _height,
+                       const SaveSettings & _settings = SaveSettings());
+
+    stick::Error begin(Writer & _writer,
+                       ImageFormat _format,
+                       stick::TypeID _pixelTypeID,
+                       stick::Size _width,
+                       stick::Size _height,
+                       const SaveSettings & _settings = SaveSettings());
+
+    // encodes the next _rowCount rows, the first one at _rows and each _stride bytes after the
+    // previous one
+    stick::Error writeRows(const void * _rows, stick::Size _rowCount, stick::Size _stride);
+
+    // writes what is left once all rows are written
+    stick::Error finish();
+
+    stick::Size rowsWritten() const;
+
+  private:
+    stick::Error fail(stick::Error _err);
+
+    stick::Error writePNGRows(const char * _rows, stick::Size _rowCount, stick::Size _stride);
+
+    stick::Error deflatePNGRows(bool _final);
+
+    stick::Error writeBMPOrTGARows(const char * _rows,
+                                   stick::Size _rowCount,
+                                   stick::Size _stride);
+
+    stick::Allocator * m_alloc;
+    Writer * m_writer;
+    ImageFormat m_format;
+    SaveSettings m_settings;
+    // the index in the table of pixel formats .pic files use
+    stick::UInt32 m_pixelFormat;
+    stick::Size m_width;
+    stick::Size m_height;
+    stick::Size m_rowCount;
+    bool m_isEncoding;
+    // converted rows, for pngs behind the last row of the previous call
+    stick::ByteArray m_rows;
+    stick::ByteArray m_lineBuffer;
+    // filtered png rows that are not deflated yet, behind the end of the deflated ones that later
+    // rows can refer back to
+    stick::ByteArray m_pending;
+    stick::Size m_dictionaryByteCount;
+    stick::ByteArray m_compressed;
+    stick::UInt32 m_adler;
+};
+
+// Decodes png, bmp, tga, binary pnm (P5 and P6) and .pic images a row at a time, either pulling
+// the rows one by one with nextRow or passing them to a callback with decodeRows. Only the rows
+// that are decoded are kept in memory, so images can be downsampled, split into tiles or
+// checksummed while they are decoded, no matter how big they are. Rows are returned in the order
+// they are stored in, which is bottom up for most bmp and tga files. Pixels are gray (alpha) or
+// rgb(a), 8 bit or 16 bit for 16 bit pngs and pnms, .pic rows are returned as they are stored.
+// Interlaced pngs and compressed bmps can't be decoded row by row.
+class STICK_API StreamDecoder
+{
+  public:
+    StreamDecoder(stick::Allocator & _alloc = stick::defaultAllocator());
+
+    StreamDecoder(const StreamDecoder &) = delete;
+
+    StreamDecoder & operator=(const StreamDecoder &) = delete;
+
+    // Reads the header of the image in _reader. The reader has to stay alive until the last row
+    // is decoded.
+    stick::Error begin(Reader & _reader);
+
+    // the size and pixel type of the rows
+    const ImageInfo & info() const;
+
+    // Decodes the next row, which stays valid until the next call. Decoding the last row of a png
+    // or .pic file also verifies the checksum of the pixel data.
+    stick::Result<const char *> nextRow();
+
+    // the y coordinate of the row that the next call to nextRow returns
+    stick::Size nextRowIndex() const;
+
+    stick::Size rowsDecoded() const;
+
+    // calls _fn(y, row) for every row that is left
+    template <class F>
+    stick::Error decodeRows(F _fn);
+
+  private:
+    enum class Format
+    {
+        PNG,
+        BMP,
+        TGA,
+        PNM,
+        Pic
+    };
+
+    stick::Error fail(stick::Error _err);
+
+    bool readBytes(char * _out, stick::Size _byteCount);
+
+    // each gets the first two bytes of the image, which were read to detect the format
+    stick::Error beginPNG(const char * _magic);
+
+    stick::Error beginBMP(const char * _magic);
+
+    stick::Error beginTGA(const char * _magic);
+
+    stick::Error beginPNM(const char * _magic);
+
+    stick::Error beginPic(const char * _magic);
+
+    stick::Error decodePNGRow();
+
+    // reads the next stored row of a bmp, tga, pnm or .pic file to m_input
+    stick::Error readStoredRow();
+
+    // converts the row in m_input to gray (alpha) or rgb(a)
+    void convertStoredRow();
+
+    // feeds the inflater with the data of the IDAT chunks
+    static stick::Size fillInflater(void * _userData, const stick::UInt8 ** _outData);
+
+    Reader * m_reader;
+    Format m_format;
+    ImageInfo m_info;
+    stick::Size m_rowCount;
+    bool m_isBottomUp;
+    bool m_isDecoding;
+    // the layout of the stored rows
+    stick::UInt32 m_channelCount;
+    stick::UInt32 m_bitsPerChannel;
+    stick::Size m_storedRowByteCount;
+    // the stored rows, for pngs the one above the current row followed by the current row
+    stick::ByteArray m_input;
+    stick::ByteArray m_row;
+    // rgba entries
+    stick::ByteArray m_palette;
+    bool m_hasPaletteAlpha;
+    Inflater m_inflater;
+    stick::ByteArray m_compressed;
+    stick::Size m_chunkByteCount;
+    // crc32 of the current png chunk or the pixels of a .pic file
+    stick::UInt32 m_crc;
+    stick::UInt32 m_expectedCRC;
+    bool m_verifyCRC;
+    // set once a chunk other than IDAT follows the image data
+    bool m_isDataAtEnd;
+    stick::Error m_inputError;
+    // tga run length encoding packets can span rows
+    bool m_isRunLengthEncoded;
+    stick::Size m_packetPixelCount;
+    bool m_isRunPacket;
+    stick::UInt8 m_runPixel[4];
+};
+
+// Decodes an image while its data arrives, i.e. from a socket or a chunked http body, so that
+// decoding overlaps with the transfer. The data is passed to feed in chunks of any size and decoded
+// on a worker thread that the first call to feed starts. Top down png, bmp, tga, pnm and .pic
+// images and baseline jpegs make their rows available while they are decoded, one MCU row behind
+// the data for jpegs. The rows of all other images become available once the whole image is
+// decoded. The pixels are the same as decodeImage's.
+class STICK_API PushDecoder
+{
+  public:
+    PushDecoder(stick::Allocator & _alloc = stick::defaultAllocator());
+
+    // stops decoding if finish was not called and waits for the worker
+    ~PushDecoder();
+
+    PushDecoder(const PushDecoder &) = delete;
+
+    PushDecoder & operator=(const PushDecoder &) = delete;
+
+    // Passes the next _byteCount bytes of the image to the decoder, which copies them. Returns the
+    // error as soon as decoding failed, so the caller can stop receiving the rest.
+    stick::Error feed(const void * _data, stick::Size _byteCount);
+
+    // how many rows from the top of image() are decoded, can be called from any thread
+    stick::Size rowsAvailable() const;
+
+    // null until the first row is available. Only the first rowsAvailable() rows may be read
+    // while decoding, the worker is still writing the others.
+    const Image * image() const;
+
+    // marks the end of the data, waits until the image is decoded and returns it
+    stick::Result<ImageUniquePtr> finish();
+
+  private:
+    // the Reader the worker decodes from, blocks until feed passes more data
+    class InputReader;
+
+    struct State;
+
+    void decode();
+
+    // waits until _byteCount bytes were fed or the data ended and copies them, without reading
+    stick::Size peek(char * _out, stick::Size _byteCount);
+
+    // stops keeping the data that was read, once it is clear that decoding won't start over
+    void dropReadInput();
+
+    stick::Error decodeStreamed(StreamDecoder & _decoder);
+
+    // defined by the implementation, decodes jpegs and makes their rows available
+    stick::Error decodeJPEG(Reader & _reader);
+
+    // decodes the whole image before making any rows available
+    stick::Error decodeWhole(Reader & _reader);
+
+    stick::Allocator * m_alloc;
+    // the worker and what it shares with the calling thread
+    State * m_state;
+};
+
+template <class P>
+ConstImageViewT<P>::ConstImageViewT() :
+    m_data(nullptr),
+    m_width(0),
+    m_height(0),
+    m_depth(0),
+    m_rowPadding(0)
+{
+}
+
+template <class P>
+ConstImageViewT<P>::ConstImageViewT(const char * _data,
+                                    stick::Size _width,
+                                    stick::Size _height,
+                                    stick::Size _depth,
+                                    stick::Size _rowPadding) :
+    m_data(_data),
+    m_width(_width),
+    m_height(_height),
+    m_depth(_depth),
+    m_rowPadding(_rowPadding)
+{
+}
+
+template <class P>
+const typename ConstImageViewT<P>::Pixel & ConstImageViewT<P>::pixel(stick::Size _left,
+                                                                     stick::Size _top) const
+{
+    STICK_ASSERT(_left < m_width && _top < m_height);
+    return *reinterpret_cast<const Pixel *>(m_data + _top * bytesPerRow() +
+                                            _left * sizeof(Pixel));
+}
+
+template <class P>
+const typename ConstImageViewT<P>::Pixel & ConstImageViewT<P>::pixel(stick::Size _left,
+                                                                     stick::Size _top,
+                                                                     stick::Size _layer) const
+{
+    STICK_ASSERT(_left < m_width && _top < m_height && _layer < m_depth);
+    return *reinterpret_cast<const Pixel *>(m_data + (_layer * m_height + _top) * bytesPerRow() +
+                                            _left * sizeof(Pixel));
+}
+
+template <class P>
+ConstImageViewT<P> ConstImageViewT<P>::layer(stick::Size _layer) const
+{
+    STICK_ASSERT(_layer < m_depth);
+    return ConstImageViewT(
+        m_data + _layer * m_height * bytesPerRow(), m_width, m_height, 1, m_rowPadding);
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::width() const
+{
+    return m_width;
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::height() const
+{
+    return m_height;
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::depth() const
+{
+    return m_depth;
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::rowPadding() const
+{
+    return m_rowPadding;
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::bytesPerRow() const
+{
+    return m_width * sizeof(Pixel) + m_rowPadding;
+}
+
+template <class P>
+stick::Size ConstImageViewT<P>::byteCount() const
+{
+    return bytesPerRow() * m_height * m_depth;
+}
+
+template <class P>
+const char * ConstImageViewT<P>::bytePtr() const
+{
+    return m_data;
+}
+
+template <class PixelT>
+ConstImageViewT<PixelT> MappedImage::view() const
+{
+    STICK_ASSERT(PixelT::pixelTypeID() == m_pixelTypeID);
+    return ConstImageViewT<PixelT>(m_pixels, m_width, m_height, m_depth, m_rowPadding);
+}
+
+template <class PixelT>
+stick::Error StreamEncoder::begin(Writer & _writer,
+                                  ImageFormat _format,
+                                  stick::Size _width,
+                                  stick::Size _height,
+                                  const SaveSettings & _settings)
+{
+    return begin(_writer, _format, PixelT::pixelTypeID(), _width, _height, _settings);
+}
+
+template <class F>
+stick::Error StreamDecoder::decodeRows(F _fn)
+{
+    while (m_rowCount < m_info.height)
+    {
+        stick::Size y = nextRowIndex();
+        auto row = nextRow();
+        if (!row)
+            return row.error();
+        _fn(y, row.get());
+    }
+    return stick::Error();
+}
 } // namespace pic
 
 #endif // PIC_IMAGE_HPP
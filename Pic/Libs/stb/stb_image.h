@@ -466,6 +466,42 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// backported from stb_image 2.27:
+// as above, but only applies to images loaded on the thread that calls the function
+// this function is only available if your compiler supports thread-local variables;
+// calling it will fail to link if your compiler doesn't
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+
+// Pic: decode jpegs at 1/(1<<scale_shift) of their size (0 to 3, i.e. down to 1/8) using reduced
+// size IDCTs, which is a lot cheaper than decoding the full image and scaling it down afterwards.
+// Odd sizes round up. stbi_info reports the scaled size, too. Per thread if thread locals work.
+STBIDEF void stbi_set_jpeg_scale_thread(int scale_shift);
+
+// Pic: load only the w*h pixels at x, y of jpegs, in pixels of the scaled size. Only the MCUs that
+// cover the region (plus one on every side, so the chroma upsampling matches a full decode) are
+// transformed and stored, and reading single scan jpegs stops after the last MCU row of the
+// region. stbi_info reports the region size. w <= 0 loads the whole image. Per thread like above.
+STBIDEF void stbi_set_jpeg_region_thread(int x, int y, int w, int h);
+
+// Pic: calls callback with every output row of jpegs as soon as it is decoded, before any
+// conversion to other value types. y is the row in the output, so flipped jpegs produce their
+// rows bottom up. Baseline jpegs with a single scan produce their rows while decoding, one MCU
+// row behind the data, all others once everything is decoded. Null turns it off. Per thread like
+// above.
+typedef void (*stbi_jpeg_row_callback)(void *user, int y, const stbi_uc *row);
+STBIDEF void stbi_set_jpeg_row_callback_thread(stbi_jpeg_row_callback callback, void *user);
+
+// Pic: writes the channels of 8 and 16 bit images with n (3 or 4) output channels in a different
+// order, out[i] = rgba[order[i]], while they are converted to the requested channel count. That
+// is the color conversion of jpegs and stbi__convert_format for the others, so images that are
+// loaded with the channel count they are stored with (and floats) are left as they are.
+// stbi_channel_order_applied_thread tells if the last load did it. n = 0 turns it off. Per thread
+// like above.
+STBIDEF void stbi_set_channel_order_thread(int n, const int *order);
+STBIDEF int stbi_channel_order_applied_thread(void);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -813,6 +849,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int is_flipped; // Pic: the loader wrote the rows flipped already
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -872,8 +909,31 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// backported from stb_image 2.25: keep the failure reason per thread, so decoding on several
+// threads at once is not a data race
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) &&  __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined (__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #endif
+
+   #ifndef STBI_THREAD_LOCAL
+      #if defined(__GNUC__)
+        #define STBI_THREAD_LOCAL       __thread
+      #endif
+   #endif
+#endif
+
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -994,11 +1054,110 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
+static int stbi__vertically_flip_on_load_global = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+   stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__vertically_flip_on_load_local, stbi__vertically_flip_on_load_set;
+
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
+{
+   stbi__vertically_flip_on_load_local = flag_true_if_should_flip;
+   stbi__vertically_flip_on_load_set = 1;
+}
+
+#define stbi__vertically_flip_on_load  (stbi__vertically_flip_on_load_set       \
+                                         ? stbi__vertically_flip_on_load_local  \
+                                         : stbi__vertically_flip_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+// Pic: there is no global version of the jpeg scale, it is per thread where supported
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_shift;
+#else
+static int stbi__jpeg_scale_shift;
+#endif
+
+STBIDEF void stbi_set_jpeg_scale_thread(int scale_shift)
+{
+   stbi__jpeg_scale_shift = scale_shift < 0 ? 0 : scale_shift > 3 ? 3 : scale_shift;
+}
+
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__jpeg_region[4];
+#else
+static int stbi__jpeg_region[4];
+#endif
+
+STBIDEF void stbi_set_jpeg_region_thread(int x, int y, int w, int h)
+{
+   stbi__jpeg_region[0] = x;
+   stbi__jpeg_region[1] = y;
+   stbi__jpeg_region[2] = w;
+   stbi__jpeg_region[3] = h;
+}
+
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL stbi_jpeg_row_callback stbi__jpeg_row_callback;
+static STBI_THREAD_LOCAL void *stbi__jpeg_row_user;
+#else
+static stbi_jpeg_row_callback stbi__jpeg_row_callback;
+static void *stbi__jpeg_row_user;
+#endif
+
+STBIDEF void stbi_set_jpeg_row_callback_thread(stbi_jpeg_row_callback callback, void *user)
+{
+   stbi__jpeg_row_callback = callback;
+   stbi__jpeg_row_user = user;
+}
+
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__channel_order_n, stbi__channel_order[4], stbi__channel_order_applied;
+#else
+static int stbi__channel_order_n, stbi__channel_order[4], stbi__channel_order_applied;
+#endif
+
+STBIDEF void stbi_set_channel_order_thread(int n, const int *order)
+{
+   int i;
+   stbi__channel_order_n = (n == 3 || n == 4) && order ? n : 0;
+   for (i=0; i < stbi__channel_order_n; ++i)
+      stbi__channel_order[i] = order[i];
+   stbi__channel_order_applied = 0;
+}
+
+STBIDEF int stbi_channel_order_applied_thread(void)
+{
+   return stbi__channel_order_applied;
+}
+
+// Pic: reorders the channels of a row that was just converted, while it is still in the cache
+static void stbi__reorder_row(stbi_uc *row, int n, int w)
+{
+   int i, k;
+   stbi_uc tmp[4];
+   for (i=0; i < w; ++i, row += n) {
+      for (k=0; k < n; ++k) tmp[k] = row[k];
+      for (k=0; k < n; ++k) row[k] = tmp[stbi__channel_order[k]];
+   }
+   stbi__channel_order_applied = 1;
+}
+
+static void stbi__reorder_row16(stbi__uint16 *row, int n, int w)
+{
+   int i, k;
+   stbi__uint16 tmp[4];
+   for (i=0; i < w; ++i, row += n) {
+      for (k=0; k < n; ++k) tmp[k] = row[k];
+      for (k=0; k < n; ++k) row[k] = tmp[stbi__channel_order[k]];
+   }
+   stbi__channel_order_applied = 1;
 }
 
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
@@ -1132,7 +1291,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.is_flipped) { // Pic
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1157,7 +1316,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.is_flipped) { // Pic
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1616,6 +1775,9 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
          default: STBI_ASSERT(0);
       }
       #undef STBI__CASE
+      // Pic: see stbi_set_channel_order_thread
+      if (stbi__channel_order_n == req_comp)
+         stbi__reorder_row(good + j * x * req_comp, req_comp, x);
    }
 
    STBI_FREE(data);
@@ -1665,6 +1827,9 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
          default: STBI_ASSERT(0);
       }
       #undef STBI__CASE
+      // Pic: see stbi_set_channel_order_thread
+      if (stbi__channel_order_n == req_comp)
+         stbi__reorder_row16(good + j * x * req_comp, req_comp, x);
    }
 
    STBI_FREE(data);
@@ -1752,6 +1917,21 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 // huffman decoding acceleration
 #define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
 
+// Pic: moved up from the resampling code, so stbi__jpeg can hold the resampling state
+typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
+                                    int w, int hs);
+
+typedef struct
+{
+   resample_row_func resample;
+   stbi_uc *line0,*line1;
+   int hs,vs;   // expansion factor in each axis
+   int w_lores; // horizontal pixels pre-expansion
+   int ystep;   // how far through vertical expansion we are
+   int ypos;    // which pre-expansion row we're on
+   int ycount;  // Pic: how many pre-expansion rows are stored
+} stbi__resample;
+
 typedef struct
 {
    stbi_uc  fast[1 << FAST_BITS];
@@ -1810,6 +1990,19 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // Pic: decode at 1/(1<<scale_shift) of the size, see stbi_set_jpeg_scale_thread
+   // Pic: the region to load, see stbi_set_jpeg_region_thread, and the range of MCUs that is stored
+   int region_x, region_y, region_w, region_h;
+   int mcu_x0, mcu_y0, mcu_x1, mcu_y1;
+   int region_done; // set once all MCU rows of the region are decoded
+   // Pic: the resampling and color conversion state, see stbi__jpeg_begin_output
+   stbi_jpeg_row_callback row_callback;
+   void *row_user;
+   int req_comp, out_n, decode_n, is_rgb;
+   int out_w, out_h, row0, col0, rows_emitted;
+   int flip; // write the output rows bottom up, see stbi_set_flip_vertically_on_load
+   stbi_uc *output;
+   stbi__resample res_comp[4];
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2326,6 +2519,58 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// Pic: reduced size IDCTs, like libjpeg's jidctred. Only the lowest n*n coefficients of a block
+// are transformed, with the cosines of an n point IDCT, which yields the n*n block scaled down
+// from 8*8 without computing the full size pixels first. The constants are
+// c(u)/2*cos((2x+1)u*pi/2n) scaled by 1<<11.
+#define STBI__IDCT4_1D(s0,s1,s2,s3) \
+   int e0 = (s0 + s2) * 724, e1 = (s0 - s2) * 724; \
+   int o0 = s1 * 946 + s3 * 392, o1 = s1 * 392 - s3 * 946;
+
+static void stbi__idct_block_reduced(stbi_uc *out, int out_stride, short data[64], int n)
+{
+   int i,val[16],*v=val;
+   short *d = data;
+
+   if (n == 1) {
+      // the dc coefficient is 8 times the block average
+      int dc = data[0] >= 0 ? (data[0] + 4) >> 3 : -((4 - data[0]) >> 3);
+      out[0] = stbi__clamp(dc + 128);
+      return;
+   }
+
+   if (n == 2) {
+      // all four constants are 724, i.e. 1/(2*sqrt(2)), so both passes together divide by 8
+      int r0 = d[0] + d[8], r1 = d[0] - d[8];
+      int s0 = d[1] + d[9], s1 = d[1] - d[9];
+      out[0]              = stbi__clamp(((r0 + s0 + 4) >> 3) + 128);
+      out[1]              = stbi__clamp(((r0 - s0 + 4) >> 3) + 128);
+      out[out_stride]     = stbi__clamp(((r1 + s1 + 4) >> 3) + 128);
+      out[out_stride + 1] = stbi__clamp(((r1 - s1 + 4) >> 3) + 128);
+      return;
+   }
+
+   // columns, keeping 2 extra bits of precision
+   for (i=0; i < 4; ++i,++d,++v) {
+      STBI__IDCT4_1D(d[0],d[8],d[16],d[24])
+      v[ 0] = (e0 + o0 + 256) >> 9;
+      v[12] = (e0 - o0 + 256) >> 9;
+      v[ 4] = (e1 + o1 + 256) >> 9;
+      v[ 8] = (e1 - o1 + 256) >> 9;
+   }
+
+   // rows, removing the 1<<11 of the constants and the 2 extra bits
+   for (i=0, v=val; i < 4; ++i,v+=4,out+=out_stride) {
+      STBI__IDCT4_1D(v[0],v[1],v[2],v[3])
+      e0 += 4096 + (128<<13);
+      e1 += 4096 + (128<<13);
+      out[0] = stbi__clamp((e0 + o0) >> 13);
+      out[3] = stbi__clamp((e0 - o0) >> 13);
+      out[1] = stbi__clamp((e1 + o1) >> 13);
+      out[2] = stbi__clamp((e1 - o1) >> 13);
+   }
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2749,6 +2994,25 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// Pic: idcts the block in block column bx and row by of component n, at the reduced size if the
+// image is decoded scaled down. Blocks outside of the stored MCUs are skipped.
+static void stbi__jpeg_idct_block(stbi__jpeg *z, int n, int bx, int by, short data[64])
+{
+   int bs = 8 >> z->scale_shift;
+   stbi_uc *out;
+   bx -= z->mcu_x0 * z->img_comp[n].h;
+   by -= z->mcu_y0 * z->img_comp[n].v;
+   if (bx < 0 || by < 0 || bx*bs >= z->img_comp[n].w2 || by*bs >= z->img_comp[n].h2)
+      return;
+   out = z->img_comp[n].data + z->img_comp[n].w2*by*bs + bx*bs;
+   if (z->scale_shift)
+      stbi__idct_block_reduced(out, z->img_comp[n].w2, data, bs);
+   else
+      z->idct_block_kernel(out, z->img_comp[n].w2, data);
+}
+
+static void stbi__jpeg_emit_rows(stbi__jpeg *z, int end); // Pic
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
@@ -2764,10 +3028,15 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            // Pic: a gray image has no other scans, so it is done after the region
+            if (z->s->img_n == 1 && j >= z->mcu_y1 * z->img_comp[n].v) {
+               z->region_done = 1;
+               return 1;
+            }
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct_block(z, n, i, j, data); // Pic
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2777,12 +3046,20 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            // Pic: output the rows of the previous block row
+            if (z->output)
+               stbi__jpeg_emit_rows(z, (j - z->mcu_y0 * z->img_comp[n].v) * (8 >> z->scale_shift));
          }
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
          STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
+            // Pic: if this scan holds all components, nothing else is needed after the region
+            if (z->scan_n == z->s->img_n && j >= z->mcu_y1) {
+               z->region_done = 1;
+               return 1;
+            }
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -2791,11 +3068,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        // Pic: block column and row instead of pixel offsets
+                        int x2 = i*z->img_comp[n].h + x;
+                        int y2 = j*z->img_comp[n].v + y;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        stbi__jpeg_idct_block(z, n, x2, y2, data);
                      }
                   }
                }
@@ -2807,6 +3085,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            // Pic: output the rows of the previous MCU row, the upsampling needs the current one
+            if (z->output)
+               stbi__jpeg_emit_rows(z, (j - z->mcu_y0) * (z->img_mcu_h >> z->scale_shift));
          }
          return 1;
       }
@@ -2892,7 +3173,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct_block(z, n, i, j, data); // Pic
             }
          }
       }
@@ -3063,6 +3344,10 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    return why;
 }
 
+// Pic: for the region bounds
+static int stbi__jpeg_min(int a, int b) { return a < b ? a : b; }
+static int stbi__jpeg_max(int a, int b) { return a > b ? a : b; }
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3111,6 +3396,23 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   // Pic: the range of MCUs to store, with one more on every side of the region for upsampling
+   z->mcu_x0 = z->mcu_y0 = 0;
+   z->mcu_x1 = z->img_mcu_x;
+   z->mcu_y1 = z->img_mcu_y;
+   if (z->region_w > 0) {
+      int round = (1 << z->scale_shift) - 1;
+      int mcu_w = z->img_mcu_w >> z->scale_shift, mcu_h = z->img_mcu_h >> z->scale_shift;
+      if (z->region_x < 0 || z->region_y < 0 || z->region_h <= 0
+          || z->region_x + z->region_w > (int) ((s->img_x + round) >> z->scale_shift)
+          || z->region_y + z->region_h > (int) ((s->img_y + round) >> z->scale_shift))
+         return stbi__err("bad region", "Region outside of the image");
+      z->mcu_x0 = stbi__jpeg_max(z->region_x / mcu_w - 1, 0);
+      z->mcu_y0 = stbi__jpeg_max(z->region_y / mcu_h - 1, 0);
+      z->mcu_x1 = stbi__jpeg_min((z->region_x + z->region_w + mcu_w - 1) / mcu_w + 1, z->img_mcu_x);
+      z->mcu_y1 = stbi__jpeg_min((z->region_y + z->region_h + mcu_h - 1) / mcu_h + 1, z->img_mcu_y);
+   }
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
@@ -3122,8 +3424,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // Pic: only the MCUs of the region are stored, at the reduced size when scaling down
+      z->img_comp[i].w2 = (z->mcu_x1 - z->mcu_x0) * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = (z->mcu_y1 - z->mcu_y0) * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3133,10 +3436,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // Pic: one block of coefficients per block of the scaled down size
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3180,6 +3483,8 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 }
 
 // decode image to YCbCr format
+static int stbi__jpeg_begin_output(stbi__jpeg *z); // Pic
+
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
    int m;
@@ -3188,12 +3493,17 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       j->img_comp[m].raw_coeff = NULL;
    }
    j->restart_interval = 0;
+   j->region_done = 0; // Pic
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+         // Pic: a single scan holds the whole image, so rows can be output while decoding it
+         if (j->row_callback && !j->progressive && j->scan_n == j->s->img_n && !j->output)
+            if (!stbi__jpeg_begin_output(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->region_done) return 1; // Pic
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3222,9 +3532,6 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
 
 // static jfif-centered resampling (across block boundaries)
 
-typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
-                                    int w, int hs);
-
 #define stbi__div4(x) ((stbi_uc) ((x) >> 2))
 
 static stbi_uc *resample_row_1(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
@@ -3619,16 +3926,6 @@ static void stbi__cleanup_jpeg(stbi__jpeg *j)
    stbi__free_jpeg_components(j, j->s->img_n, 0);
 }
 
-typedef struct
-{
-   resample_row_func resample;
-   stbi_uc *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi__resample;
-
 // fast 0..255 * 0..255 => 0..255 rounded multiplication
 static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
 {
@@ -3636,171 +3933,226 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// Pic: sets up resampling and color conversion and allocates the output. Only needs the frame
+// header and what comes before the first scan, so single scan jpegs can output rows while decoding.
+static int stbi__jpeg_begin_output(stbi__jpeg *z)
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
-
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   int k, round = (1 << z->scale_shift) - 1;
+   int mcu_w = z->img_mcu_w >> z->scale_shift, mcu_h = z->img_mcu_h >> z->scale_shift;
+   // the components hold the stored MCUs at the scaled down size, which is what is resampled
+   int sub_w = stbi__jpeg_min((z->s->img_x + round) >> z->scale_shift, z->mcu_x1 * mcu_w) - z->mcu_x0 * mcu_w;
+   int sub_h = stbi__jpeg_min((z->s->img_y + round) >> z->scale_shift, z->mcu_y1 * mcu_h) - z->mcu_y0 * mcu_h;
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   // the output is the region within the stored MCUs if there is one
+   z->out_w = sub_w;
+   z->out_h = sub_h;
+   z->col0 = z->row0 = 0;
+   if (z->region_w > 0) {
+      z->col0 = z->region_x - z->mcu_x0 * mcu_w;
+      z->row0 = z->region_y - z->mcu_y0 * mcu_h;
+      z->out_w = z->region_w;
+      z->out_h = z->region_h;
+   }
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   z->out_n = z->req_comp ? z->req_comp : z->s->img_n >= 3 ? 3 : 1;
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   z->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
+   if (z->s->img_n == 3 && z->out_n < 3 && !z->is_rgb)
+      z->decode_n = 1;
    else
-      decode_n = z->s->img_n;
-
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+      z->decode_n = z->s->img_n;
+
+   for (k=0; k < z->decode_n; ++k) {
+      stbi__resample *r = &z->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(sub_w + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (sub_w + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->ycount  = (sub_h * z->img_comp[k].v + z->img_v_max - 1) / z->img_v_max;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   // can't error after this so, this is safe
+   z->output = (stbi_uc *) stbi__malloc_mad3(z->out_n, z->out_w, z->out_h, 1);
+   if (!z->output) return stbi__err("outofmem", "Out of memory");
+   z->rows_emitted = 0;
+   return 1;
+}
 
-      stbi__resample res_comp[4];
+// Pic: resamples and color converts the rows of the stored MCUs up to end into the output
+static void stbi__jpeg_emit_rows(stbi__jpeg *z, int end)
+{
+   int i, j, k, n = z->out_n, decode_n = z->decode_n, is_rgb = z->is_rgb, out_y;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc next_row_byte = 0;
 
+   if (end > z->row0 + z->out_h) end = z->row0 + z->out_h;
+   for (j=z->rows_emitted; j < end; ++j) {
+      stbi_uc *out;
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+         stbi__resample *r = &z->res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < r->ycount)
+               r->line1 += z->img_comp[k].w2;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+         coutput[k] += z->col0;
+      }
+      // the rows above the region are only resampled to advance the resamplers
+      if (j < z->row0) continue;
+      out_y = z->flip ? z->out_h - 1 - (j - z->row0) : j - z->row0;
+      out = z->output + n * z->out_w * out_y;
+      // the 3 channel conversions write a fourth byte past every pixel, which is the first byte
+      // of the next row, already written if the rows go bottom up
+      if (z->flip && n == 3 && out_y + 1 < z->out_h) next_row_byte = out[n * z->out_w];
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->out_w; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->out_w; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+               for (i=0; i < z->out_w; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+            }
+         } else
+            for (i=0; i < z->out_w; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->out_w; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->out_w; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
                   out[1] = 255;
-                  out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
             }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->out_w; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->out_w; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->out_w; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->out_w; ++i) { *out++ = y[i]; *out++ = 255; }
          }
       }
+      if (stbi__channel_order_n == n)
+         stbi__reorder_row(z->output + n * z->out_w * out_y, n, z->out_w);
+      if (z->flip && n == 3 && out_y + 1 < z->out_h) z->output[n * z->out_w * (out_y + 1)] = next_row_byte;
+      if (z->row_callback)
+         z->row_callback(z->row_user, out_y, z->output + n * z->out_w * out_y);
+   }
+   if (end > z->rows_emitted) z->rows_emitted = end;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   // Pic: single scan jpegs with a row callback are resampled and color converted while decoding
+   z->req_comp = req_comp;
+   z->output = NULL;
+   if (!stbi__decode_jpeg_image(z) || (!z->output && !stbi__jpeg_begin_output(z))) {
+      STBI_FREE(z->output);
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return NULL;
    }
+
+   // resample and color-convert the rest
+   stbi__jpeg_emit_rows(z, z->row0 + z->out_h);
+   stbi__cleanup_jpeg(z);
+   *out_x = z->out_w;
+   *out_y = z->out_h;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return z->output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale_shift; // Pic
+   j->region_x = stbi__jpeg_region[0];
+   j->region_y = stbi__jpeg_region[1];
+   j->region_w = stbi__jpeg_region[2];
+   j->region_h = stbi__jpeg_region[3];
+   j->row_callback = stbi__jpeg_row_callback;
+   j->row_user = stbi__jpeg_row_user;
+   // Pic: the rows are written flipped while they are color converted, not in a pass afterwards
+   j->flip = stbi__vertically_flip_on_load;
+   ri->is_flipped = j->flip;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
@@ -3825,8 +4177,11 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   // Pic: report the size the image is loaded at
+   if (x) *x = (j->s->img_x + (1 << j->scale_shift) - 1) >> j->scale_shift;
+   if (y) *y = (j->s->img_y + (1 << j->scale_shift) - 1) >> j->scale_shift;
+   if (x && j->region_w > 0) *x = j->region_w;
+   if (y && j->region_w > 0) *y = j->region_h;
    if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
    return 1;
 }
@@ -3836,6 +4191,9 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    int result;
    stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale_shift; // Pic
+   j->region_w = stbi__jpeg_region[2];
+   j->region_h = stbi__jpeg_region[3];
    result = stbi__jpeg_info_raw(j, x, y, comp);
    STBI_FREE(j);
    return result;
@@ -4736,19 +5094,46 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
+static int stbi__unpremultiply_on_load_global = 0;
+static int stbi__de_iphone_flag_global = 0;
 
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
 }
 
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-   stbi__de_iphone_flag = flag_true_if_should_convert;
+   stbi__de_iphone_flag_global = flag_true_if_should_convert;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
+#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
+#else
+static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
+static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load_local = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_set = 1;
 }
 
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag_local = flag_true_if_should_convert;
+   stbi__de_iphone_flag_set = 1;
+}
+
+#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
+                                       ? stbi__unpremultiply_on_load_local      \
+                                       : stbi__unpremultiply_on_load_global)
+#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
+                                ? stbi__de_iphone_flag_local                    \
+                                : stbi__de_iphone_flag_global)
+#endif // STBI_THREAD_LOCAL
+
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
@@ -6935,7 +7320,8 @@ static int stbi__bmp_info(stbi__context *s, int *x, int *y, int *comp)
    if (p == NULL)
       return 0;
    if (x) *x = s->img_x;
-   if (y) *y = s->img_y;
+   // Pic: top down bmps store a negative height, like stbi__bmp_load handles
+   if (y) *y = abs((int) s->img_y);
    if (comp) *comp = info.ma ? 4 : 3;
    return 1;
 }
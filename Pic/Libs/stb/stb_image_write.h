@@ -170,10 +170,23 @@ LICENSE
 #endif
 #endif
 
+// Pic: the write settings are thread local, so that threads can write with different settings
+#ifndef STBIW_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBIW_THREAD_LOCAL       thread_local
+   #elif defined(_MSC_VER)
+      #define STBIW_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__GNUC__)
+      #define STBIW_THREAD_LOCAL       __thread
+   #else
+      #define STBIW_THREAD_LOCAL
+   #endif
+#endif
+
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
-extern int stbi_write_tga_with_rle;
-extern int stbi_write_png_compression_level;
-extern int stbi_write_force_png_filter;
+extern STBIW_THREAD_LOCAL int stbi_write_tga_with_rle;
+extern STBIW_THREAD_LOCAL int stbi_write_png_compression_level;
+extern STBIW_THREAD_LOCAL int stbi_write_force_png_filter;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -196,6 +209,17 @@ STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
 
+// Pic: the bmp, tga and jpg writers can fetch the rows of the image from a callback instead of
+// reading them from one contiguous block, so that padded images can be written without repacking
+// them first. Rows are requested in the order they are written. The jpg writer uses 8 rows at a
+// time, the others one, so a pointer returned by the callback has to stay valid while the next 7
+// rows are requested.
+typedef const void *stbi_write_row_func(void *context, int y);
+
+STBIWDEF int stbi_write_bmp_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *row, void *row_context);
+STBIWDEF int stbi_write_tga_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *row, void *row_context);
+STBIWDEF int stbi_write_jpg_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *row, void *row_context, int quality);
+
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #endif//INCLUDE_STB_IMAGE_WRITE_H
@@ -252,15 +276,15 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
 #ifdef STB_IMAGE_WRITE_STATIC
-static int stbi__flip_vertically_on_write=0;
-static int stbi_write_png_compression_level = 8;
-static int stbi_write_tga_with_rle = 1;
-static int stbi_write_force_png_filter = -1;
+static STBIW_THREAD_LOCAL int stbi__flip_vertically_on_write=0;
+static STBIW_THREAD_LOCAL int stbi_write_png_compression_level = 8;
+static STBIW_THREAD_LOCAL int stbi_write_tga_with_rle = 1;
+static STBIW_THREAD_LOCAL int stbi_write_force_png_filter = -1;
 #else
-int stbi_write_png_compression_level = 8;
-int stbi__flip_vertically_on_write=0;
-int stbi_write_tga_with_rle = 1;
-int stbi_write_force_png_filter = -1;
+STBIW_THREAD_LOCAL int stbi_write_png_compression_level = 8;
+STBIW_THREAD_LOCAL int stbi__flip_vertically_on_write=0;
+STBIW_THREAD_LOCAL int stbi_write_tga_with_rle = 1;
+STBIW_THREAD_LOCAL int stbi_write_force_png_filter = -1;
 #endif
 
 STBIWDEF void stbi_flip_vertically_on_write(int flag)
@@ -272,6 +296,9 @@ typedef struct
 {
    stbi_write_func *func;
    void *context;
+   // Pic: the row callback, if the image is not contiguous
+   stbi_write_row_func *row;
+   void *row_context;
 } stbi__write_context;
 
 // initialize a callback-based context
@@ -279,6 +306,16 @@ static void stbi__start_write_callbacks(stbi__write_context *s, stbi_write_func
 {
    s->func    = c;
    s->context = context;
+   s->row     = NULL;
+   s->row_context = NULL;
+}
+
+// Pic: row j of an image of x pixels with comp channels each
+static unsigned char *stbiw__row(stbi__write_context *s, void *data, int x, int comp, int j)
+{
+   if (s->row)
+      return (unsigned char *) s->row(s->row_context, j);
+   return (unsigned char *) data + j*x*comp;
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -448,8 +485,9 @@ static void stbiw__write_pixels(stbi__write_context *s, int rgb_dir, int vdir, i
    }
 
    for (; j != j_end; j += vdir) {
+      unsigned char *row = stbiw__row(s, data, x, comp, j);
       for (i=0; i < x; ++i) {
-         unsigned char *d = (unsigned char *) data + (j*x+i)*comp;
+         unsigned char *d = row + i*comp;
          stbiw__write_pixel(s, rgb_dir, comp, write_alpha, expand_mono, d);
       }
       s->func(s->context, &zero, scanline_pad);
@@ -486,6 +524,15 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int x,
    return stbi_write_bmp_core(&s, x, y, comp, data);
 }
 
+STBIWDEF int stbi_write_bmp_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *row, void *row_context)
+{
+   stbi__write_context s;
+   stbi__start_write_callbacks(&s, func, context);
+   s.row = row;
+   s.row_context = row_context;
+   return stbi_write_bmp_core(&s, x, y, comp, NULL);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_bmp(char const *filename, int x, int y, int comp, const void *data)
 {
@@ -527,7 +574,7 @@ static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, v
          jdir = -1;
       }
       for (; j != jend; j += jdir) {
-         unsigned char *row = (unsigned char *) data + j * x * comp;
+         unsigned char *row = stbiw__row(s, data, x, comp, j);
          int len;
 
          for (i = 0; i < x; i += len) {
@@ -584,6 +631,15 @@ STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int x,
    return stbi_write_tga_core(&s, x, y, comp, (void *) data);
 }
 
+STBIWDEF int stbi_write_tga_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *row, void *row_context)
+{
+   stbi__write_context s;
+   stbi__start_write_callbacks(&s, func, context);
+   s.row = row;
+   s.row_context = row_context;
+   return stbi_write_tga_core(&s, x, y, comp, NULL);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_tga(char const *filename, int x, int y, int comp, const void *data)
 {
@@ -777,7 +833,8 @@ STBIWDEF int stbi_write_hdr(char const *filename, int x, int y, int comp, const
 // PNG writer
 //
 
-#ifndef STBIW_ZLIB_COMPRESS
+// Pic: the builtin compressor is always compiled so it stays selectable when STBIW_ZLIB_COMPRESS
+// is defined.
 // stretchy buffer; stbiw__sbpush() == vector<>::push_back() -- stbiw__sbcount() == vector<>::size()
 #define stbiw__sbraw(a) ((int *) (a) - 2)
 #define stbiw__sbm(a)   stbiw__sbraw(a)[0]
@@ -858,14 +915,8 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
-#endif // STBIW_ZLIB_COMPRESS
-
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+static unsigned char * stbiw__zlib_compress_builtin(unsigned char *data, int data_len, int *out_len, int quality)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
@@ -969,6 +1020,15 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
+}
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   return stbiw__zlib_compress_builtin(data, data_len, out_len, quality);
 #endif // STBIW_ZLIB_COMPRESS
 }
 
@@ -1417,7 +1477,7 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    float fdtbl_Y[64], fdtbl_UV[64];
    unsigned char YTable[64], UVTable[64];
 
-   if(!data || !width || !height || comp > 4 || comp < 1) {
+   if((!data && !s->row) || !width || !height || comp > 4 || comp < 1) {
       return 0;
    }
 
@@ -1467,23 +1527,27 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    // Encode 8x8 macroblocks
    {
       static const unsigned short fillBits[] = {0x7F, 7};
-      const unsigned char *imageData = (const unsigned char *)data;
       int DCY=0, DCU=0, DCV=0;
       int bitBuf=0, bitCnt=0;
       // comp == 2 is grey+alpha (alpha is ignored)
       int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
       int x, y, pos;
       for(y = 0; y < height; y += 8) {
+         // Pic: the rows of a block row are fetched once, as they may come from a row callback
+         const unsigned char *rows[8];
+         for(row = y; row < y+8; ++row) {
+            // row >= height => use last input row
+            int clamped_row = (row < height) ? row : height - 1;
+            rows[row-y] = stbiw__row(s, (void *) data, width, comp, stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row);
+         }
          for(x = 0; x < width; x += 8) {
             float YDU[64], UDU[64], VDU[64];
             for(row = y, pos = 0; row < y+8; ++row) {
-               // row >= height => use last input row
-               int clamped_row = (row < height) ? row : height - 1;
-               int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
+               const unsigned char *imageData = rows[row-y];
                for(col = x; col < x+8; ++col, ++pos) {
                   float r, g, b;
                   // if col >= width => use pixel from last input column
-                  int p = base_p + ((col < width) ? col : (width-1))*comp;
+                  int p = ((col < width) ? col : (width-1))*comp;
 
                   r = imageData[p+0];
                   g = imageData[p+ofsG];
@@ -1518,6 +1582,15 @@ STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x,
    return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
 }
 
+STBIWDEF int stbi_write_jpg_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *row, void *row_context, int quality)
+{
+   stbi__write_context s;
+   stbi__start_write_callbacks(&s, func, context);
+   s.row = row;
+   s.row_context = row_context;
+   return stbi_write_jpg_core(&s, x, y, comp, NULL, quality);
+}
+
 
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void *data, int quality)
@@ -0,0 +1,205 @@
+#include <Pic/Deflate.hpp>
+#include <Pic/Image.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+using namespace stick;
+using namespace pic;
+
+// a photo like image, smooth gradients with a bit of noise
+static ImageRGBA8 makeTestImage(Size _width, Size _height)
+{
+    ImageRGBA8 ret(_width, _height);
+    UInt32 state = 1;
+    for (Size y = 0; y < _height; ++y)
+    {
+        for (Size x = 0; x < _width; ++x)
+        {
+            state = state * 1664525 + 1013904223;
+            UInt8 noise = (UInt8)(state >> 29);
+            ret.pixel(x, y) = PixelRGBA8((UInt8)(x * 255 / _width) + noise,
+                                         (UInt8)(y * 255 / _height),
+                                         (UInt8)(128 + 127 * std::sin(x * 0.05 + y * 0.02)),
+                                         255);
+        }
+    }
+    return ret;
+}
+
+static double secondsSince(std::chrono::high_resolution_clock::time_point _start)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - _start)
+        .count();
+}
+
+static void benchmarkPNG(const ImageRGBA8 & _img)
+{
+    const Size iterations = 2;
+    const char * names[] = { "pic", "stb" };
+    DeflateImplementation impls[] = { DeflateImplementation::Pic, DeflateImplementation::STB };
+
+    printf("png encode %lux%lu rgba8\n", (unsigned long)_img.width(), (unsigned long)_img.height());
+    printf("%-6s %-6s %10s %10s\n", "impl", "level", "MB/s", "ratio");
+    ByteArray out;
+    out.reserve(_img.byteCount() * 2);
+    for (Int32 level = 1; level <= 9; ++level)
+    {
+        for (Size i = 0; i < 2; ++i)
+        {
+            SaveSettings settings;
+            settings.pngCompressionLevel = level;
+            settings.pngDeflate = impls[i];
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (Size j = 0; j < iterations; ++j)
+            {
+                out.clear();
+                Error err = encodeImage(_img, ImageFormat::PNG, out, settings);
+                if (err)
+                {
+                    printf("encoding failed: %s\n", err.message().cString());
+                    return;
+                }
+            }
+            double seconds = secondsSince(start);
+            printf("%-6s %-6d %10.1f %10.3f\n",
+                   names[i],
+                   level,
+                   _img.byteCount() * iterations / seconds / (1024.0 * 1024.0),
+                   (double)_img.byteCount() / out.count());
+        }
+    }
+}
+
+static void benchmarkParallelPNG(const ImageRGBA8 & _img)
+{
+    printf("parallel png encode %lux%lu rgba8, level 6\n",
+           (unsigned long)_img.width(),
+           (unsigned long)_img.height());
+    printf("%-8s %10s %10s\n", "threads", "MB/s", "ratio");
+    ByteArray out;
+    out.reserve(_img.byteCount() * 2);
+    for (Size threadCount : { 1, 2, 4, 8 })
+    {
+        SaveSettings settings;
+        settings.pngCompressionLevel = 6;
+        settings.pngThreadCount = threadCount;
+
+        out.clear();
+        auto start = std::chrono::high_resolution_clock::now();
+        Error err = encodeImage(_img, ImageFormat::PNG, out, settings);
+        double seconds = secondsSince(start);
+        if (err)
+        {
+            printf("encoding failed: %s\n", err.message().cString());
+            return;
+        }
+        printf("%-8lu %10.1f %10.3f\n",
+               (unsigned long)threadCount,
+               _img.byteCount() / seconds / (1024.0 * 1024.0),
+               (double)_img.byteCount() / out.count());
+    }
+}
+
+static void benchmarkJPEGScale(const ImageRGBA8 & _img)
+{
+    ByteArray jpg;
+    if (encodeImage(_img, ImageFormat::JPEG, jpg))
+        return;
+
+    printf("jpeg decode %lux%lu\n", (unsigned long)_img.width(), (unsigned long)_img.height());
+    printf("%-6s %10s\n", "scale", "ms");
+    for (UInt32 denominator : { 1, 2, 4, 8 })
+    {
+        DecodeSettings settings;
+        settings.jpegScaleDenominator = denominator;
+        auto start = std::chrono::high_resolution_clock::now();
+        auto res = decodeImage(jpg, settings);
+        double seconds = secondsSince(start);
+        if (!res)
+        {
+            printf("decoding failed: %s\n", res.error().message().cString());
+            return;
+        }
+        printf("1/%-4u %10.1f\n", denominator, seconds * 1000.0);
+    }
+}
+
+// feeds the data at about _megabytesPerSecond, like a download, and compares the time to the first
+// row and to the whole image with decoding once everything arrived
+static void benchmarkPushDecoder(const ImageRGBA8 & _img, double _megabytesPerSecond)
+{
+    const Size chunkByteCount = 16 * 1024;
+    auto chunkTime = std::chrono::duration<double>(chunkByteCount / (_megabytesPerSecond * 1e6));
+    printf("push decode %lux%lu at %.0f MB/s\n",
+           (unsigned long)_img.width(),
+           (unsigned long)_img.height(),
+           _megabytesPerSecond);
+    printf("%-6s %12s %12s %12s\n", "format", "first row", "pushed", "after");
+    for (ImageFormat format : { ImageFormat::PNG, ImageFormat::JPEG })
+    {
+        ByteArray data;
+        if (encodeImage(_img, format, data))
+            return;
+
+        PushDecoder dec;
+        double firstRow = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (Size i = 0; i < data.count(); i += chunkByteCount)
+        {
+            std::this_thread::sleep_for(chunkTime);
+            dec.feed(&data[i], std::min(chunkByteCount, data.count() - i));
+            if (!firstRow && dec.rowsAvailable())
+                firstRow = secondsSince(start);
+        }
+        double transfer = secondsSince(start);
+        auto res = dec.finish();
+        double pushed = secondsSince(start);
+        if (!res)
+        {
+            printf("decoding failed: %s\n", res.error().message().cString());
+            return;
+        }
+
+        auto decodeStart = std::chrono::high_resolution_clock::now();
+        decodeImage(data);
+        double after = transfer + secondsSince(decodeStart);
+        printf("%-6s %10.1fms %10.1fms %10.1fms\n",
+               format == ImageFormat::PNG ? "png" : "jpeg",
+               firstRow * 1000.0,
+               pushed * 1000.0,
+               after * 1000.0);
+    }
+}
+
+static void benchmarkChecksums()
+{
+    const Size byteCount = 64 * 1024 * 1024;
+    ByteArray data(byteCount);
+    for (Size i = 0; i < byteCount; ++i)
+        data[i] = (char)(i * 2654435761u >> 24);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    UInt32 crc = crc32(0, &data[0], byteCount);
+    double crcSeconds = secondsSince(start);
+
+    start = std::chrono::high_resolution_clock::now();
+    UInt32 adler = adler32(1, &data[0], byteCount);
+    double adlerSeconds = secondsSince(start);
+
+    printf("crc32   %10.1f MB/s (%08x)\n", byteCount / crcSeconds / (1024.0 * 1024.0), crc);
+    printf("adler32 %10.1f MB/s (%08x)\n", byteCount / adlerSeconds / (1024.0 * 1024.0), adler);
+}
+
+int main()
+{
+    benchmarkPNG(makeTestImage(1024, 1024));
+    benchmarkParallelPNG(makeTestImage(4096, 4096));
+    benchmarkJPEGScale(makeTestImage(4096, 4096));
+    benchmarkPushDecoder(makeTestImage(2048, 2048), 20.0);
+    benchmarkChecksums();
+    return 0;
+}
@@ -1,11 +1,96 @@
+#include <Pic/Deflate.hpp>
 #include <Pic/Image.hpp>
 #include <Stick/Test.hpp>
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <thread>
 
 using namespace stick;
 using namespace pic;
 
+// simple allocator that keeps track of how many allocations are alive
+class CountingAllocator : public Allocator
+{
+  public:
+    CountingAllocator() : allocationCount(0), liveAllocationCount(0)
+    {
+    }
+
+    Block allocate(Size _byteCount, Size _alignment) override
+    {
+        ++allocationCount;
+        ++liveAllocationCount;
+        return defaultAllocator().allocate(_byteCount, _alignment);
+    }
+
+    void deallocate(const Block & _block) override
+    {
+        --liveAllocationCount;
+        defaultAllocator().deallocate(_block);
+    }
+
+    Size allocationCount;
+    Size liveAllocationCount;
+};
+
+// serves a buffer in small chunks, like a pipe would
+class ChunkedReader : public Reader
+{
+  public:
+    ChunkedReader(const ByteArray & _data, Size _chunkSize) :
+        data(_data),
+        chunkSize(_chunkSize),
+        position(0)
+    {
+    }
+
+    Size read(char * _buffer, Size _byteCount) override
+    {
+        Size n = std::min(std::min(_byteCount, chunkSize), data.count() - position);
+        std::copy(data.begin() + position, data.begin() + position + n, _buffer);
+        position += n;
+        return n;
+    }
+
+    void skip(Size _byteCount) override
+    {
+        position = std::min(position + _byteCount, data.count());
+    }
+
+    bool isAtEnd() const override
+    {
+        return position == data.count();
+    }
+
+    const ByteArray & data;
+    Size chunkSize;
+    Size position;
+};
+
+// collects the written data and fails once a limit is reached
+class ByteArrayWriter : public Writer
+{
+  public:
+    ByteArrayWriter(Size _limit = -1) : limit(_limit), writeCount(0)
+    {
+    }
+
+    Error write(const char * _data, Size _byteCount) override
+    {
+        if (data.count() + _byteCount > limit)
+            return Error(ec::InvalidOperation, "Writer is full", STICK_FILE, STICK_LINE);
+        data.insert(data.end(), _data, _data + _byteCount);
+        ++writeCount;
+        return Error();
+    }
+
+    ByteArray data;
+    Size limit;
+    Size writeCount;
+};
+
 const Suite spec[] =
 {
     SUITE("Pixel Tests")
@@ -377,6 +462,1467 @@ const Suite spec[] =
         EXPECT(img.pixel(1, 1) == PixelBGRA8(0, 0, 255, 255));
 #endif
     },
+    SUITE("Decode Allocator Tests")
+    {
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+
+        CountingAllocator alloc;
+        {
+            auto res = decodeImage(file.get(), alloc);
+            EXPECT(res);
+            EXPECT(&res.get()->allocator() == &alloc);
+            EXPECT(res.get()->width() == 2);
+            EXPECT(res.get()->height() == 2);
+            // stb's temporary buffers are gone, only the image and its pixels are left
+            EXPECT(alloc.allocationCount > 2);
+            EXPECT(alloc.liveAllocationCount == 2);
+        }
+        EXPECT(alloc.liveAllocationCount == 0);
+
+        auto bad = decodeImage(file.get().begin(), 8, alloc);
+        EXPECT(!bad);
+        EXPECT(alloc.liveAllocationCount == 0);
+    },
+    SUITE("Probe Image Tests")
+    {
+        EXPECT(!probeImage("I DO NOT EXIST"));
+
+        auto res = probeImage("../../Tests/TestFiles/test01.png");
+        EXPECT(res);
+        EXPECT(res.get().width == 2);
+        EXPECT(res.get().height == 2);
+        EXPECT(res.get().channelCount == 4);
+        EXPECT(!res.get().is16Bit);
+        EXPECT(!res.get().isHDR);
+
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+        auto res2 = probeImage(file.get());
+        EXPECT(res2);
+        EXPECT(res2.get().width == 2);
+        EXPECT(res2.get().height == 2);
+
+        auto img = decodeImage(file.get());
+        EXPECT(img);
+        EXPECT(img.get()->pixelTypeID() == res2.get().pixelTypeID);
+    },
+    SUITE("16 Bit Decode Tests")
+    {
+        auto info = probeImage("../../Tests/TestFiles/test16.png");
+        EXPECT(info);
+        EXPECT(info.get().is16Bit);
+        EXPECT(info.get().pixelTypeID == ImageRGB16::pixelTID);
+
+        auto res = loadImage("../../Tests/TestFiles/test16.png");
+        EXPECT(res);
+        EXPECT(res.get()->pixelTypeID() == ImageRGB16::pixelTID);
+        EXPECT(res.get()->bitsPerChannel() == 16);
+
+        const ImageRGB16 & img = static_cast<const ImageRGB16 &>(*res.get());
+        EXPECT(img.pixel(0, 0) == PixelRGB16(0, 1000, 65535));
+        EXPECT(img.pixel(1, 0) == PixelRGB16(300, 40000, 7));
+        EXPECT(img.pixel(0, 1) == PixelRGB16(12345, 2, 3));
+        EXPECT(img.pixel(1, 1) == PixelRGB16(65000, 500, 60000));
+
+        auto file = loadBinaryFile("../../Tests/TestFiles/test16.png");
+        EXPECT(file);
+        auto res2 = decodeImage(file.get());
+        EXPECT(res2);
+        EXPECT(res2.get()->pixelTypeID() == ImageRGB16::pixelTID);
+        const ImageRGB16 & img2 = static_cast<const ImageRGB16 &>(*res2.get());
+        EXPECT(img2.pixel(1, 1) == PixelRGB16(65000, 500, 60000));
+    },
+    SUITE("HDR Tests")
+    {
+        float pixels[12] = {
+            0.0f, 0.5f, 1.0f, 2.0f, 4.0f, 8.0f, 100.0f, 0.25f, 0.125f, 1.5f, 1.5f, 1.5f
+        };
+        ImageRGB32f a(2, 2, pixels);
+        String path("../../Tests/TestFiles/saveTest.hdr");
+        Error err = a.save(path);
+        EXPECT(!err);
+
+        auto info = probeImage(path);
+        EXPECT(info);
+        EXPECT(info.get().isHDR);
+        EXPECT(info.get().pixelTypeID == ImageRGB32f::pixelTID);
+
+        auto res = loadImage(path);
+        EXPECT(res);
+        EXPECT(res.get()->pixelTypeID() == ImageRGB32f::pixelTID);
+        const ImageRGB32f & img = static_cast<const ImageRGB32f &>(*res.get());
+        // rgbe has a shared 8 bit exponent, so we compare relative to the largest channel
+        for (Size i = 0; i < 4; ++i)
+        {
+            const PixelRGB32f & p = img.pixel(i % 2, i / 2);
+            float maxChannel =
+                std::max(pixels[i * 3], std::max(pixels[i * 3 + 1], pixels[i * 3 + 2]));
+            EXPECT(std::abs(p.r - pixels[i * 3]) <= maxChannel * 0.01f);
+            EXPECT(std::abs(p.g - pixels[i * 3 + 1]) <= maxChannel * 0.01f);
+            EXPECT(std::abs(p.b - pixels[i * 3 + 2]) <= maxChannel * 0.01f);
+        }
+        remove(path.cString());
+
+#ifdef PIC_IMPLEMENTATION_STB
+        // 8 bit images can't be written as hdr and vice versa
+        ImageGray8 b(2, 2);
+        EXPECT(b.save(path));
+        EXPECT(a.save("../../Tests/TestFiles/saveTest3.png"));
+#endif // PIC_IMPLEMENTATION_STB
+    },
+    SUITE("Typed Decode Tests")
+    {
+        auto res = loadImageAs<ImageBGRA8>("../../Tests/TestFiles/test01.png");
+        EXPECT(res);
+        const ImageBGRA8 & img = res.get();
+        EXPECT(img.width() == 2);
+        EXPECT(img.height() == 2);
+
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+        auto res2 = decodeImageAs<ImageARGB8>(file.get());
+        EXPECT(res2);
+
+        EXPECT(!loadImageAs<ImageRGBA8>("I DO NOT EXIST"));
+
+//@TODO: FreeImage hands us the rows bottom up
+#ifdef PIC_IMPLEMENTATION_STB
+        EXPECT(img.pixel(0, 0) == PixelBGRA8(255, 255, 255, 0));
+        EXPECT(img.pixel(1, 0) == PixelBGRA8(0, 0, 255, 255));
+        EXPECT(img.pixel(0, 1) == PixelBGRA8(0, 0, 0, 255));
+        EXPECT(img.pixel(1, 1) == PixelBGRA8(0, 255, 0, 255));
+        EXPECT(res2.get().pixel(1, 1) == PixelARGB8(255, 0, 255, 0));
+
+        // channel count and bit depth conversions
+        auto res3 = decodeImageAs<ImageRGB8>(file.get());
+        EXPECT(res3);
+        EXPECT(res3.get().pixel(1, 1) == PixelRGB8(0, 255, 0));
+
+        auto res4 = decodeImageAs<ImageRGBA16>(file.get());
+        EXPECT(res4);
+        EXPECT(res4.get().pixel(1, 0) == PixelRGBA16(65535, 0, 0, 65535));
+
+        auto res5 = loadImageAs<ImageBGR8>("../../Tests/TestFiles/test16.png");
+        EXPECT(res5);
+        EXPECT(res5.get().pixel(1, 1) == PixelBGR8(234, 1, 253));
+#endif // PIC_IMPLEMENTATION_STB
+
+        // stb reorders the channels of jpegs while color converting them, and of pngs while
+        // converting their channel count, the result has to be the same as reordering afterwards
+        ImageRGB8 gradient(37, 23);
+        for (Size y = 0; y < gradient.height(); ++y)
+            for (Size x = 0; x < gradient.width(); ++x)
+                gradient.pixel(x, y) = PixelRGB8(x * 6, y * 11, (x * y) % 256);
+        ByteArray jpg, png;
+        EXPECT(!encodeImage(gradient, ImageFormat::JPEG, jpg));
+        EXPECT(!encodeImage(gradient, ImageFormat::PNG, png));
+        for (const ByteArray * data : { &jpg, &png })
+        {
+            auto rgba = decodeImageAs<ImageRGBA8>(*data);
+            auto bgra = decodeImageAs<ImageBGRA8>(*data);
+            auto argb = decodeImageAs<ImageARGB8>(*data);
+            auto bgr = decodeImageAs<ImageBGR8>(*data);
+            auto abgr16 = decodeImageAs<ImageABGR16>(*data);
+            EXPECT(rgba && bgra && argb && bgr && abgr16);
+            bool same = true;
+            for (Size y = 0; y < gradient.height(); ++y)
+            {
+                for (Size x = 0; x < gradient.width(); ++x)
+                {
+                    PixelRGBA8 p = rgba.get().pixel(x, y);
+                    PixelABGR16 p16 = abgr16.get().pixel(x, y);
+                    same = same && bgra.get().pixel(x, y) == PixelBGRA8(p.b, p.g, p.r, p.a) &&
+                           argb.get().pixel(x, y) == PixelARGB8(p.a, p.r, p.g, p.b) &&
+                           bgr.get().pixel(x, y) == PixelBGR8(p.b, p.g, p.r) &&
+                           p16.a == p.a * 257 && p16.b == p.b * 257 && p16.g == p.g * 257 &&
+                           p16.r == p.r * 257;
+                }
+            }
+            EXPECT(same);
+        }
+    },
+    SUITE("Decode Into Tests")
+    {
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+
+        CountingAllocator alloc;
+        ImageRGBA8 img(alloc);
+        Error err = decodeInto(img, file.get());
+        EXPECT(!err);
+        EXPECT(img.width() == 2);
+        EXPECT(img.height() == 2);
+        EXPECT(alloc.liveAllocationCount == 1);
+
+        // decoding a same sized image again reuses the existing storage
+        const char * storage = img.bytePtr();
+        err = decodeInto(img, file.get());
+        EXPECT(!err);
+        EXPECT(img.bytePtr() == storage);
+        EXPECT(alloc.liveAllocationCount == 1);
+
+        // a smaller image fits into the existing storage, too
+        ImageRGBA8 small(1, 1);
+        small.pixel(0, 0) = PixelRGBA8(1, 2, 3, 4);
+        String path("../../Tests/TestFiles/decodeIntoTest.png");
+        EXPECT(!small.save(path));
+        err = loadInto(img, path);
+        EXPECT(!err);
+        EXPECT(img.width() == 1);
+        EXPECT(img.height() == 1);
+        EXPECT(img.bytePtr() == storage);
+        EXPECT(img.pixel(0, 0) == PixelRGBA8(1, 2, 3, 4));
+        remove(path.cString());
+
+        EXPECT(decodeInto(img, file.get().begin(), 8));
+    },
+    SUITE("Stream Decode Tests")
+    {
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+        ChunkedReader reader(file.get(), 7);
+        auto res = decodeImage(reader);
+        EXPECT(res);
+        EXPECT(res.get()->width() == 2);
+        EXPECT(res.get()->height() == 2);
+        EXPECT(res.get()->channelLayoutTypeID() == ImageRGBA8::channelLayoutTID);
+        EXPECT(reader.isAtEnd());
+
+        auto file16 = loadBinaryFile("../../Tests/TestFiles/test16.png");
+        EXPECT(file16);
+        ChunkedReader reader16(file16.get(), 3);
+        ImageRGB16 img16;
+        EXPECT(!decodeInto(img16, reader16));
+        EXPECT(img16.pixel(0, 0) == PixelRGB16(0, 1000, 65535));
+        EXPECT(img16.pixel(1, 1) == PixelRGB16(65000, 500, 60000));
+
+        // images that are bigger than the header that is read up front
+        ImageRGB8 big(64, 64);
+        for (Size y = 0; y < big.height(); ++y)
+            for (Size x = 0; x < big.width(); ++x)
+                big.pixel(x, y) = PixelRGB8(x * 4, y * 4, (x * y) % 256);
+        for (const char * path : { "../../Tests/TestFiles/streamTest.png",
+                                   "../../Tests/TestFiles/streamTest.jpg" })
+        {
+            EXPECT(!big.save(path));
+            auto bigFile = loadBinaryFile(path);
+            EXPECT(bigFile);
+            auto expected = decodeImageAs<ImageRGB8>(bigFile.get());
+            EXPECT(expected);
+
+            ChunkedReader bigReader(bigFile.get(), 100);
+            ImageRGB8 img;
+            EXPECT(!decodeInto(img, bigReader));
+            EXPECT(img.width() == 64);
+            EXPECT(img.height() == 64);
+            EXPECT(std::equal(img.bytePtr(),
+                              img.bytePtr() + img.byteCount(),
+                              expected.get().bytePtr()));
+            remove(path);
+        }
+
+        ByteArray empty;
+        ChunkedReader emptyReader(empty, 16);
+        EXPECT(!decodeImage(emptyReader));
+    },
+    SUITE("Batch Decode Tests")
+    {
+        auto png = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        auto png16 = loadBinaryFile("../../Tests/TestFiles/test16.png");
+        EXPECT(png);
+        EXPECT(png16);
+
+        DynamicArray<ByteArray> batch;
+        for (Size i = 0; i < 32; ++i)
+            batch.append(i % 3 == 2 ? png16.get() : png.get());
+        batch.append(ByteArray());
+
+        CountingAllocator allocs[4];
+        Allocator * workerAllocs[4] = { &allocs[0], &allocs[1], &allocs[2], &allocs[3] };
+        DecodeImagesSettings settings;
+        settings.workerCount = 4;
+        settings.workerAllocators = workerAllocs;
+
+        DynamicArray<DecodedImage> results;
+        EXPECT(!decodeImages(batch.begin(), batch.count(), results, settings));
+        EXPECT(results.count() == 33);
+        for (Size i = 0; i < 32; ++i)
+        {
+            EXPECT(!results[i].error);
+            EXPECT(results[i].image);
+            EXPECT(results[i].image->pixelTypeID() ==
+                   (i % 3 == 2 ? ImageRGB16::pixelTID : ImageRGBA8::pixelTID));
+            Allocator * alloc = &results[i].image->allocator();
+            EXPECT(std::find(workerAllocs, workerAllocs + 4, alloc) != workerAllocs + 4);
+        }
+        EXPECT(results[32].error);
+        EXPECT(!results[32].image);
+
+        results.clear();
+        for (CountingAllocator & alloc : allocs)
+            EXPECT(alloc.liveAllocationCount == 0);
+
+        // default settings
+        EXPECT(!decodeImages(batch.begin(), 2, results));
+        EXPECT(results.count() == 2);
+        EXPECT(results[1].image->width() == 2);
+
+        // without worker allocators the temporary buffers come from an arena per worker, which
+        // is reused and grown from image to image
+        ImageRGB8 gradient(97, 61);
+        for (Size y = 0; y < gradient.height(); ++y)
+            for (Size x = 0; x < gradient.width(); ++x)
+                gradient.pixel(x, y) = PixelRGB8(x * 2, y * 4, (x * y) % 256);
+        ByteArray jpg;
+        EXPECT(!encodeImage(gradient, ImageFormat::JPEG, jpg));
+        batch.append(jpg);
+        for (Size i = 0; i < 16; ++i)
+        {
+            ByteArray data = batch[i % 3 == 0 ? batch.count() - 1 : i];
+            batch.append(data);
+        }
+        settings.workerAllocators = nullptr;
+        EXPECT(!decodeImages(batch.begin(), batch.count(), results, settings));
+        EXPECT(results.count() == batch.count());
+        for (Size i = 0; i < batch.count(); ++i)
+        {
+            if (batch[i].isEmpty())
+                continue;
+            auto expected = decodeImage(batch[i]);
+            EXPECT(expected);
+            EXPECT(results[i].image);
+            EXPECT(results[i].image->byteCount() == expected.get()->byteCount());
+            EXPECT(std::equal(expected.get()->bytePtr(),
+                              expected.get()->bytePtr() + expected.get()->byteCount(),
+                              results[i].image->bytePtr()));
+        }
+    },
+    SUITE("Batch Load Tests")
+    {
+        DynamicArray<String> paths;
+        for (Size i = 0; i < 40; ++i)
+            paths.append(i % 4 == 3 ? "../../Tests/TestFiles/test16.png"
+                                    : "../../Tests/TestFiles/test01.png");
+        paths.append("../../Tests/TestFiles/doesNotExist.png");
+        String emptyPath("../../Tests/TestFiles/batchLoadEmpty.png");
+        FILE * empty = fopen(emptyPath.cString(), "wb");
+        EXPECT(empty);
+        if (empty)
+            fclose(empty);
+        paths.append(emptyPath);
+        paths.append("../../Tests/TestFiles/test02.gif");
+
+        auto expected = loadImage("../../Tests/TestFiles/test01.png");
+        EXPECT(expected);
+
+        // io_uring where available and the pread threads, with one and many reads in flight
+        for (bool forceThreads : { false, true })
+        {
+            for (Size readsInFlight : { 1, 4, 64 })
+            {
+                LoadImagesSettings settings;
+                settings.readsInFlight = readsInFlight;
+                settings.workerCount = 3;
+                settings.forceThreadedReads = forceThreads;
+                DynamicArray<DecodedImage> results;
+                EXPECT(!loadImages(paths.begin(), paths.count(), results, settings));
+                EXPECT(results.count() == 43);
+                for (Size i = 0; i < 40; ++i)
+                {
+                    EXPECT(!results[i].error);
+                    EXPECT(results[i].image);
+                    EXPECT(results[i].image->pixelTypeID() ==
+                           (i % 4 == 3 ? ImageRGB16::pixelTID : ImageRGBA8::pixelTID));
+                }
+                EXPECT(!memcmp(results[0].image->bytePtr(),
+                               expected.get()->bytePtr(),
+                               expected.get()->byteCount()));
+                EXPECT(results[40].error);
+                EXPECT(results[41].error);
+                EXPECT(!results[42].error);
+                EXPECT(results[42].image);
+            }
+        }
+        remove(emptyPath.cString());
+
+        // per worker allocators and decode settings, with fewer read threads than reads in flight
+        {
+            CountingAllocator allocs[3];
+            Allocator * workerAllocs[3] = { &allocs[0], &allocs[1], &allocs[2] };
+            for (bool forceThreads : { false, true })
+            {
+                LoadImagesSettings settings;
+                settings.workerCount = 3;
+                settings.workerAllocators = workerAllocs;
+                settings.decodeSettings.channelCount = 3;
+                settings.readThreadCount = 2;
+                settings.forceThreadedReads = forceThreads;
+                DynamicArray<DecodedImage> results;
+                EXPECT(!loadImages(paths.begin(), 40, results, settings));
+                for (Size i = 0; i < 40; ++i)
+                {
+                    EXPECT(results[i].image);
+                    EXPECT(results[i].image->pixelTypeID() ==
+                           (i % 4 == 3 ? ImageRGB16::pixelTID : ImageRGB8::pixelTID));
+                    Allocator * alloc = &results[i].image->allocator();
+                    EXPECT(std::find(workerAllocs, workerAllocs + 3, alloc) != workerAllocs + 3);
+                }
+            }
+            for (CountingAllocator & alloc : allocs)
+                EXPECT(alloc.liveAllocationCount == 0);
+        }
+
+        DynamicArray<DecodedImage> results;
+        LoadImagesSettings settings;
+        settings.readsInFlight = 0;
+        EXPECT(loadImages(paths.begin(), paths.count(), results, settings));
+        CountingAllocator alloc;
+        Allocator * workerAllocs[1] = { &alloc };
+        settings.readsInFlight = 4;
+        settings.workerAllocators = workerAllocs;
+        EXPECT(loadImages(paths.begin(), paths.count(), results, settings));
+        EXPECT(!loadImages(paths.begin(), 0, results));
+        EXPECT(results.count() == 0);
+    },
+    SUITE("Animated Image Tests")
+    {
+        CountingAllocator alloc;
+        {
+            auto res = loadAnimatedImage("../../Tests/TestFiles/test02.gif", alloc);
+            EXPECT(res);
+            const AnimatedImage & anim = res.get();
+            EXPECT(anim.frames.width() == 2);
+            EXPECT(anim.frames.height() == 2);
+            EXPECT(anim.frames.depth() == 3);
+            EXPECT(&anim.frames.allocator() == &alloc);
+            EXPECT(anim.delays.count() == 3);
+            EXPECT(anim.delays[0] == 100);
+            EXPECT(anim.delays[1] == 200);
+            EXPECT(anim.delays[2] == 300);
+
+            EXPECT(anim.frames.pixel(0, 0, 0) == PixelRGBA8(255, 0, 0, 255));
+            EXPECT(anim.frames.pixel(1, 0, 0) == PixelRGBA8(0, 255, 0, 255));
+            EXPECT(anim.frames.pixel(0, 1, 0) == PixelRGBA8(0, 0, 255, 255));
+            EXPECT(anim.frames.pixel(1, 1, 0) == PixelRGBA8(255, 255, 255, 255));
+            EXPECT(anim.frames.pixel(0, 0, 1) == PixelRGBA8(255, 255, 255, 255));
+            EXPECT(anim.frames.pixel(1, 1, 1) == PixelRGBA8(255, 0, 0, 255));
+            EXPECT(anim.frames.pixel(0, 0, 2) == PixelRGBA8(0, 255, 0, 255));
+            EXPECT(anim.frames.pixel(1, 1, 2) == PixelRGBA8(0, 255, 0, 255));
+        }
+        EXPECT(alloc.liveAllocationCount == 0);
+
+        auto png = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(png);
+        EXPECT(!decodeAnimatedImage(png.get()));
+    },
+    SUITE("Decode Settings Tests")
+    {
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+
+        DecodeSettings settings;
+        settings.flipVertically = true;
+        settings.channelCount = 3;
+        auto res = decodeImage(file.get(), settings);
+        EXPECT(res);
+        EXPECT(res.get()->channelCount() == 3);
+        auto unflipped = decodeImage(file.get());
+        EXPECT(unflipped);
+        EXPECT(unflipped.get()->channelCount() == 4);
+
+#ifdef PIC_IMPLEMENTATION_STB
+        const ImageRGB8 & img = static_cast<const ImageRGB8 &>(*res.get());
+        EXPECT(img.pixel(0, 0) == PixelRGB8(0, 0, 0));
+        EXPECT(img.pixel(1, 0) == PixelRGB8(0, 255, 0));
+        EXPECT(img.pixel(0, 1) == PixelRGB8(255, 255, 255));
+        EXPECT(img.pixel(1, 1) == PixelRGB8(255, 0, 0));
+
+        // the settings of the previous call don't stick
+        const ImageRGBA8 & img2 = static_cast<const ImageRGBA8 &>(*unflipped.get());
+        EXPECT(img2.pixel(1, 0) == PixelRGBA8(255, 0, 0, 255));
+#endif // PIC_IMPLEMENTATION_STB
+
+        // jpegs are flipped while decoding, the rows have to be the same as the unflipped ones
+        ImageRGB8 gradient(37, 23);
+        for (Size y = 0; y < gradient.height(); ++y)
+            for (Size x = 0; x < gradient.width(); ++x)
+                gradient.pixel(x, y) = PixelRGB8(x * 6, y * 11, (x * y) % 256);
+        ByteArray jpg;
+        EXPECT(!encodeImage(gradient, ImageFormat::JPEG, jpg));
+        for (UInt32 channelCount : { 0, 1, 4 })
+        {
+            settings = DecodeSettings();
+            settings.channelCount = channelCount;
+            auto upright = decodeImage(jpg, settings);
+            settings.flipVertically = true;
+            auto flipped = decodeImage(jpg, settings);
+            EXPECT(upright && flipped);
+            const Image & a = *upright.get();
+            const Image & b = *flipped.get();
+            bool same = a.width() == b.width() && a.height() == b.height();
+            for (Size y = 0; same && y < a.height(); ++y)
+                same = !memcmp(a.bytePtr() + y * a.bytesPerRow(),
+                               b.bytePtr() + (b.height() - 1 - y) * b.bytesPerRow(),
+                               a.width() * a.bytesPerPixel());
+            EXPECT(same);
+        }
+
+        settings = DecodeSettings();
+        settings.channelCount = 5;
+        EXPECT(!loadImage("../../Tests/TestFiles/test01.png", settings));
+    },
+    SUITE("JPEG Scale Tests")
+    {
+        ImageRGB8 img(203, 101);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGB8(x, y * 2, (x + y) / 2);
+
+        // the stb jpeg writer subsamples the chroma below quality 90
+        for (UInt32 quality : { 95, 80 })
+        {
+            SaveSettings saveSettings;
+            saveSettings.jpegQuality = quality;
+            ByteArray jpg;
+            EXPECT(!encodeImage(img, ImageFormat::JPEG, jpg, saveSettings));
+            auto full = decodeImage(jpg);
+            EXPECT(full);
+            const ImageRGB8 & fullImg = static_cast<const ImageRGB8 &>(*full.get());
+
+            for (UInt32 denominator : { 2, 4, 8 })
+            {
+                DecodeSettings settings;
+                settings.jpegScaleDenominator = denominator;
+                auto res = decodeImage(jpg, settings);
+#ifdef PIC_IMPLEMENTATION_STB
+                EXPECT(res);
+                const ImageRGB8 & scaled = static_cast<const ImageRGB8 &>(*res.get());
+                EXPECT(scaled.width() == (203 + denominator - 1) / denominator);
+                EXPECT(scaled.height() == (101 + denominator - 1) / denominator);
+
+                // every pixel is about the average of the block it was scaled down from
+                bool isClose = true;
+                for (Size y = 0; y < scaled.height(); ++y)
+                {
+                    for (Size x = 0; x < scaled.width(); ++x)
+                    {
+                        Int32 sum[3] = { 0, 0, 0 };
+                        Int32 count = 0;
+                        for (Size by = y * denominator;
+                             by < std::min((y + 1) * denominator, fullImg.height());
+                             ++by)
+                        {
+                            for (Size bx = x * denominator;
+                                 bx < std::min((x + 1) * denominator, fullImg.width());
+                                 ++bx)
+                            {
+                                for (Size c = 0; c < 3; ++c)
+                                    sum[c] += fullImg.pixel(bx, by).channel(c);
+                                ++count;
+                            }
+                        }
+                        for (Size c = 0; c < 3; ++c)
+                            isClose = isClose &&
+                                      abs(sum[c] / count - scaled.pixel(x, y).channel(c)) <= 8;
+                    }
+                }
+                EXPECT(isClose);
+#else
+                EXPECT(!res);
+#endif // PIC_IMPLEMENTATION_STB
+            }
+        }
+
+        // probing still reports the full size, and the scale only applies to jpegs
+        ByteArray jpg, png;
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, jpg));
+        EXPECT(!encodeImage(img, ImageFormat::PNG, png));
+        DecodeSettings settings;
+        settings.jpegScaleDenominator = 8;
+        auto scaledPNG = decodeImage(png, settings);
+        EXPECT(scaledPNG);
+        EXPECT(scaledPNG.get()->width() == 203);
+        auto info = probeImage(jpg);
+        EXPECT(info);
+        EXPECT(info.get().width == 203);
+        EXPECT(info.get().height == 101);
+
+        settings.jpegScaleDenominator = 3;
+        EXPECT(!decodeImage(jpg, settings));
+    },
+    SUITE("Decode Region Tests")
+    {
+        // the region has to match the same pixels of the fully decoded image
+        auto matchesCrop = [](const ByteArray & _data, Size _left, Size _top, Size _w, Size _h) {
+            auto full = decodeImage(_data);
+            auto region = decodeRegion(_data, _left, _top, _w, _h);
+            if (!full || !region)
+                return false;
+            const Image & a = *full.get();
+            const Image & b = *region.get();
+            if (b.width() != _w || b.height() != _h || b.pixelTypeID() != a.pixelTypeID())
+                return false;
+            for (Size y = 0; y < _h; ++y)
+            {
+                if (memcmp(b.bytePtr() + y * b.bytesPerRow(),
+                           a.bytePtr() + (_top + y) * a.bytesPerRow() + _left * a.bytesPerPixel(),
+                           _w * b.bytesPerPixel()))
+                    return false;
+            }
+            return true;
+        };
+
+        ImageRGBA8 img(300, 200);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA8(x % 251, (y * 3) % 256, (x * y) % 13, x > y ? 255 : 0);
+        ImageGray8 gray(150, 77);
+        for (Size y = 0; y < gray.height(); ++y)
+            for (Size x = 0; x < gray.width(); ++x)
+                gray.pixel(x, y) = PixelGray8((x * 7 + y * 3) % 256);
+
+        ByteArray png, bmp, tga, jpg, grayJPG;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, png));
+        EXPECT(!encodeImage(img, ImageFormat::BMP, bmp));
+        EXPECT(!encodeImage(img, ImageFormat::TGA, tga));
+        EXPECT(!encodeImage(gray, ImageFormat::JPEG, grayJPG));
+        for (const ByteArray * data : { &png, &bmp, &tga })
+        {
+            EXPECT(matchesCrop(*data, 10, 20, 50, 30));
+            EXPECT(matchesCrop(*data, 0, 0, 300, 1));
+            EXPECT(matchesCrop(*data, 299, 0, 1, 200));
+        }
+
+        // jpegs keep one more MCU around the region, so the chroma upsampling is the same
+        for (UInt32 quality : { 95, 80 })
+        {
+            SaveSettings settings;
+            settings.jpegQuality = quality;
+            jpg.clear();
+            EXPECT(!encodeImage(img, ImageFormat::JPEG, jpg, settings));
+            EXPECT(matchesCrop(jpg, 37, 45, 61, 70));
+            EXPECT(matchesCrop(jpg, 0, 0, 16, 16));
+            EXPECT(matchesCrop(jpg, 250, 150, 50, 50));
+            EXPECT(matchesCrop(jpg, 0, 0, 300, 200));
+        }
+        EXPECT(matchesCrop(grayJPG, 8, 60, 100, 17));
+
+        auto gif = loadBinaryFile("../../Tests/TestFiles/test02.gif");
+        EXPECT(gif);
+        EXPECT(matchesCrop(gif.get(), 1, 0, 1, 2));
+
+        EXPECT(!decodeRegion(png, 0, 0, 0, 10));
+        EXPECT(!decodeRegion(png, 290, 0, 11, 10));
+        EXPECT(!decodeRegion(jpg, 0, 190, 10, 11));
+    },
+    SUITE("Push Decoder Tests")
+    {
+        // feeds the data in small chunks, the result has to be the same as decodeImage's
+        auto decodesLikeDecodeImage = [](const ByteArray & _data) {
+            PushDecoder dec;
+            for (Size i = 0; i < _data.count(); i += 100)
+            {
+                if (dec.feed(&_data[i], std::min((Size)100, _data.count() - i)))
+                    return false;
+            }
+            auto pushed = dec.finish();
+            auto expected = decodeImage(_data);
+            if (!pushed || !expected)
+                return false;
+            const Image & a = *pushed.get();
+            const Image & b = *expected.get();
+            if (a.pixelTypeID() != b.pixelTypeID() || a.width() != b.width() ||
+                a.height() != b.height() || dec.rowsAvailable() != a.height())
+                return false;
+            for (Size y = 0; y < a.height(); ++y)
+            {
+                if (memcmp(a.bytePtr() + y * a.bytesPerRow(),
+                           b.bytePtr() + y * b.bytesPerRow(),
+                           a.width() * a.bytesPerPixel()))
+                    return false;
+            }
+            return true;
+        };
+
+        // waits for the worker while the rest of the data is held back
+        auto waitForRows = [](const PushDecoder & _dec, Size _rowCount) {
+            auto start = std::chrono::steady_clock::now();
+            while (_dec.rowsAvailable() < _rowCount &&
+                   std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return _dec.rowsAvailable() >= _rowCount;
+        };
+
+        ImageRGBA8 img(256, 256);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA8(x % 251, (y * 3) % 256, (x * y) % 13, x > y ? 255 : 0);
+        ImageGray8 gray(150, 77);
+        for (Size y = 0; y < gray.height(); ++y)
+            for (Size x = 0; x < gray.width(); ++x)
+                gray.pixel(x, y) = PixelGray8((x * 7 + y * 3) % 256);
+
+        ByteArray png, bmp, tga, jpg, grayJPG;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, png));
+        EXPECT(!encodeImage(img, ImageFormat::BMP, bmp));
+        EXPECT(!encodeImage(img, ImageFormat::TGA, tga));
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, jpg));
+        EXPECT(!encodeImage(gray, ImageFormat::JPEG, grayJPG));
+        for (const ByteArray * data : { &png, &bmp, &tga, &jpg, &grayJPG })
+            EXPECT(decodesLikeDecodeImage(*data));
+
+        // StreamDecoder can't decode gifs, they are decoded once all data is in
+        auto gif = loadBinaryFile("../../Tests/TestFiles/test02.gif");
+        EXPECT(gif);
+        EXPECT(decodesLikeDecodeImage(gif.get()));
+
+        // the rows are available before the end of the data arrives
+        for (const ByteArray * data : { &png, &jpg })
+        {
+            PushDecoder dec;
+            EXPECT(!dec.image());
+            EXPECT(!dec.feed(&(*data)[0], data->count() - 16));
+            EXPECT(waitForRows(dec, 128));
+            EXPECT(dec.image() && dec.image()->width() == 256);
+            EXPECT(!dec.feed(&(*data)[data->count() - 16], 16));
+            auto res = dec.finish();
+            EXPECT(res && res.get()->height() == 256);
+            EXPECT(dec.feed(&(*data)[0], 1));
+            EXPECT(!dec.finish());
+        }
+
+        // truncated data fails once finish marks the end
+        for (const ByteArray * data : { &png, &jpg })
+        {
+            PushDecoder dec;
+            EXPECT(!dec.feed(&(*data)[0], data->count() / 2));
+            EXPECT(!dec.finish());
+        }
+        {
+            PushDecoder dec;
+            EXPECT(!dec.finish());
+        }
+
+        // destroying the decoder before finish stops the worker
+        {
+            PushDecoder dec;
+            EXPECT(!dec.feed(&png[0], png.count() / 2));
+        }
+        {
+            PushDecoder dec;
+            EXPECT(!dec.feed(&jpg[0], jpg.count() / 2));
+        }
+    },
+    SUITE("Encode Image Tests")
+    {
+        ImageRGBA8 img(2, 2);
+        img.pixel(0, 0) = PixelRGBA8(255, 0, 0, 255);
+        img.pixel(1, 0) = PixelRGBA8(0, 255, 0, 128);
+        img.pixel(0, 1) = PixelRGBA8(0, 0, 255, 0);
+        img.pixel(1, 1) = PixelRGBA8(10, 20, 30, 40);
+
+        ByteArray out;
+        out.reserve(4096);
+        const char * storage = &*out.begin();
+        EXPECT(!encodeImage(img, ImageFormat::PNG, out));
+        EXPECT(out.count() > 8);
+        EXPECT(&*out.begin() == storage);
+        EXPECT(out[1] == 'P' && out[2] == 'N' && out[3] == 'G');
+
+        auto res = decodeImageAs<ImageRGBA8>(out);
+        EXPECT(res);
+        EXPECT(res.get().pixel(1, 0) == PixelRGBA8(0, 255, 0, 128));
+        EXPECT(res.get().pixel(1, 1) == PixelRGBA8(10, 20, 30, 40));
+
+        // encoded data is appended
+        Size pngByteCount = out.count();
+        EXPECT(!encodeImage(img, ImageFormat::TGA, out));
+        EXPECT(out.count() > pngByteCount);
+        EXPECT(&*out.begin() == storage);
+        auto res2 =
+            decodeImageAs<ImageRGBA8>(out.begin() + pngByteCount, out.count() - pngByteCount);
+        EXPECT(res2);
+        EXPECT(res2.get().pixel(0, 1) == PixelRGBA8(0, 0, 255, 0));
+
+        out.clear();
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, out));
+        EXPECT(decodeImage(out));
+        out.clear();
+        EXPECT(!encodeImage(img, ImageFormat::BMP, out));
+        EXPECT(decodeImage(out));
+
+        // failures leave the output untouched
+        out.clear();
+        EXPECT(encodeImage(img, ImageFormat::HDR, out));
+        EXPECT(out.count() == 0);
+    },
+    SUITE("Save Settings Tests")
+    {
+        ImageRGB8 img(64, 64);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGB8(x < 32 ? 255 : 0, (x * y) % 256, 0);
+
+        SaveSettings settings;
+        ByteArray rle, raw;
+        EXPECT(!encodeImage(img, ImageFormat::TGA, rle, settings));
+        settings.tgaRLE = false;
+        EXPECT(!encodeImage(img, ImageFormat::TGA, raw, settings));
+        EXPECT(raw.count() > rle.count());
+
+        ByteArray low, high;
+        settings.jpegQuality = 10;
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, low, settings));
+        settings.jpegQuality = 100;
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, high, settings));
+        EXPECT(high.count() > low.count());
+
+        ByteArray unfiltered;
+        settings.pngFilter = 0;
+        settings.pngCompressionLevel = 1;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, unfiltered, settings));
+        auto res = decodeImageAs<ImageRGB8>(unfiltered);
+        EXPECT(res);
+        EXPECT(res.get().pixel(40, 50) == img.pixel(40, 50));
+
+        // settings of a previous call don't carry over
+        ByteArray rle2;
+        EXPECT(!encodeImage(img, ImageFormat::TGA, rle2));
+        EXPECT(rle2.count() == rle.count());
+    },
+    SUITE("Deflate Tests")
+    {
+        EXPECT(crc32(0, "123456789", 9) == 0xCBF43926);
+        EXPECT(adler32(1, "Wikipedia", 9) == 0x11E60398);
+
+        // the simd paths kick in for longer inputs, crc32 and adler32 can be continued
+        ByteArray bytes(100000);
+        UInt32 state = 1;
+        for (Size i = 0; i < bytes.count(); ++i)
+        {
+            state = state * 1664525 + 1013904223;
+            bytes[i] = (char)(state >> 24);
+        }
+        for (Size len : { 63, 64, 65, 127, 1000, 5552, 5553, 100000 })
+        {
+            UInt32 crc = 0, adler = 1;
+            for (Size i = 0; i < len; ++i)
+            {
+                crc = crc32(crc, &bytes[i], 1);
+                adler = adler32(adler, &bytes[i], 1);
+            }
+            EXPECT(crc32(0, &bytes[0], len) == crc);
+            EXPECT(adler32(1, &bytes[0], len) == adler);
+        }
+
+        // bigger than a block and a mix of noise and repetition
+        ImageRGB8 img(300, 200);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = y < 100 ? PixelRGB8(x / 8, y, 7)
+                                          : PixelRGB8(bytes[y * 300 + x], bytes[x], 3);
+
+        SaveSettings settings;
+        for (DeflateImplementation impl :
+             { DeflateImplementation::Pic, DeflateImplementation::STB })
+        {
+            settings.pngDeflate = impl;
+            Size previousCount = 0;
+            for (Int32 level = 0; level <= 9; ++level)
+            {
+                settings.pngCompressionLevel = level;
+                ByteArray png;
+                EXPECT(!encodeImage(img, ImageFormat::PNG, png, settings));
+                auto res = decodeImageAs<ImageRGB8>(png);
+                EXPECT(res);
+                EXPECT(memcmp(res.get().bytePtr(), img.bytePtr(), img.byteCount()) == 0);
+                if (impl == DeflateImplementation::Pic && level == 1)
+                    EXPECT(png.count() < previousCount);
+                previousCount = png.count();
+            }
+        }
+
+        // empty and tiny inputs
+        char out[128];
+        for (Int32 level : { 0, 6 })
+        {
+            Size count = zlibCompress("", 0, level, out);
+            EXPECT(count > 0);
+            ByteArray compressed(count);
+            memcpy(&compressed[0], out, count);
+            ChunkedReader reader(compressed, count);
+            Inflater inflater;
+            EXPECT(!inflater.begin(
+                [](void * _reader, const UInt8 ** _outData) -> Size {
+                    static char s_buffer[128];
+                    *_outData = (const UInt8 *)s_buffer;
+                    return static_cast<ChunkedReader *>(_reader)->read(s_buffer,
+                                                                       sizeof(s_buffer));
+                },
+                &reader));
+            char c;
+            auto res = inflater.read(&c, 1);
+            EXPECT(res && res.get() == 0 && inflater.isAtEnd());
+        }
+        EXPECT(zlibCompress("a", 1, 9, out) > 0);
+
+        UInt32 crcA = crc32(0, &bytes[0], 777);
+        UInt32 crcB = crc32(0, &bytes[777], 50000);
+        EXPECT(crc32Combine(crcA, crcB, 50000) == crc32(0, &bytes[0], 50777));
+        UInt32 adlerA = adler32(1, &bytes[0], 777);
+        UInt32 adlerB = adler32(1, &bytes[777], 70000);
+        EXPECT(adler32Combine(adlerA, adlerB, 70000) == adler32(1, &bytes[0], 70777));
+
+        // inflating in pieces, with the compressed data arriving in pieces, too
+        ByteArray compressed(zlibCompressBound(bytes.count()));
+        for (Int32 level : { 0, 1, 9 })
+        {
+            compressed.resize(zlibCompressBound(bytes.count()));
+            compressed.resize(zlibCompress(&bytes[0], bytes.count(), level, &compressed[0]));
+            ChunkedReader reader(compressed, 1000);
+            auto fill = [](void * _reader, const UInt8 ** _outData) -> Size {
+                static char s_buffer[1000];
+                *_outData = (const UInt8 *)s_buffer;
+                return static_cast<ChunkedReader *>(_reader)->read(s_buffer, sizeof(s_buffer));
+            };
+            Inflater inflater;
+            EXPECT(!inflater.begin(fill, &reader));
+            ByteArray inflated(bytes.count() + 1);
+            Size count = 0;
+            for (Size n = 1; count < inflated.count(); n = n * 3 + 1)
+            {
+                auto res = inflater.read(&inflated[count], std::min(n, inflated.count() - count));
+                EXPECT(res);
+                count += res.get();
+                if (res.get() < n)
+                    break;
+            }
+            EXPECT(count == bytes.count());
+            EXPECT(inflater.isAtEnd());
+            EXPECT(memcmp(&inflated[0], &bytes[0], count) == 0);
+        }
+
+        // a corrupt checksum is detected
+        compressed[compressed.count() - 1] ^= 1;
+        ChunkedReader reader(compressed, compressed.count());
+        Inflater inflater;
+        EXPECT(!inflater.begin(
+            [](void * _reader, const UInt8 ** _outData) -> Size {
+                ChunkedReader & r = *static_cast<ChunkedReader *>(_reader);
+                *_outData = (const UInt8 *)r.data.begin() + r.position;
+                Size n = r.data.count() - r.position;
+                r.position += n;
+                return n;
+            },
+            &reader));
+        ByteArray inflated(bytes.count() + 1);
+        EXPECT(!inflater.read(&inflated[0], inflated.count()));
+    },
+    SUITE("Parallel PNG Encode Tests")
+    {
+        // the crc of every chunk has to match
+        auto checkChunks = [](const ByteArray & _png) {
+            const UInt8 * p = (const UInt8 *)&_png[0] + 8;
+            const UInt8 * end = (const UInt8 *)&_png[0] + _png.count();
+            Size chunkCount = 0;
+            while (p + 12 <= end)
+            {
+                UInt32 len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+                const UInt8 * c = p + 8 + len;
+                UInt32 crc = ((UInt32)c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+                if (crc32(0, p + 4, len + 4) != crc)
+                    return false;
+                p = c + 4;
+                ++chunkCount;
+            }
+            return p == end && chunkCount == 3;
+        };
+
+        // big enough for several bands
+        ImageRGBA8 img(700, 500, 1, 12);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA8(x % 256, y % 256, (x * y) % 7, x < 350 ? 255 : 0);
+
+        SaveSettings settings;
+        ByteArray serial;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, serial, settings));
+
+        for (Size threadCount : { 0, 2, 5 })
+        {
+            settings.pngThreadCount = threadCount;
+            ByteArray png;
+            EXPECT(!encodeImage(img, ImageFormat::PNG, png, settings));
+            EXPECT(checkChunks(png));
+            // bands lose a little compression, but not much
+            EXPECT(png.count() < serial.count() * 11 / 10);
+
+            auto res = decodeImageAs<ImageRGBA8>(png);
+            EXPECT(res);
+            bool same = res.get().width() == img.width() && res.get().height() == img.height();
+            for (Size y = 0; same && y < img.height(); ++y)
+                for (Size x = 0; x < img.width(); ++x)
+                    same = same && res.get().pixel(x, y) == img.pixel(x, y);
+            EXPECT(same);
+        }
+
+        // more threads than rows and a forced filter
+        UInt8 smallPixels[6] = { 0, 10, 20, 30, 40, 200 };
+        ImageGray8 small(3, 2, smallPixels);
+        settings.pngThreadCount = 8;
+        settings.pngFilter = 2;
+        ByteArray png;
+        EXPECT(!encodeImage(small, ImageFormat::PNG, png, settings));
+        EXPECT(checkChunks(png));
+        auto res = decodeImageAs<ImageGray8>(png);
+        EXPECT(res);
+        EXPECT(res.get().pixel(2, 1).v == 200);
+        EXPECT(res.get().pixel(0, 0).v == 0);
+    },
+    SUITE("16 Bit PNG Encode Tests")
+    {
+        ImageRGB16 img(37, 21, 1, 10);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGB16(x * 1771, y * 3001, (x * y * 97) % 65536);
+
+        SaveSettings settings;
+        for (Size threadCount : { 1, 3 })
+        {
+            settings.pngThreadCount = threadCount;
+            ByteArray png;
+            EXPECT(!encodeImage(img, ImageFormat::PNG, png, settings));
+            auto info = probeImage(png);
+            EXPECT(info);
+            EXPECT(info.get().is16Bit);
+            EXPECT(info.get().channelCount == 3);
+
+            auto res = decodeImageAs<ImageRGB16>(png);
+            EXPECT(res);
+            bool same = res.get().width() == img.width() && res.get().height() == img.height();
+            for (Size y = 0; same && y < img.height(); ++y)
+                for (Size x = 0; x < img.width(); ++x)
+                    same = same && res.get().pixel(x, y) == img.pixel(x, y);
+            EXPECT(same);
+        }
+
+        // other channel orders are written as rgba
+        ImageBGRA16 bgra(3, 2);
+        bgra.pixel(2, 1) = PixelBGRA16(1, 2, 3, 4);
+        settings.pngThreadCount = 1;
+        String path("../../Tests/TestFiles/save16.png");
+        EXPECT(!bgra.save(path, settings));
+        auto rgba = loadImageAs<ImageRGBA16>(path);
+        EXPECT(rgba);
+        EXPECT(rgba.get().pixel(2, 1) == PixelRGBA16(3, 2, 1, 4));
+        remove(path.cString());
+
+        ImageAlphaGray8 alphaGray(2, 2);
+        alphaGray.pixel(1, 0) = PixelAlphaGray8(200, 50);
+        ByteArray png;
+        EXPECT(!encodeImage(alphaGray, ImageFormat::PNG, png, settings));
+        auto grayAlpha = decodeImageAs<ImageGrayAlpha8>(png);
+        EXPECT(grayAlpha);
+        EXPECT(grayAlpha.get().pixel(1, 0) == PixelGrayAlpha8(50, 200));
+
+        ImageGray32f floats(2, 2);
+        EXPECT(encodeImage(floats, ImageFormat::PNG, png, settings));
+    },
+    SUITE("Padded Encode Tests")
+    {
+        // padded images encode to the same bytes as unpadded ones
+        ImageRGB8 padded(19, 13, 1, 5);
+        ImageRGB8 packed(19, 13);
+        for (Size y = 0; y < padded.height(); ++y)
+        {
+            for (Size x = 0; x < padded.width(); ++x)
+            {
+                padded.pixel(x, y) = PixelRGB8(x * 13, y * 19, x < 8 ? 255 : 0);
+                packed.pixel(x, y) = padded.pixel(x, y);
+            }
+        }
+
+        SaveSettings settings;
+        for (bool rle : { true, false })
+        {
+            settings.tgaRLE = rle;
+            for (ImageFormat format : { ImageFormat::JPEG, ImageFormat::BMP, ImageFormat::TGA })
+            {
+                ByteArray a, b;
+                EXPECT(!encodeImage(padded, format, a, settings));
+                EXPECT(!encodeImage(packed, format, b, settings));
+                EXPECT(a.count() == b.count());
+                EXPECT(std::equal(a.begin(), a.end(), b.begin()));
+            }
+        }
+
+        String path("../../Tests/TestFiles/paddedSave.bmp");
+        EXPECT(!padded.save(path));
+        auto res = loadImageAs<ImageRGB8>(path);
+        EXPECT(res);
+        EXPECT(res.get().pixel(18, 12) == padded.pixel(18, 12));
+        EXPECT(res.get().pixel(3, 7) == padded.pixel(3, 7));
+        remove(path.cString());
+    },
+    SUITE("Stream Encoder Tests")
+    {
+        // rendered in bands of 37 rows, with row padding
+        ImageRGBA8 img(600, 400, 1, 24);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) =
+                    PixelRGBA8(x % 251, (y * 3) % 256, (x * y) % 13, x > y ? 255 : 100);
+
+        auto encodeInBands = [&](ImageFormat _format, const SaveSettings & _settings) {
+            ByteArrayWriter writer;
+            StreamEncoder enc;
+            EXPECT(!enc.begin<PixelRGBA8>(writer, _format, img.width(), img.height(), _settings));
+            for (Size y = 0; y < img.height(); y += 37)
+            {
+                Size count = std::min((Size)37, img.height() - y);
+                EXPECT(!enc.writeRows(&img.pixel(0, y), count, img.bytesPerRow()));
+            }
+            EXPECT(enc.rowsWritten() == img.height());
+            EXPECT(!enc.finish());
+            return writer.data;
+        };
+
+        auto matches = [&](const ByteArray & _data, bool _hasAlpha) {
+            DecodeSettings settings;
+            settings.channelCount = 4;
+            auto res = decodeImage(_data, settings);
+            if (!res || res.get()->width() != img.width() || res.get()->height() != img.height())
+                return false;
+            ImageRGBA8 & decoded = static_cast<ImageRGBA8 &>(*res.get());
+            for (Size y = 0; y < img.height(); ++y)
+            {
+                for (Size x = 0; x < img.width(); ++x)
+                {
+                    PixelRGBA8 a = decoded.pixel(x, y);
+                    PixelRGBA8 b = img.pixel(x, y);
+                    if (a.r != b.r || a.g != b.g || a.b != b.b || (_hasAlpha && a.a != b.a))
+                        return false;
+                }
+            }
+            return true;
+        };
+
+        SaveSettings settings;
+        ByteArray png = encodeInBands(ImageFormat::PNG, settings);
+        EXPECT(matches(png, true));
+        // about as small as encoding the whole image at once
+        ByteArray whole;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, whole, settings));
+        EXPECT(png.count() < whole.count() * 21 / 20);
+
+        EXPECT(matches(encodeInBands(ImageFormat::BMP, settings), false));
+        EXPECT(matches(encodeInBands(ImageFormat::TGA, settings), true));
+        settings.tgaRLE = false;
+        EXPECT(matches(encodeInBands(ImageFormat::TGA, settings), true));
+        EXPECT(matches(encodeInBands(ImageFormat::Pic, settings), true));
+
+        // 16 bit in another channel order, one row at a time
+        ImageBGR16 img16(5, 4);
+        for (Size y = 0; y < img16.height(); ++y)
+            for (Size x = 0; x < img16.width(); ++x)
+                img16.pixel(x, y) = PixelBGR16(x * 1000, y * 3000, 60000 + x);
+        ByteArrayWriter writer;
+        StreamEncoder enc;
+        EXPECT(!enc.begin<PixelBGR16>(writer, ImageFormat::PNG, 5, 4));
+        for (Size y = 0; y < img16.height(); ++y)
+            EXPECT(!enc.writeRows(&img16.pixel(0, y), 1, 0));
+        EXPECT(!enc.finish());
+        auto rgb16 = decodeImageAs<ImageRGB16>(writer.data);
+        EXPECT(rgb16);
+        EXPECT(rgb16.get().pixel(3, 2) == PixelRGB16(60003, 6000, 3000));
+
+        // misuse and failing writers are reported
+        EXPECT(enc.writeRows(&img16.pixel(0, 0), 1, 0));
+        EXPECT(enc.begin<PixelRGB32f>(writer, ImageFormat::PNG, 5, 4));
+        EXPECT(enc.begin<PixelRGB8>(writer, ImageFormat::JPEG, 5, 4));
+        EXPECT(!enc.begin<PixelBGR16>(writer, ImageFormat::PNG, 5, 4));
+        EXPECT(enc.writeRows(&img16.pixel(0, 0), 5, img16.bytesPerRow()));
+        EXPECT(!enc.begin<PixelBGR16>(writer, ImageFormat::PNG, 5, 4));
+        EXPECT(!enc.writeRows(&img16.pixel(0, 0), 3, img16.bytesPerRow()));
+        EXPECT(enc.finish());
+        ByteArrayWriter tooSmall(100);
+        EXPECT(enc.begin<PixelRGBA8>(tooSmall, ImageFormat::Pic, 2, 2));
+        ByteArrayWriter headerOnly(130);
+        EXPECT(!enc.begin<PixelRGBA8>(headerOnly, ImageFormat::Pic, 2, 2));
+        EXPECT(enc.writeRows(&img.pixel(0, 0), 2, img.bytesPerRow()));
+        EXPECT(enc.finish());
+    },
+    SUITE("Pic File Tests")
+    {
+        // padded rows survive a round trip through a file
+        ImageRGBA16 img(5, 3, 1, 6);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA16(x * 1000, y * 20000, 65535 - x, 7);
+
+        String path("../../Tests/TestFiles/picTest.pic");
+        EXPECT(!img.save(path));
+
+        auto info = probeImage(path);
+        EXPECT(info);
+        EXPECT(info.get().width == 5);
+        EXPECT(info.get().height == 3);
+        EXPECT(info.get().channelCount == 4);
+        EXPECT(info.get().is16Bit);
+        EXPECT(info.get().pixelTypeID == ImageRGBA16::pixelTID);
+
+        auto res = loadImageAs<ImageRGBA16>(path);
+        EXPECT(res);
+        EXPECT(res.get().rowPadding() == 6);
+        bool same = res.get().width() == 5 && res.get().height() == 3;
+        for (Size y = 0; same && y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                same = same && res.get().pixel(x, y) == img.pixel(x, y);
+        EXPECT(same);
+
+        DecodeSettings settings;
+        settings.flipVertically = true;
+        auto flipped = loadImage(path, settings);
+        EXPECT(flipped);
+        EXPECT(static_cast<ImageRGBA16 &>(*flipped.get()).pixel(3, 0) == img.pixel(3, 2));
+
+        // a different channel count is an error rather than a silent conversion
+        settings.flipVertically = false;
+        settings.channelCount = 3;
+        EXPECT(!loadImage(path, settings));
+        remove(path.cString());
+
+        // 3D volumes are kept as they are
+        ImageGray32f volume(4, 3, 5);
+        for (Size z = 0; z < volume.depth(); ++z)
+            for (Size y = 0; y < volume.height(); ++y)
+                for (Size x = 0; x < volume.width(); ++x)
+                    volume.pixel(x, y, z) = PixelGray32f(x + y * 10.0f + z * 100.0f);
+
+        ByteArray encoded;
+        EXPECT(!encodeImage(volume, ImageFormat::Pic, encoded));
+        EXPECT(encoded.count() == 128 + volume.byteCount());
+        auto decoded = decodeImageAs<ImageGray32f>(encoded);
+        EXPECT(decoded);
+        EXPECT(decoded.get().depth() == 5);
+        EXPECT(decoded.get().pixel(3, 2, 4).v == 423.0f);
+
+        String volumePath("../../Tests/TestFiles/picVolume.pic");
+        EXPECT(!volume.save(volumePath));
+        auto mapped = mapImage(volumePath, true);
+        EXPECT(mapped);
+        EXPECT(mapped.get().width() == 4);
+        EXPECT(mapped.get().height() == 3);
+        EXPECT(mapped.get().depth() == 5);
+        EXPECT(mapped.get().isFloatingPoint());
+        EXPECT(mapped.get().pixelTypeID() == ImageGray32f::pixelTID);
+        // the pixels start on a cache line so they can be used with aligned loads
+        EXPECT((reinterpret_cast<std::uintptr_t>(mapped.get().bytePtr()) & 63) == 0);
+        auto view = mapped.get().view<PixelGray32f>();
+        EXPECT(view.pixel(1, 2, 3).v == 321.0f);
+        auto layer = view.layer(2);
+        EXPECT(layer.depth() == 1);
+        EXPECT(layer.pixel(3, 1).v == 213.0f);
+
+        // moving keeps the mapping alive
+        MappedImage moved = std::move(mapped.get());
+        EXPECT(moved.view<PixelGray32f>().pixel(0, 0, 4).v == 400.0f);
+        remove(volumePath.cString());
+
+        // corrupt pixels fail the checksum
+        encoded[200] ^= 0x55;
+        EXPECT(!decodeImage(encoded));
+        auto probed = probeImage(&encoded[0], encoded.count());
+        EXPECT(probed);
+        EXPECT(probed.get().isHDR);
+
+        // headers with empty or wrapping sizes are rejected, width is at byte 40 followed by
+        // height, depth, row padding, data offset and byte count
+        auto corruptHeader = [&](UInt64 _width, UInt64 _height, UInt64 _byteCount) {
+            ByteArray ret = encoded;
+            UInt64 fields[] = { _width, _height, 1, 0, 128, _byteCount };
+            memcpy(&ret[40], fields, sizeof(fields));
+            return ret;
+        };
+        ByteArray zeroHeight = corruptHeader(4, 0, 0);
+        EXPECT(!decodeImage(zeroHeight));
+        EXPECT(!probeImage(&zeroHeight[0], zeroHeight.count()));
+        ByteArray wrapping = corruptHeader(UInt64(1) << 62, 1, 0);
+        EXPECT(!decodeImage(wrapping));
+        EXPECT(!probeImage(&wrapping[0], wrapping.count()));
+
+        // an image that can't be written leaves an existing file alone
+        EXPECT(!volume.save(volumePath));
+        EXPECT(ImageGray8().save(volumePath));
+        EXPECT(mapImage(volumePath, true));
+        remove(volumePath.cString());
+    },
+    SUITE("Stream Decoder Tests")
+    {
+        // decodes _data row by row and compares the rows to the ones decodeImage returns
+        auto matchesDecodeImage = [](const ByteArray & _data, Size _chunkSize, bool _isBottomUp) {
+            auto res = decodeImage(_data);
+            ChunkedReader reader(_data, _chunkSize);
+            StreamDecoder dec;
+            if (!res || dec.begin(reader))
+                return false;
+            const Image & img = *res.get();
+            const ImageInfo & info = dec.info();
+            if (info.width != img.width() || info.height != img.height() ||
+                info.pixelTypeID != img.pixelTypeID() ||
+                dec.nextRowIndex() != (_isBottomUp ? img.height() - 1 : 0))
+                return false;
+            bool same = true;
+            Size rowCount = 0;
+            Error err = dec.decodeRows([&](Size _y, const char * _row) {
+                same = same && !memcmp(_row,
+                                       img.bytePtr() + _y * img.bytesPerRow(),
+                                       img.width() * img.bytesPerPixel());
+                ++rowCount;
+            });
+            return !err && same && rowCount == img.height() && dec.rowsDecoded() == rowCount;
+        };
+
+        ImageRGBA8 img(300, 200);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA8(x % 251, (y * 3) % 256, (x * y) % 13, x > y ? 255 : 0);
+
+        ByteArray png, bmp, tga;
+        EXPECT(!encodeImage(img, ImageFormat::PNG, png));
+        EXPECT(!encodeImage(img, ImageFormat::BMP, bmp));
+        EXPECT(!encodeImage(img, ImageFormat::TGA, tga));
+        EXPECT(matchesDecodeImage(png, 13, false));
+        EXPECT(matchesDecodeImage(png, 100000, false));
+        EXPECT(matchesDecodeImage(bmp, 7, true));
+        EXPECT(matchesDecodeImage(tga, 7, true));
+
+        auto file = loadBinaryFile("../../Tests/TestFiles/test01.png");
+        EXPECT(file);
+        EXPECT(matchesDecodeImage(file.get(), 5, false));
+        auto file16 = loadBinaryFile("../../Tests/TestFiles/test16.png");
+        EXPECT(file16);
+        EXPECT(matchesDecodeImage(file16.get(), 3, false));
+
+        // binary pnms, 16 bit values are big endian
+        const char pgm[] = "P5\n# comment\n2 1\n65535\n\x12\x34\xff\x00";
+        ByteArray pnm;
+        pnm.insert(pnm.end(), pgm, pgm + sizeof(pgm) - 1);
+        ChunkedReader pnmReader(pnm, 2);
+        StreamDecoder dec;
+        EXPECT(!dec.begin(pnmReader));
+        EXPECT(dec.info().pixelTypeID == ImageGray16::pixelTID);
+        auto row = dec.nextRow();
+        EXPECT(row);
+        EXPECT(reinterpret_cast<const UInt16 *>(row.get())[0] == 0x1234);
+        EXPECT(reinterpret_cast<const UInt16 *>(row.get())[1] == 0xff00);
+        EXPECT(!dec.nextRow());
+
+        // .pic rows are returned as they are stored
+        ImageRGB32f hdr(3, 2);
+        hdr.pixel(2, 1) = PixelRGB32f(1.5f, 2.5f, 3.5f);
+        ByteArray pic;
+        EXPECT(!encodeImage(hdr, ImageFormat::Pic, pic));
+        ChunkedReader picReader(pic, 10);
+        EXPECT(!dec.begin(picReader));
+        EXPECT(dec.info().isHDR);
+        EXPECT(dec.nextRow());
+        row = dec.nextRow();
+        EXPECT(row);
+        EXPECT(reinterpret_cast<const PixelRGB32f *>(row.get())[2] == hdr.pixel(2, 1));
+
+        // corrupt and truncated data is reported
+        png[png.count() / 2] ^= 0x20;
+        ChunkedReader corruptReader(png, 100);
+        EXPECT(!dec.begin(corruptReader));
+        EXPECT(dec.decodeRows([](Size, const char *) {}));
+        ByteArray truncated;
+        truncated.insert(truncated.end(), bmp.begin(), bmp.begin() + bmp.count() / 2);
+        ChunkedReader truncatedReader(truncated, 100);
+        EXPECT(!dec.begin(truncatedReader));
+        EXPECT(dec.decodeRows([](Size, const char *) {}));
+        EXPECT(dec.rowsDecoded() < img.height());
+        pic[pic.count() - 1] ^= 0x55;
+        ChunkedReader picCorruptReader(pic, 10);
+        EXPECT(!dec.begin(picCorruptReader));
+        EXPECT(dec.decodeRows([](Size, const char *) {}));
+
+        // a .pic header without rows, the height is at byte 48
+        pic[pic.count() - 1] ^= 0x55;
+        UInt64 zero = 0;
+        memcpy(&pic[48], &zero, 8);
+        memcpy(&pic[80], &zero, 8);
+        ChunkedReader picEmptyReader(pic, 10);
+        EXPECT(dec.begin(picEmptyReader));
+        EXPECT(!decodeImage(pic));
+        EXPECT(!decodeRegion(pic, 0, 0, 1, 1));
+        PushDecoder pushDec;
+        pushDec.feed(&pic[0], pic.count());
+        EXPECT(!pushDec.finish());
+        ByteArray jpg;
+        EXPECT(!encodeImage(img, ImageFormat::JPEG, jpg));
+        ChunkedReader jpgReader(jpg, 100);
+        EXPECT(dec.begin(jpgReader));
+
+        // a plain 32 bit 4x2 bmp whose alpha is 0 everywhere, which decodeImage makes opaque
+        ByteArray bmp32(14 + 40 + 32);
+        memset(&bmp32[0], 0, bmp32.count());
+        auto putLE = [&](Size _offset, UInt32 _value, Size _byteCount) {
+            for (Size i = 0; i < _byteCount; ++i)
+                bmp32[_offset + i] = (char)(_value >> (i * 8));
+        };
+        bmp32[0] = 'B';
+        bmp32[1] = 'M';
+        putLE(2, (UInt32)bmp32.count(), 4);
+        putLE(10, 54, 4);
+        putLE(14, 40, 4);
+        putLE(18, 4, 4);
+        putLE(22, 2, 4);
+        putLE(26, 1, 2);
+        putLE(28, 32, 2);
+        for (Size i = 0; i < 8; ++i)
+            putLE(54 + i * 4, 0x00102030 + (UInt32)i, 4);
+        ChunkedReader bmp32Reader(bmp32, 10);
+        EXPECT(dec.begin(bmp32Reader));
+        auto isOpaque = [](const Result<ImageUniquePtr> & _res) {
+            if (!_res || _res.get()->pixelTypeID() != ImageRGBA8::pixelTID)
+                return false;
+            const ImageRGBA8 & img = static_cast<const ImageRGBA8 &>(*_res.get());
+            for (Size y = 0; y < img.height(); ++y)
+                for (Size x = 0; x < img.width(); ++x)
+                    if (img.pixel(x, y).a != 255)
+                        return false;
+            return true;
+        };
+        EXPECT(isOpaque(decodeImage(bmp32)));
+        EXPECT(isOpaque(decodeRegion(bmp32, 1, 0, 2, 2)));
+        PushDecoder bmp32Pushed;
+        EXPECT(!bmp32Pushed.feed(&bmp32[0], bmp32.count()));
+        EXPECT(isOpaque(bmp32Pushed.finish()));
+
+        // truecolor pngs may carry a suggested palette, it is inserted right behind IHDR
+        ImageRGB8 rgb(5, 4);
+        for (Size y = 0; y < rgb.height(); ++y)
+            for (Size x = 0; x < rgb.width(); ++x)
+                rgb.pixel(x, y) = PixelRGB8(x * 40, y * 60, 9);
+        ByteArray rgbPNG;
+        EXPECT(!encodeImage(rgb, ImageFormat::PNG, rgbPNG));
+        const char plte[] = { 0, 0, 0, 3, 'P', 'L', 'T', 'E', 1, 2, 3 };
+        UInt32 plteCRC = crc32(0, plte + 4, 7);
+        char plteChunk[15];
+        memcpy(plteChunk, plte, 11);
+        for (Size i = 0; i < 4; ++i)
+            plteChunk[11 + i] = (char)(plteCRC >> ((3 - i) * 8));
+        ByteArray plteRGBPNG;
+        plteRGBPNG.insert(plteRGBPNG.end(), rgbPNG.begin(), rgbPNG.begin() + 33);
+        plteRGBPNG.insert(plteRGBPNG.end(), plteChunk, plteChunk + 15);
+        plteRGBPNG.insert(plteRGBPNG.end(), rgbPNG.begin() + 33, rgbPNG.end());
+        EXPECT(matchesDecodeImage(plteRGBPNG, 7, false));
+        auto rgbRegion = decodeRegion(plteRGBPNG, 1, 1, 3, 2);
+        EXPECT(rgbRegion);
+        EXPECT(static_cast<ImageRGB8 &>(*rgbRegion.get()).pixel(2, 1) == rgb.pixel(3, 2));
+    },
     SUITE("Image Save Tests")
     {
         //TODO: Test more image formats.
@@ -429,7 +1975,88 @@ const Suite spec[] =
         EXPECT(abs(100 - img2.pixel(1, 1).b) <= 5);
         EXPECT(abs(110 - img2.pixel(1, 1).g) <= 5);
         EXPECT(abs(120 - img2.pixel(1, 1).r) <= 5);
+
+        // images that can't be written in the format leave an existing file alone
+        ImageRGB32f floats(2, 2);
+        EXPECT(floats.save(path2));
+        ImageRGB16 sixteen(2, 2);
+        EXPECT(sixteen.save(path2));
+        res = loadImage(path2);
+        EXPECT(res);
+        EXPECT(res && res.get()->width() == 2);
         remove(path2.cString());
+    },
+    SUITE("Async Image IO Tests")
+    {
+        ImageIOPoolSettings settings;
+        settings.threadCount = 2;
+        ImageIOPool pool(settings);
+        EXPECT(pool.threadCount() == 2);
+        EXPECT(pool.maxQueueDepth() == 256);
+
+        ImageRGBA8 img(64, 32);
+        for (Size y = 0; y < img.height(); ++y)
+            for (Size x = 0; x < img.width(); ++x)
+                img.pixel(x, y) = PixelRGBA8(x * 4, y * 8, x ^ y, 255);
+
+        String path("../../Tests/TestFiles/asyncSaveTest.png");
+        std::atomic<bool> saved(false);
+        auto save = saveAsync(
+            img, path, [&](const Error & _err) { saved = !_err; }, SaveSettings(), pool);
+        EXPECT(save);
+        EXPECT(!save.get().wait());
+        EXPECT(save.get().isDone());
+        EXPECT(saved);
+
+        ImageUniquePtr loaded;
+        auto load = loadImageAsync(
+            path,
+            [&](Result<ImageUniquePtr> _res) {
+                if (_res)
+                    loaded = std::move(_res.get());
+            },
+            DecodeSettings(),
+            pool);
+        EXPECT(load);
+        EXPECT(!load.get().wait());
+        EXPECT(loaded && loaded->width() == 64 && loaded->height() == 32);
+        EXPECT(loaded && !memcmp(loaded->bytePtr(), img.bytePtr(), img.byteCount()));
+        remove(path.cString());
+
+        // errors are passed to the callback and returned by wait
+        bool failed = false;
+        load = loadImageAsync("../../Tests/TestFiles/doesNotExist.png",
+                              [&](Result<ImageUniquePtr> _res) { failed = !_res; },
+                              DecodeSettings(),
+                              pool);
+        EXPECT(load);
+        EXPECT(load.get().wait());
+        EXPECT(failed);
+        EXPECT(ImageIOTask().wait());
+
+        // submitting fails once the queue is full
+        ImageIOPoolSettings smallSettings;
+        smallSettings.threadCount = 1;
+        smallSettings.maxQueueDepth = 1;
+        ImageIOPool smallPool(smallSettings);
+        std::atomic<bool> release(false);
+        auto blocking = smallPool.submit([&]() {
+            while (!release)
+                std::this_thread::yield();
+            return Error();
+        });
+        EXPECT(blocking);
+        while (smallPool.queueDepth())
+            std::this_thread::yield();
+        auto queued = smallPool.submit([]() { return Error(); });
+        EXPECT(queued);
+        EXPECT(smallPool.queueDepth() == 1);
+        EXPECT(!smallPool.submit([]() { return Error(); }));
+        EXPECT(!queued.get().isDone());
+        release = true;
+        EXPECT(!queued.get().wait());
+        EXPECT(blocking.get().isDone());
+        EXPECT(smallPool.queueDepth() == 0);
     }
 };
 